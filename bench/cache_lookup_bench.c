@@ -0,0 +1,101 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "cache.h"
+
+#define DEFAULT_LOOKUPS 2000000
+#define URL_LEN 64
+
+static const size_t ENTRY_COUNTS[] = {1000, 100000, 1000000};
+
+static double nowSec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t nextRandom(uint64_t *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+static int runCase(size_t entries, size_t lookups)
+{
+    int result = -1;
+    int isNew = 0;
+    char *urls = malloc(entries * URL_LEN);
+    CacheManagerT *cache = CacheManagerT_new(0, StorageHeap);
+
+    if (urls == NULL || cache == NULL)
+    {
+        fprintf(stderr, "Allocation failed\n");
+        goto cleanup;
+    }
+
+    for (size_t i = 0; i < entries; i++)
+    {
+        char *url = urls + i * URL_LEN;
+        snprintf(url, URL_LEN, "http://bench.example.com/objects/%zu.bin", i);
+
+        CacheEntryT *entry = CacheManagerT_acquire_CacheEntryT(cache, url, &isNew);
+        if (entry == NULL)
+        {
+            fprintf(stderr, "Insert failed at %zu\n", i);
+            goto cleanup;
+        }
+        CacheEntryT_release(entry);
+    }
+
+    uint64_t state = 0x9e3779b97f4a7c15ULL;
+    size_t hits = 0;
+    double start = nowSec();
+
+    for (size_t i = 0; i < lookups; i++)
+    {
+        const char *url = urls + (nextRandom(&state) % entries) * URL_LEN;
+        CacheEntryT *entry = CacheManagerT_acquire_CacheEntryT(cache, url, &isNew);
+        hits += (entry != NULL && !isNew);
+        CacheEntryT_release(entry);
+    }
+
+    double elapsed = nowSec() - start;
+
+    printf("entries=%zu lookups=%zu hits=%zu ns_per_lookup=%.1f\n",
+           entries, lookups, hits, elapsed * 1e9 / lookups);
+    result = 0;
+
+cleanup:
+    CacheManagerT_delete(cache);
+    free(urls);
+    return result;
+}
+
+int main(int argc, char **argv)
+{
+    size_t lookups = DEFAULT_LOOKUPS;
+
+    if (argc > 1)
+    {
+        lookups = strtoull(argv[1], NULL, 10);
+        if (lookups == 0)
+        {
+            fprintf(stderr, "Usage: %s [lookups]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    for (size_t i = 0; i < sizeof(ENTRY_COUNTS) / sizeof(ENTRY_COUNTS[0]); i++)
+    {
+        if (runCase(ENTRY_COUNTS[i], lookups) != 0)
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
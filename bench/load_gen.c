@@ -0,0 +1,702 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <math.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * HTTP load generator for the proxy. Each connection runs on its own
+ * thread and keeps one request in flight. In closed-loop mode the next
+ * request goes out as soon as the previous one completes; with -r the
+ * connections share a fixed arrival rate and latency is measured from
+ * the scheduled send time, so a stalled server is not under-reported.
+ *
+ * Requests target the origin stub's /obj/<bytes>/<tag> objects through
+ * the proxy. One JSON object is printed per run.
+ */
+
+#define DEFAULT_CONNECTIONS 16
+#define DEFAULT_DURATION_SEC 10.0
+#define READ_BUFFER_SIZE 65536
+#define REQUEST_MAX 1024
+#define INITIAL_SAMPLES 65536
+
+typedef enum Scenario
+{
+    ScenarioHit,
+    ScenarioMiss,
+    ScenarioFanout,
+    ScenarioLarge
+} ScenarioT;
+
+typedef struct ScenarioInfo
+{
+    const char *name;
+    size_t objectSize;
+    size_t objectCount;
+    int isWarmed;
+} ScenarioInfo;
+
+/* Hit and large runs fetch their objects once before timing starts. */
+static const ScenarioInfo SCENARIOS[] = {
+    [ScenarioHit] = {"hit", 16 * 1024, 1000, 1},
+    [ScenarioMiss] = {"miss", 16 * 1024, 0, 0},
+    [ScenarioFanout] = {"fanout", 1024 * 1024, 1, 0},
+    [ScenarioLarge] = {"large", 64 * 1024 * 1024, 4, 1},
+};
+
+typedef struct LoadConfig
+{
+    char proxyHost[64];
+    int proxyPort;
+    char originHost[64];
+    int originPort;
+    ScenarioT scenario;
+    int connections;
+    double durationSec;
+    double rate;
+    size_t objectSize;
+    size_t objectCount;
+    unsigned runId;
+} LoadConfig;
+
+typedef struct Worker
+{
+    pthread_t thread;
+    int index;
+    int socket;
+    char buffer[READ_BUFFER_SIZE];
+    size_t start;
+    size_t end;
+    uint64_t state;
+    uint64_t sequence;
+    uint32_t *samples;
+    size_t sampleCount;
+    size_t sampleCapacity;
+    uint64_t requests;
+    uint64_t errors;
+    uint64_t bytes;
+} Worker;
+
+static LoadConfig config;
+static double startTime;
+static double stopTime;
+
+static double nowSec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void sleepUntil(double when)
+{
+    struct timespec ts;
+    double whole = floor(when);
+
+    ts.tv_sec = (time_t)whole;
+    ts.tv_nsec = (long)((when - whole) * 1e9);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+    {
+    }
+}
+
+static uint64_t nextRandom(uint64_t *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+static int parseAddress(const char *text, char *host, size_t hostSize, int *port)
+{
+    const char *colon = strrchr(text, ':');
+    if (colon == NULL || (size_t)(colon - text) >= hostSize)
+    {
+        return -1;
+    }
+
+    memcpy(host, text, colon - text);
+    host[colon - text] = '\0';
+    *port = atoi(colon + 1);
+    return (*port > 0 && *port < 65536) ? 0 : -1;
+}
+
+static int connectProxy(void)
+{
+    int one = 1;
+    int sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    struct sockaddr_in address = {
+        .sin_family = AF_INET,
+        .sin_port = htons(config.proxyPort),
+    };
+
+    if (sock < 0)
+    {
+        return -1;
+    }
+
+    if (inet_pton(AF_INET, config.proxyHost, &address.sin_addr) != 1 ||
+        connect(sock, (struct sockaddr *)&address, sizeof(address)) != 0)
+    {
+        close(sock);
+        return -1;
+    }
+
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return sock;
+}
+
+static void formatPath(Worker *worker, char *path, size_t size)
+{
+    const ScenarioInfo *info = &SCENARIOS[config.scenario];
+
+    switch (config.scenario)
+    {
+    case ScenarioMiss:
+        snprintf(path, size, "/obj/%zu/%s-%u-%d-%llu", config.objectSize, info->name,
+                 config.runId, worker->index, (unsigned long long)worker->sequence++);
+        break;
+    case ScenarioFanout:
+        snprintf(path, size, "/obj/%zu/%s-%u", config.objectSize, info->name, config.runId);
+        break;
+    case ScenarioHit:
+    case ScenarioLarge:
+    default:
+        snprintf(path, size, "/obj/%zu/%s-%u-%llu", config.objectSize, info->name, config.runId,
+                 (unsigned long long)(nextRandom(&worker->state) % config.objectCount));
+        break;
+    }
+}
+
+static int sendRequest(Worker *worker, const char *path)
+{
+    char request[REQUEST_MAX];
+    int length = snprintf(request, sizeof(request),
+                          "GET http://%s:%d%s HTTP/1.1\r\nHost: %s:%d\r\n\r\n",
+                          config.originHost, config.originPort, path,
+                          config.originHost, config.originPort);
+    const char *data = request;
+
+    while (length > 0)
+    {
+        ssize_t n = send(worker->socket, data, length, MSG_NOSIGNAL);
+        if (n <= 0)
+        {
+            return -1;
+        }
+        data += n;
+        length -= n;
+    }
+    return 0;
+}
+
+static int fill(Worker *worker)
+{
+    if (worker->start == worker->end)
+    {
+        worker->start = 0;
+        worker->end = 0;
+    }
+    else if (worker->end == READ_BUFFER_SIZE)
+    {
+        memmove(worker->buffer, worker->buffer + worker->start, worker->end - worker->start);
+        worker->end -= worker->start;
+        worker->start = 0;
+    }
+
+    ssize_t n = recv(worker->socket, worker->buffer + worker->end, READ_BUFFER_SIZE - worker->end, 0);
+    if (n <= 0)
+    {
+        return -1;
+    }
+
+    worker->end += n;
+    worker->bytes += n;
+    return 0;
+}
+
+/* Returns the length of the next CRLF-terminated line, reading as needed. */
+static ssize_t nextLine(Worker *worker)
+{
+    while (1)
+    {
+        const char *data = worker->buffer + worker->start;
+        const char *lineEnd = memmem(data, worker->end - worker->start, "\r\n", 2);
+
+        if (lineEnd != NULL)
+        {
+            return lineEnd - data;
+        }
+        if (worker->start == 0 && worker->end == READ_BUFFER_SIZE)
+        {
+            return -1;
+        }
+        if (fill(worker) != 0)
+        {
+            return -1;
+        }
+    }
+}
+
+static int skipBytes(Worker *worker, size_t count)
+{
+    while (count > 0)
+    {
+        if (worker->start == worker->end && fill(worker) != 0)
+        {
+            return -1;
+        }
+
+        size_t available = worker->end - worker->start;
+        size_t taken = (available < count) ? available : count;
+        worker->start += taken;
+        count -= taken;
+    }
+    return 0;
+}
+
+static int skipChunkedBody(Worker *worker)
+{
+    while (1)
+    {
+        ssize_t length = nextLine(worker);
+        if (length < 0)
+        {
+            return -1;
+        }
+
+        size_t size = strtoul(worker->buffer + worker->start, NULL, 16);
+        worker->start += length + 2;
+
+        if (size == 0)
+        {
+            while ((length = nextLine(worker)) > 0)
+            {
+                worker->start += length + 2;
+            }
+            if (length < 0)
+            {
+                return -1;
+            }
+            worker->start += 2;
+            return 0;
+        }
+
+        if (skipBytes(worker, size + 2) != 0)
+        {
+            return -1;
+        }
+    }
+}
+
+/* The read buffer is not NUL-terminated, so searches stay within the line. */
+static int hasToken(const char *line, size_t length, const char *token)
+{
+    size_t tokenLength = strlen(token);
+
+    for (size_t i = 0; i + tokenLength <= length; i++)
+    {
+        if (strncasecmp(line + i, token, tokenLength) == 0)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Reads one response. Returns its status, or -1 when the connection broke.
+ * *isClosing is set when the connection cannot carry another request.
+ */
+static int readResponse(Worker *worker, int *isClosing)
+{
+    int status = 0;
+    long long contentLength = -1;
+    int isChunked = 0;
+    ssize_t length = nextLine(worker);
+
+    if (length < 12 || strncmp(worker->buffer + worker->start, "HTTP/1.", 7) != 0)
+    {
+        return -1;
+    }
+    status = atoi(worker->buffer + worker->start + 9);
+    *isClosing = worker->buffer[worker->start + 7] == '0';
+    worker->start += length + 2;
+
+    while ((length = nextLine(worker)) > 0)
+    {
+        const char *line = worker->buffer + worker->start;
+
+        if (strncasecmp(line, "Content-Length:", 15) == 0)
+        {
+            contentLength = strtoll(line + 15, NULL, 10);
+        }
+        else if (strncasecmp(line, "Transfer-Encoding:", 18) == 0)
+        {
+            isChunked = hasToken(line, length, "chunked");
+        }
+        else if (strncasecmp(line, "Connection:", 11) == 0)
+        {
+            *isClosing = hasToken(line, length, "close");
+        }
+        worker->start += length + 2;
+    }
+
+    if (length < 0)
+    {
+        return -1;
+    }
+    worker->start += 2;
+
+    if (isChunked)
+    {
+        return (skipChunkedBody(worker) == 0) ? status : -1;
+    }
+    if (contentLength >= 0)
+    {
+        return (skipBytes(worker, contentLength) == 0) ? status : -1;
+    }
+
+    while (fill(worker) == 0)
+    {
+        worker->start = worker->end;
+    }
+    *isClosing = 1;
+    return status;
+}
+
+static void recordSample(Worker *worker, double latency)
+{
+    if (worker->sampleCount == worker->sampleCapacity)
+    {
+        size_t capacity = (worker->sampleCapacity == 0) ? INITIAL_SAMPLES : worker->sampleCapacity * 2;
+        uint32_t *samples = realloc(worker->samples, capacity * sizeof(uint32_t));
+        if (samples == NULL)
+        {
+            return;
+        }
+        worker->samples = samples;
+        worker->sampleCapacity = capacity;
+    }
+
+    double micros = latency * 1e6;
+    worker->samples[worker->sampleCount++] = (micros < UINT32_MAX) ? (uint32_t)micros : UINT32_MAX;
+}
+
+static void resetConnection(Worker *worker)
+{
+    if (worker->socket >= 0)
+    {
+        close(worker->socket);
+    }
+    worker->socket = -1;
+    worker->start = 0;
+    worker->end = 0;
+}
+
+/* Performs one request; returns the HTTP status or -1. */
+static int exchange(Worker *worker, const char *path)
+{
+    int isClosing = 0;
+
+    if (worker->socket < 0)
+    {
+        worker->socket = connectProxy();
+        if (worker->socket < 0)
+        {
+            return -1;
+        }
+    }
+
+    int status = (sendRequest(worker, path) == 0) ? readResponse(worker, &isClosing) : -1;
+    if (status < 0 || isClosing)
+    {
+        resetConnection(worker);
+    }
+    return status;
+}
+
+static void *runWorker(void *arg)
+{
+    Worker *worker = arg;
+    char path[512];
+    double interval = (config.rate > 0) ? config.connections / config.rate : 0;
+    double scheduled = startTime + interval * worker->index / config.connections;
+
+    sleepUntil(startTime);
+
+    while (1)
+    {
+        if (interval > 0)
+        {
+            if (scheduled >= stopTime)
+            {
+                break;
+            }
+            sleepUntil(scheduled);
+        }
+
+        double sent = (interval > 0) ? scheduled : nowSec();
+        if (nowSec() >= stopTime)
+        {
+            break;
+        }
+
+        formatPath(worker, path, sizeof(path));
+        int status = exchange(worker, path);
+        double done = nowSec();
+
+        worker->requests++;
+        if (status != 200)
+        {
+            worker->errors++;
+        }
+        else
+        {
+            recordSample(worker, done - sent);
+        }
+
+        scheduled += interval;
+    }
+
+    resetConnection(worker);
+    return NULL;
+}
+
+static int warmUp(void)
+{
+    Worker *worker = calloc(1, sizeof(Worker));
+    char path[512];
+    int result = 0;
+
+    if (worker == NULL)
+    {
+        return -1;
+    }
+
+    worker->socket = -1;
+    for (size_t i = 0; i < config.objectCount && result == 0; i++)
+    {
+        snprintf(path, sizeof(path), "/obj/%zu/%s-%u-%zu", config.objectSize,
+                 SCENARIOS[config.scenario].name, config.runId, i);
+        if (exchange(worker, path) != 200)
+        {
+            result = -1;
+        }
+    }
+
+    resetConnection(worker);
+    free(worker);
+    return result;
+}
+
+static int compareSamples(const void *a, const void *b)
+{
+    uint32_t left = *(const uint32_t *)a;
+    uint32_t right = *(const uint32_t *)b;
+    return (left > right) - (left < right);
+}
+
+static uint32_t percentile(const uint32_t *samples, size_t count, double fraction)
+{
+    if (count == 0)
+    {
+        return 0;
+    }
+
+    size_t rank = (size_t)ceil(fraction * count);
+    return samples[(rank == 0) ? 0 : rank - 1];
+}
+
+static int report(Worker *workers, double elapsed)
+{
+    uint64_t requests = 0;
+    uint64_t errors = 0;
+    uint64_t bytes = 0;
+    size_t count = 0;
+
+    for (int i = 0; i < config.connections; i++)
+    {
+        requests += workers[i].requests;
+        errors += workers[i].errors;
+        bytes += workers[i].bytes;
+        count += workers[i].sampleCount;
+    }
+
+    uint32_t *samples = malloc((count > 0 ? count : 1) * sizeof(uint32_t));
+    if (samples == NULL)
+    {
+        return -1;
+    }
+
+    size_t offset = 0;
+    for (int i = 0; i < config.connections; i++)
+    {
+        memcpy(samples + offset, workers[i].samples, workers[i].sampleCount * sizeof(uint32_t));
+        offset += workers[i].sampleCount;
+    }
+    qsort(samples, count, sizeof(uint32_t), compareSamples);
+
+    printf("{\"scenario\":\"%s\",\"mode\":\"%s\",\"connections\":%d,\"rate\":%.0f,"
+           "\"object_bytes\":%zu,\"duration_sec\":%.3f,\"requests\":%llu,\"errors\":%llu,"
+           "\"throughput_rps\":%.1f,\"throughput_mib_s\":%.2f,"
+           "\"latency_us\":{\"p50\":%u,\"p99\":%u,\"p999\":%u,\"max\":%u}}\n",
+           SCENARIOS[config.scenario].name, (config.rate > 0) ? "open" : "closed",
+           config.connections, config.rate, config.objectSize, elapsed,
+           (unsigned long long)requests, (unsigned long long)errors,
+           (requests - errors) / elapsed, bytes / elapsed / (1024.0 * 1024.0),
+           percentile(samples, count, 0.50), percentile(samples, count, 0.99),
+           percentile(samples, count, 0.999), (count > 0) ? samples[count - 1] : 0);
+
+    free(samples);
+    return 0;
+}
+
+static int parseScenario(const char *name, ScenarioT *scenario)
+{
+    for (size_t i = 0; i < sizeof(SCENARIOS) / sizeof(SCENARIOS[0]); i++)
+    {
+        if (strcmp(name, SCENARIOS[i].name) == 0)
+        {
+            *scenario = (ScenarioT)i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static void printUsage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [-x proxy_host:port] [-o origin_host:port] [-s hit|miss|fanout|large]\n"
+            "          [-c connections] [-d seconds] [-r requests_per_sec] [-b object_bytes]\n"
+            "          [-n objects]\n"
+            "  -r  open loop at a fixed arrival rate; closed loop when omitted\n",
+            name);
+}
+
+int main(int argc, char **argv)
+{
+    int opt;
+    long long objectSize = -1;
+    long long objectCount = -1;
+
+    snprintf(config.proxyHost, sizeof(config.proxyHost), "127.0.0.1");
+    config.proxyPort = 18081;
+    snprintf(config.originHost, sizeof(config.originHost), "127.0.0.1");
+    config.originPort = 18080;
+    config.scenario = ScenarioHit;
+    config.connections = DEFAULT_CONNECTIONS;
+    config.durationSec = DEFAULT_DURATION_SEC;
+
+    while ((opt = getopt(argc, argv, "x:o:s:c:d:r:b:n:")) != -1)
+    {
+        int isValid = 1;
+
+        switch (opt)
+        {
+        case 'x':
+            isValid = parseAddress(optarg, config.proxyHost, sizeof(config.proxyHost),
+                                   &config.proxyPort) == 0;
+            break;
+        case 'o':
+            isValid = parseAddress(optarg, config.originHost, sizeof(config.originHost),
+                                   &config.originPort) == 0;
+            break;
+        case 's':
+            isValid = parseScenario(optarg, &config.scenario) == 0;
+            break;
+        case 'c':
+            config.connections = atoi(optarg);
+            isValid = config.connections > 0;
+            break;
+        case 'd':
+            config.durationSec = atof(optarg);
+            isValid = config.durationSec > 0;
+            break;
+        case 'r':
+            config.rate = atof(optarg);
+            isValid = config.rate >= 0;
+            break;
+        case 'b':
+            objectSize = atoll(optarg);
+            isValid = objectSize >= 0;
+            break;
+        case 'n':
+            objectCount = atoll(optarg);
+            isValid = objectCount > 0;
+            break;
+        default:
+            isValid = 0;
+            break;
+        }
+
+        if (!isValid)
+        {
+            printUsage(argv[0]);
+            return 1;
+        }
+    }
+
+    const ScenarioInfo *info = &SCENARIOS[config.scenario];
+    config.objectSize = (objectSize >= 0) ? (size_t)objectSize : info->objectSize;
+    config.objectCount = (objectCount > 0) ? (size_t)objectCount : info->objectCount;
+    config.runId = (unsigned)time(NULL) ^ ((unsigned)getpid() << 16);
+
+    signal(SIGPIPE, SIG_IGN);
+
+    if (info->isWarmed && warmUp() != 0)
+    {
+        fprintf(stderr, "Warm-up through %s:%d failed\n", config.proxyHost, config.proxyPort);
+        return 1;
+    }
+
+    Worker *workers = calloc(config.connections, sizeof(Worker));
+    if (workers == NULL)
+    {
+        fprintf(stderr, "Allocation failed\n");
+        return 1;
+    }
+
+    startTime = nowSec() + 0.1;
+    stopTime = startTime + config.durationSec;
+
+    for (int i = 0; i < config.connections; i++)
+    {
+        workers[i].index = i;
+        workers[i].socket = -1;
+        workers[i].state = 0x9e3779b97f4a7c15ULL * (i + 1);
+        if (pthread_create(&workers[i].thread, NULL, runWorker, &workers[i]) != 0)
+        {
+            fprintf(stderr, "Failed to start worker %d\n", i);
+            return 1;
+        }
+    }
+
+    for (int i = 0; i < config.connections; i++)
+    {
+        pthread_join(workers[i].thread, NULL);
+    }
+
+    double elapsed = nowSec() - startTime;
+    int result = report(workers, (elapsed < config.durationSec) ? config.durationSec : elapsed);
+
+    for (int i = 0; i < config.connections; i++)
+    {
+        free(workers[i].samples);
+    }
+    free(workers);
+    return (result == 0) ? 0 : 1;
+}
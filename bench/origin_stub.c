@@ -0,0 +1,341 @@
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Local origin for benchmarks. Objects are addressed by size:
+ *
+ *     GET /obj/<bytes>[/<anything>]
+ *
+ * answers with <bytes> of body and "Cache-Control: max-age=<ttl>", so the
+ * tail of the path only serves to make URLs distinct. /nostore/<bytes>
+ * answers the same body with no-store. Connections are kept alive.
+ */
+
+#define DEFAULT_PORT 18080
+#define DEFAULT_MAX_AGE 3600
+#define REQUEST_MAX 16384
+#define WRITE_SIZE 16384
+#define PATTERN_SIZE 65536
+
+typedef struct StubConfig
+{
+    int port;
+    int latencyMs;
+    int isChunked;
+    int dripMs;
+    int maxAge;
+} StubConfig;
+
+static StubConfig config = {
+    .port = DEFAULT_PORT,
+    .latencyMs = 0,
+    .isChunked = 0,
+    .dripMs = 0,
+    .maxAge = DEFAULT_MAX_AGE,
+};
+
+static char pattern[PATTERN_SIZE];
+
+static void sleepMs(int ms)
+{
+    struct timespec delay = {ms / 1000, (long)(ms % 1000) * 1000000L};
+    while (nanosleep(&delay, &delay) != 0 && errno == EINTR)
+    {
+    }
+}
+
+static int sendAll(int socket, const char *data, size_t size)
+{
+    while (size > 0)
+    {
+        ssize_t n = send(socket, data, size, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            return -1;
+        }
+        data += n;
+        size -= n;
+    }
+    return 0;
+}
+
+static int sendBody(int socket, size_t size)
+{
+    char frame[32];
+
+    for (size_t sent = 0; sent < size;)
+    {
+        size_t part = (size - sent < WRITE_SIZE) ? size - sent : WRITE_SIZE;
+        const char *data = pattern + sent % (PATTERN_SIZE - WRITE_SIZE);
+
+        if (config.isChunked)
+        {
+            int length = snprintf(frame, sizeof(frame), "%zx\r\n", part);
+            if (sendAll(socket, frame, length) != 0 || sendAll(socket, data, part) != 0 ||
+                sendAll(socket, "\r\n", 2) != 0)
+            {
+                return -1;
+            }
+        }
+        else if (sendAll(socket, data, part) != 0)
+        {
+            return -1;
+        }
+
+        sent += part;
+        if (config.dripMs > 0 && sent < size)
+        {
+            sleepMs(config.dripMs);
+        }
+    }
+
+    return config.isChunked ? sendAll(socket, "0\r\n\r\n", 5) : 0;
+}
+
+static int respond(int socket, const char *request, int keepAlive)
+{
+    char head[512];
+    char path[1024];
+    size_t size = 0;
+    int isStorable = 1;
+    int status = 200;
+
+    const char *target = NULL;
+
+    if (sscanf(request, "GET %1023s", path) == 1)
+    {
+        target = path;
+        if (strncmp(path, "http://", 7) == 0)
+        {
+            target = strchr(path + 7, '/');
+        }
+    }
+
+    if (target == NULL)
+    {
+        status = 400;
+    }
+    else if (sscanf(target, "/nostore/%zu", &size) == 1)
+    {
+        isStorable = 0;
+    }
+    else if (sscanf(target, "/obj/%zu", &size) != 1)
+    {
+        status = 404;
+    }
+
+    if (config.latencyMs > 0)
+    {
+        sleepMs(config.latencyMs);
+    }
+
+    if (status != 200)
+    {
+        int length = snprintf(head, sizeof(head),
+                              "HTTP/1.1 %d %s\r\nContent-Length: 0\r\nConnection: %s\r\n\r\n",
+                              status, (status == 404) ? "Not Found" : "Bad Request",
+                              keepAlive ? "keep-alive" : "close");
+        return sendAll(socket, head, length);
+    }
+
+    char cacheControl[64];
+    char framing[64];
+
+    if (isStorable)
+    {
+        snprintf(cacheControl, sizeof(cacheControl), "max-age=%d", config.maxAge);
+    }
+    else
+    {
+        snprintf(cacheControl, sizeof(cacheControl), "no-store");
+    }
+
+    if (config.isChunked)
+    {
+        snprintf(framing, sizeof(framing), "Transfer-Encoding: chunked");
+    }
+    else
+    {
+        snprintf(framing, sizeof(framing), "Content-Length: %zu", size);
+    }
+
+    int length = snprintf(head, sizeof(head),
+                          "HTTP/1.1 200 OK\r\n%s\r\nCache-Control: %s\r\n"
+                          "Content-Type: application/octet-stream\r\nConnection: %s\r\n\r\n",
+                          framing, cacheControl, keepAlive ? "keep-alive" : "close");
+
+    if (sendAll(socket, head, length) != 0)
+    {
+        return -1;
+    }
+    return sendBody(socket, size);
+}
+
+static void *serveConnection(void *arg)
+{
+    int socket = (int)(intptr_t)arg;
+    char request[REQUEST_MAX + 1];
+    size_t used = 0;
+
+    while (1)
+    {
+        char *end = NULL;
+
+        while ((end = memmem(request, used, "\r\n\r\n", 4)) == NULL)
+        {
+            if (used == REQUEST_MAX)
+            {
+                goto done;
+            }
+
+            ssize_t n = recv(socket, request + used, REQUEST_MAX - used, 0);
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (n <= 0)
+            {
+                goto done;
+            }
+            used += n;
+        }
+
+        size_t length = end + 4 - request;
+        request[length - 1] = '\0';
+
+        int keepAlive = strcasestr(request, "Connection: close") == NULL;
+        if (respond(socket, request, keepAlive) != 0 || !keepAlive)
+        {
+            goto done;
+        }
+
+        memmove(request, request + length, used - length);
+        used -= length;
+    }
+
+done:
+    close(socket);
+    return NULL;
+}
+
+static int listenOn(int port)
+{
+    int one = 1;
+    int server = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in address = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+
+    if (server < 0)
+    {
+        return -1;
+    }
+
+    setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(server, (struct sockaddr *)&address, sizeof(address)) != 0 ||
+        listen(server, SOMAXCONN) != 0)
+    {
+        close(server);
+        return -1;
+    }
+    return server;
+}
+
+static void printUsage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-p port] [-l latency_ms] [-c] [-d drip_ms] [-a max_age]\n"
+                    "  -c  send bodies with chunked framing instead of Content-Length\n"
+                    "  -d  pause between %d-byte writes (slow drip)\n",
+            name, WRITE_SIZE);
+}
+
+int main(int argc, char **argv)
+{
+    int opt;
+
+    while ((opt = getopt(argc, argv, "p:l:cd:a:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'p':
+            config.port = atoi(optarg);
+            break;
+        case 'l':
+            config.latencyMs = atoi(optarg);
+            break;
+        case 'c':
+            config.isChunked = 1;
+            break;
+        case 'd':
+            config.dripMs = atoi(optarg);
+            break;
+        case 'a':
+            config.maxAge = atoi(optarg);
+            break;
+        default:
+            printUsage(argv[0]);
+            return 1;
+        }
+    }
+
+    for (size_t i = 0; i < PATTERN_SIZE; i++)
+    {
+        pattern[i] = (char)('a' + i % 26);
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    int server = listenOn(config.port);
+    if (server < 0)
+    {
+        perror("listen");
+        return 1;
+    }
+
+    while (1)
+    {
+        int client = accept(server, NULL, NULL);
+        if (client < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+            perror("accept");
+            break;
+        }
+
+        int one = 1;
+        pthread_t thread;
+        pthread_attr_t attributes;
+
+        setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        pthread_attr_init(&attributes);
+        pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+        if (pthread_create(&thread, &attributes, serveConnection, (void *)(intptr_t)client) != 0)
+        {
+            close(client);
+        }
+        pthread_attr_destroy(&attributes);
+    }
+
+    close(server);
+    return 0;
+}
@@ -0,0 +1,27 @@
+#!/bin/sh
+# Runs every load-gen scenario against a fresh origin stub and proxy and
+# prints one JSON line per scenario.
+#
+#     bench/run_scenarios.sh <build_dir> [threads|epoll] [load-gen options]
+
+set -e
+
+BUILD=${1:?usage: $0 <build_dir> [threads|epoll] [load-gen options]}
+MODE=${2:-threads}
+shift
+[ $# -gt 0 ] && shift
+
+ORIGIN_PORT=18080
+PROXY_PORT=18081
+
+"$BUILD/bench/origin-stub" -p "$ORIGIN_PORT" &
+ORIGIN=$!
+"$BUILD/cache-proxy" -M "$MODE" -m 1G "$PROXY_PORT" >/dev/null 2>&1 &
+PROXY=$!
+trap 'kill $PROXY $ORIGIN 2>/dev/null' EXIT
+sleep 1
+
+for SCENARIO in hit miss fanout large; do
+    "$BUILD/bench/load-gen" -s "$SCENARIO" -x "127.0.0.1:$PROXY_PORT" \
+        -o "127.0.0.1:$ORIGIN_PORT" "$@"
+done
@@ -10,6 +10,8 @@ typedef struct Buffer
     char *data;
     size_t size;
     size_t capacity;
+    size_t headerScanned;
+    int headerEnd;
 } Buffer;
 
 Buffer *Buffer_create(size_t capacity);
@@ -26,6 +28,9 @@ char *Buffer_writePtr(Buffer *buffer);
 size_t Buffer_available(const Buffer *buffer);
 void Buffer_advanceSize(Buffer *buffer, size_t count);
 int Buffer_reserve(Buffer *buffer, size_t minCapacity);
+int Buffer_append(Buffer *buffer, const char *data, size_t size);
+void Buffer_consume(Buffer *buffer, size_t count);
+void Buffer_truncate(Buffer *buffer, size_t size);
 const char *Buffer_asString(Buffer *buffer);
 
 #endif
\ No newline at end of file
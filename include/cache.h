@@ -2,69 +2,396 @@
 #define CACHE_H
 
 #include <pthread.h>
+#include <stdatomic.h>
 #include <sys/time.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+
+#define CACHE_SHARD_BITS 6
+#define CACHE_SHARD_COUNT (1u << CACHE_SHARD_BITS)
+#define CACHE_SHARD_INITIAL_CAPACITY 64
+
+#define CACHE_GHOST_BITS 16
+#define CACHE_MAX_FREQUENCY 3
+#define CACHE_SMALL_QUEUE_PERCENT 10
+
+#define CACHE_WAKE_THRESHOLD (64 * 1024)
+
+#define CACHE_CHUNK_MIN_SIZE (4 * 1024)
+#define CACHE_SLAB_CLASSES 5
+#define CACHE_SLAB_CLASS_SHIFT 2
+#define CACHE_CHUNK_MAX_SIZE ((size_t)CACHE_CHUNK_MIN_SIZE << (CACHE_SLAB_CLASS_SHIFT * (CACHE_SLAB_CLASSES - 1)))
+#define CACHE_SLAB_ARENA_SIZE ((size_t)32 * 1024 * 1024)
+#define CACHE_SLAB_RELEASE_SIZE (64 * 1024)
+
+#define CACHE_DISK_SEGMENT_SIZE ((off_t)64 * 1024 * 1024)
+#define CACHE_DISK_LARGE_OBJECT ((size_t)16 * 1024 * 1024)
+#define CACHE_DISK_QUEUE_MAX_BYTES ((size_t)64 * 1024 * 1024)
+#define CACHE_DISK_INITIAL_CAPACITY 1024
 
 typedef struct CacheEntry CacheEntryT;
-typedef struct CacheNode CacheNodeT;
+typedef struct CacheSlot CacheSlotT;
+typedef struct CacheShard CacheShardT;
+typedef struct CacheQueue CacheQueueT;
+typedef struct CachePolicy CachePolicyT;
 typedef struct CacheManager CacheManagerT;
 typedef struct CacheEntryChunk CacheEntryChunkT;
+typedef struct CacheWaiter CacheWaiterT;
+typedef struct CacheChunkRef CacheChunkRefT;
+typedef struct CacheChunkIndex CacheChunkIndexT;
+typedef struct CacheCursor CacheCursorT;
+typedef struct CacheSlabArena CacheSlabArenaT;
+typedef struct CacheSlabClass CacheSlabClassT;
+typedef struct CacheSlab CacheSlabT;
+typedef struct CacheMemoryStats CacheMemoryStatsT;
+typedef struct CacheDiskSegment CacheDiskSegmentT;
+typedef struct CacheDiskSlot CacheDiskSlotT;
+typedef struct CacheDiskSpill CacheDiskSpillT;
+typedef struct CacheDisk CacheDiskT;
 
 typedef enum CacheStatus
 {
     InProcess,
     Success,
-    Failed
+    Failed,
+    Uncacheable
 } CacheStatusT;
 
+typedef enum CacheStorage
+{
+    StorageHeap,
+    StorageHugePages,
+    StorageMemfd
+} CacheStorageT;
+
+typedef enum CacheQueueId
+{
+    QueueNone,
+    QueueSmall,
+    QueueMain
+} CacheQueueIdT;
+
+/*
+ * Chunk memory comes from per-size-class arenas reserved up front. Slots of
+ * CACHE_SLAB_RELEASE_SIZE and up are returned to the kernel when freed, so
+ * residentBytes counts slots handed out plus small free slots kept for reuse.
+ * allocatedBytes counts live slots only. In memfd mode each arena maps its
+ * own memfd (fd, otherwise -1), so a few descriptors back the whole cache.
+ * Only the newest arena of a class is carved from; older ones are full, and
+ * are unmapped once none of their slots is in use.
+ */
+struct CacheSlabArena
+{
+    char *base;
+    int fd;
+    size_t liveSlots;
+    CacheSlabArenaT *next;
+};
+
+struct CacheSlabClass
+{
+    pthread_mutex_t mutex;
+    size_t slotSize;
+    int isReleasing;
+    char *carve;
+    char *carveEnd;
+    void **freeSlots;
+    size_t freeCount;
+    size_t freeCapacity;
+    CacheSlabArenaT *arenas;
+};
+
+struct CacheSlab
+{
+    CacheSlabClassT classes[CACHE_SLAB_CLASSES];
+    size_t classCount;
+    int useHugePages;
+    int useMemfd;
+    atomic_size_t reservedBytes;
+    atomic_size_t residentBytes;
+    atomic_size_t allocatedBytes;
+};
+
+struct CacheMemoryStats
+{
+    size_t reservedBytes;
+    size_t residentBytes;
+    size_t allocatedBytes;
+    size_t usedBytes;
+    size_t diskBytes;
+};
+
+/*
+ * Second cache tier. Complete entries are appended to segment files by a
+ * writer thread; an append-only index file maps URL hashes to records and
+ * is replayed on startup. Segments are dropped oldest first once the tier
+ * is over maxBytes. Chunks served from disk hold a segment reference, so a
+ * dropped segment's file stays readable until its last reader finishes.
+ */
+struct CacheDiskSegment
+{
+    uint32_t id;
+    int fd;
+    off_t size;
+    atomic_int refCount;
+    CacheDiskSegmentT *next;
+};
+
+struct CacheDiskSlot
+{
+    uint64_t hash;
+    uint32_t segment;
+    off_t offset;
+    off_t length;
+};
+
+struct CacheDiskSpill
+{
+    CacheEntryT *entry;
+    size_t size;
+    CacheDiskSpillT *next;
+};
+
+struct CacheDisk
+{
+    char *path;
+    size_t maxBytes;
+    CacheManagerT *owner;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    pthread_t writer;
+    int isStopping;
+
+    CacheDiskSlotT *slots;
+    size_t capacity;
+    size_t count;
+    int indexFd;
+
+    CacheDiskSegmentT *oldest;
+    CacheDiskSegmentT *active;
+    atomic_size_t totalBytes;
+
+    CacheDiskSpillT *queueHead;
+    CacheDiskSpillT *queueTail;
+    size_t queuedBytes;
+    CacheEntryT *writing;
+};
+
+/*
+ * Heap chunks have fd == -1; slab is set when data came from the slab.
+ * Chunks from a memfd arena map [fileOffset, fileOffset + maxDataSize) of
+ * the arena's file, so readers can sendfile() from fd instead of copying
+ * data. A chunk is only linked to its successor once it is full, so
+ * lock-free readers load next before curDataSize.
+ */
 struct CacheEntryChunk
 {
     char *data;
-    size_t curDataSize;
+    atomic_size_t curDataSize;
     size_t maxDataSize;
-    CacheEntryChunkT *next;
+    int fd;
+    off_t fileOffset;
+    CacheSlabT *slab;
+    CacheDiskSegmentT *segment;
+    _Atomic(CacheEntryChunkT *) next;
+};
+
+/*
+ * Chunk descriptors in entry order; offset is where the chunk starts in the
+ * entry. The array is only appended to under dataMutex. Growing it copies
+ * the descriptors into a larger array and keeps the old one on the retired
+ * chain until the entry is freed, so lock-free readers can keep indexing
+ * whichever array they loaded. Readers load chunkCount before chunkIndex.
+ */
+struct CacheChunkRef
+{
+    CacheEntryChunkT *chunk;
+    size_t offset;
+};
+
+struct CacheChunkIndex
+{
+    size_t capacity;
+    CacheChunkIndexT *retired;
+    CacheChunkRefT refs[];
+};
+
+/*
+ * Read position within an entry. Readers call readable() for the bytes
+ * available at the position, consume some of them and advance().
+ */
+struct CacheCursor
+{
+    CacheEntryT *entry;
+    size_t position;
+    size_t index;
+};
+
+/*
+ * One-shot progress callback for readers that cannot block on the sequence.
+ * It is unlinked before notify runs, and notify is called with the entry's
+ * dataMutex held.
+ */
+struct CacheWaiter
+{
+    void (*notify)(CacheWaiterT *waiter);
+    CacheWaiterT *prev;
+    CacheWaiterT *next;
+    int isLinked;
 };
 
+/*
+ * refreshedHeaders, once a 304 has been merged in, is the header block to
+ * serve instead of the first headerSize bytes of the data. isDropped marks
+ * an entry that revalidation took out of the cache, so readers waiting on
+ * it look the URL up again. Both are guarded by dataMutex.
+ */
 struct CacheEntry
 {
     char *url;
-    CacheEntryChunkT *dataChunks;
+    uint64_t urlHash;
+    _Atomic(CacheEntryChunkT *) dataChunks;
     CacheEntryChunkT *lastChunk;
+    _Atomic(CacheChunkIndexT *) chunkIndex;
+    atomic_size_t chunkCount;
+    size_t headerSize;
     size_t downloadedSize;
-    CacheStatusT status;
+    size_t diskSize;
+    atomic_int isSpilled;
+    size_t chargedSize;
+    int isCharged;
+    _Atomic CacheStatusT status;
+    time_t expiresAt;
+    int responseStatus;
+    char *etag;
+    char *lastModified;
+    char *refreshedHeaders;
+    size_t refreshedHeaderSize;
+    int isRevalidating;
+    int isDropped;
+    atomic_int refCount;
     pthread_mutex_t dataMutex;
-    pthread_cond_t dataCond;
+    atomic_uint sequence;
+    atomic_int sleepers;
+    size_t unwokenBytes;
+    CacheWaiterT *waiters;
+
+    CacheManagerT *owner;
+    CacheEntryT *queuePrev;
+    CacheEntryT *queueNext;
+    CacheQueueIdT queue;
+    atomic_uint frequency;
 };
 
-struct CacheNode
+struct CacheSlot
 {
+    uint64_t hash;
     CacheEntryT *entry;
-    CacheNodeT *next;
+};
+
+struct CacheShard
+{
+    pthread_mutex_t mutex;
+    CacheSlotT *slots;
+    size_t capacity;
+    size_t count;
+};
+
+struct CacheQueue
+{
+    CacheEntryT *head;
+    CacheEntryT *tail;
+    size_t count;
+};
+
+struct CachePolicy
+{
+    pthread_mutex_t mutex;
+    CacheQueueT small;
+    CacheQueueT main;
+    uint64_t *ghost;
 };
 
 struct CacheManager
 {
-    pthread_mutex_t entriesMutex;
-    CacheNodeT *nodes;
-    CacheNodeT *lastNode;
+    CacheShardT shards[CACHE_SHARD_COUNT];
+    CachePolicyT policy;
+    atomic_size_t usedBytes;
+    size_t maxBytes;
+    CacheStorageT storage;
+    CacheSlabT slab;
+    CacheDiskT *disk;
 };
 
+int CacheSlabT_init(CacheSlabT *slab, int useHugePages, int useMemfd);
+void CacheSlabT_destroy(CacheSlabT *slab);
+char *CacheSlabT_alloc(CacheSlabT *slab, size_t dataSize, size_t *slotSize, int *fd, off_t *offset);
+void CacheSlabT_free(CacheSlabT *slab, char *slot, size_t slotSize);
+
 CacheEntryChunkT *CacheEntryChunkT_new(size_t dataSize);
+CacheEntryChunkT *CacheEntryChunkT_newSlab(CacheSlabT *slab, size_t dataSize);
+CacheEntryChunkT *CacheEntryChunkT_newFile(CacheDiskSegmentT *segment, off_t offset, size_t dataSize);
 void CacheEntryChunkT_delete(CacheEntryChunkT *chunk);
 
 CacheEntryT *CacheEntryT_new(void);
 void CacheEntryT_delete(CacheEntryT *entry);
+CacheEntryT *CacheEntryT_acquire(CacheEntryT *entry);
+void CacheEntryT_release(CacheEntryT *entry);
 
 void CacheEntryT_updateStatus(CacheEntryT *entry, CacheStatusT status);
+void CacheEntryT_wakeReaders(CacheEntryT *entry);
+unsigned CacheEntryT_sequence(CacheEntryT *entry);
+void CacheEntryT_waitChange(CacheEntryT *entry, unsigned sequence);
+void CacheEntryT_addWaiter(CacheEntryT *entry, CacheWaiterT *waiter);
+void CacheEntryT_removeWaiter(CacheEntryT *entry, CacheWaiterT *waiter);
 CacheEntryChunkT *CacheEntryT_appendData(CacheEntryT *entry, const char *data,
                                          size_t dataSize, CacheStatusT status);
+CacheEntryChunkT *CacheEntryT_appendChunk(CacheEntryT *entry, CacheEntryChunkT *chunk,
+                                          CacheStatusT status);
+char *CacheEntryT_reserve(CacheEntryT *entry, size_t *available);
+void CacheEntryT_commit(CacheEntryT *entry, size_t dataSize, CacheStatusT status);
+void CacheEntryT_flush(CacheEntryT *entry);
+int CacheEntryT_hasHeaders(CacheEntryT *entry);
+
+void CacheCursorT_init(CacheCursorT *cursor, CacheEntryT *entry, size_t position);
+size_t CacheCursorT_readable(CacheCursorT *cursor, CacheEntryChunkT **chunk, size_t *from);
+void CacheCursorT_advance(CacheCursorT *cursor, size_t count);
 
-CacheNodeT *CacheNodeT_new(void);
-void CacheNodeT_delete(CacheNodeT *node);
+int CacheShardT_init(CacheShardT *shard, size_t capacity);
+void CacheShardT_destroy(CacheShardT *shard);
+CacheEntryT *CacheShardT_find(const CacheShardT *shard, uint64_t hash, const char *url);
+int CacheShardT_insert(CacheShardT *shard, CacheEntryT *entry);
+int CacheShardT_remove(CacheShardT *shard, const CacheEntryT *entry);
 
-CacheManagerT *CacheManagerT_new(void);
+int CachePolicyT_init(CachePolicyT *policy);
+void CachePolicyT_destroy(CachePolicyT *policy);
+void CachePolicyT_insert(CachePolicyT *policy, CacheEntryT *entry);
+void CachePolicyT_unlink(CachePolicyT *policy, CacheEntryT *entry);
+CacheEntryT *CachePolicyT_pickVictim(CachePolicyT *policy);
+void CachePolicyT_touch(CacheEntryT *entry);
+
+CacheManagerT *CacheManagerT_new(size_t maxBytes, CacheStorageT storage);
 void CacheManagerT_delete(CacheManagerT *manager);
-CacheNodeT *CacheManagerT_get_CacheNodeT(CacheManagerT *cache, const char *url);
-void CacheManagerT_put_CacheNodeT(CacheManagerT *cache, CacheNodeT *node);
+uint64_t CacheManagerT_hashUrl(const char *url);
+CacheEntryT *CacheManagerT_acquire_CacheEntryT(CacheManagerT *cache,
+                                               const char *url,
+                                               int *isNew);
+void CacheManagerT_remove_CacheEntryT(CacheManagerT *cache, CacheEntryT *entry);
+void CacheManagerT_charge(CacheManagerT *cache, size_t bytes);
+void CacheManagerT_evict(CacheManagerT *cache);
+void CacheManagerT_memoryStats(CacheManagerT *cache, CacheMemoryStatsT *stats);
+int CacheManagerT_attachDisk(CacheManagerT *cache, const char *path, size_t maxBytes);
+void CacheManagerT_onComplete(CacheManagerT *cache, CacheEntryT *entry);
+void CacheManagerT_onSpilled(CacheManagerT *cache, CacheEntryT *entry);
+
+int CacheDiskT_open(CacheDiskT *disk, CacheManagerT *owner, const char *path, size_t maxBytes);
+void CacheDiskT_close(CacheDiskT *disk);
+CacheEntryT *CacheDiskT_load(CacheDiskT *disk, uint64_t hash, const char *url);
+int CacheDiskT_spill(CacheDiskT *disk, CacheEntryT *entry, int isFlushing);
+void CacheDiskT_remove(CacheDiskT *disk, CacheEntryT *entry);
+CacheDiskSegmentT *CacheDiskSegmentT_acquire(CacheDiskSegmentT *segment);
+void CacheDiskSegmentT_release(CacheDiskSegmentT *segment);
 
 #endif
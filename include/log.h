@@ -1,8 +1,48 @@
 #ifndef PROXY_LOG_H
 #define PROXY_LOG_H
 
-void logDebug(const char *message);
-void logInfo(const char *message);
-void logError(const char *message);
+#include <stdatomic.h>
 
-#endif
\ No newline at end of file
+#define LOG_LEVEL_DEBUG 0
+#define LOG_LEVEL_INFO 1
+#define LOG_LEVEL_ERROR 2
+#define LOG_LEVEL_NONE 3
+
+/*
+ * Calls below LOG_COMPILE_LEVEL are dead code the compiler drops, while
+ * their arguments are still type-checked. Calls below the runtime level
+ * cost one load and do not evaluate their arguments.
+ */
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+#define LOG_AT(level, ...)                                                     \
+    do                                                                         \
+    {                                                                          \
+        if ((level) >= LOG_COMPILE_LEVEL &&                                    \
+            (level) >= atomic_load_explicit(&logRuntimeLevel, memory_order_relaxed)) \
+        {                                                                      \
+            logWrite((level), __VA_ARGS__);                                    \
+        }                                                                      \
+    } while (0)
+
+#define logDebug(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define logInfo(...) LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#define logError(...) LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+
+extern _Atomic int logRuntimeLevel;
+
+void logWrite(int level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+void logSetLevel(int level);
+int logParseLevel(const char *name);
+
+/*
+ * Until logStart is called messages are written synchronously. After it,
+ * each thread formats into its own ring and a writer thread prints them;
+ * logStop drains what is left and returns to synchronous writes.
+ */
+int logStart(void);
+void logStop(void);
+
+#endif
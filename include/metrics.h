@@ -0,0 +1,50 @@
+#ifndef PROXY_METRICS_H
+#define PROXY_METRICS_H
+
+#include <stdint.h>
+
+#include "buffer.h"
+
+#define METRICS_SHARDS 16
+#define METRICS_SUB_BUCKET_BITS 4
+#define METRICS_MAX_EXPONENT 40
+#define METRICS_SUB_BUCKETS (1 << METRICS_SUB_BUCKET_BITS)
+#define METRICS_BUCKETS ((METRICS_MAX_EXPONENT - METRICS_SUB_BUCKET_BITS + 2) * METRICS_SUB_BUCKETS)
+
+/* Counters only grow; gauges go up and down through the same calls. */
+typedef enum MetricCounter
+{
+    CounterRequests,
+    CounterRequestErrors,
+    CounterCacheHits,
+    CounterCacheMisses,
+    CounterRevalidations,
+    CounterClientBytes,
+    CounterOriginConnects,
+    CounterOriginConnectErrors,
+    CounterOriginReused,
+    GaugeClientConnections,
+    GaugeDownloads,
+    CounterCount
+} MetricCounterT;
+
+/* Durations are recorded in nanoseconds, sizes in bytes. */
+typedef enum MetricHistogram
+{
+    HistogramRequestTime,
+    HistogramOriginFirstByte,
+    HistogramOriginConnect,
+    HistogramCacheLookup,
+    HistogramObjectSize,
+    HistogramCount
+} MetricHistogramT;
+
+uint64_t metricsNow(void);
+void metricsAdd(MetricCounterT counter, int64_t value);
+void metricsObserve(MetricHistogramT histogram, uint64_t value);
+void metricsObserveSince(MetricHistogramT histogram, uint64_t start);
+
+int metricsRender(Buffer *out);
+int metricsAppendGauge(Buffer *out, const char *name, const char *help, double value);
+
+#endif
@@ -0,0 +1,66 @@
+#ifndef PROXY_PROBES_H
+#define PROXY_PROBES_H
+
+#include <stdint.h>
+
+/*
+ * USDT probes in the format of systemtap's <sys/sdt.h>, so perf, bpftrace
+ * and friends find them as usdt:cache-proxy:proxy:<name>. A probe is a nop
+ * plus an ELF note describing where its arguments live; nothing is called
+ * and no library is needed. Arguments are passed as signed 64-bit values,
+ * pointers included. Building with PROXY_NO_PROBES compiles them out.
+ */
+#if !defined(PROXY_NO_PROBES) && defined(__ELF__) && (defined(__x86_64__) || defined(__aarch64__))
+
+#define PROXY_PROBE_NOTE(name, args)                                           \
+    "990: nop\n"                                                               \
+    ".pushsection .note.stapsdt,\"?\",\"note\"\n"                              \
+    ".balign 4\n"                                                              \
+    ".4byte 992f-991f, 994f-993f, 3\n"                                         \
+    "991: .asciz \"stapsdt\"\n"                                                \
+    "992: .balign 4\n"                                                         \
+    "993: .8byte 990b\n"                                                       \
+    ".8byte _.stapsdt.base\n"                                                  \
+    ".8byte 0\n"                                                               \
+    ".asciz \"proxy\"\n"                                                       \
+    ".asciz \"" #name "\"\n"                                                   \
+    ".asciz \"" args "\"\n"                                                    \
+    "994: .balign 4\n"                                                         \
+    ".popsection\n"                                                            \
+    ".ifndef _.stapsdt.base\n"                                                 \
+    ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n"    \
+    ".weak _.stapsdt.base\n"                                                   \
+    ".hidden _.stapsdt.base\n"                                                 \
+    "_.stapsdt.base: .space 1\n"                                               \
+    ".size _.stapsdt.base, 1\n"                                                \
+    ".popsection\n"                                                            \
+    ".endif\n"
+
+#define PROXY_PROBE_ARG(x) "nor"((int64_t)(x))
+
+#define PROXY_PROBE0(name)                                                     \
+    __asm__ __volatile__(PROXY_PROBE_NOTE(name, "") ::)
+
+#define PROXY_PROBE1(name, a1)                                                 \
+    __asm__ __volatile__(PROXY_PROBE_NOTE(name, "-8@%[arg1]")                  \
+                         :: [arg1] PROXY_PROBE_ARG(a1))
+
+#define PROXY_PROBE2(name, a1, a2)                                             \
+    __asm__ __volatile__(PROXY_PROBE_NOTE(name, "-8@%[arg1] -8@%[arg2]")       \
+                         :: [arg1] PROXY_PROBE_ARG(a1), [arg2] PROXY_PROBE_ARG(a2))
+
+#define PROXY_PROBE3(name, a1, a2, a3)                                         \
+    __asm__ __volatile__(PROXY_PROBE_NOTE(name, "-8@%[arg1] -8@%[arg2] -8@%[arg3]") \
+                         :: [arg1] PROXY_PROBE_ARG(a1), [arg2] PROXY_PROBE_ARG(a2), \
+                            [arg3] PROXY_PROBE_ARG(a3))
+
+#else
+
+#define PROXY_PROBE0(name) ((void)0)
+#define PROXY_PROBE1(name, a1) ((void)sizeof(a1))
+#define PROXY_PROBE2(name, a1, a2) ((void)sizeof(a1), (void)sizeof(a2))
+#define PROXY_PROBE3(name, a1, a2, a3) ((void)sizeof(a1), (void)sizeof(a2), (void)sizeof(a3))
+
+#endif
+
+#endif
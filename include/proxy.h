@@ -5,6 +5,7 @@
 #include <stddef.h>
 #include <sys/types.h>
 #include <signal.h>
+#include <sys/socket.h>
 
 #include "cache.h"
 #include "buffer.h"
@@ -12,13 +13,40 @@
 #define BUFFER_SIZE 16384
 #define HOST_MAX_LEN 1024
 #define PATH_MAX_LEN 2048
+#define URL_MAX_LEN 2048
+#define HTTP_MAX_HEADERS 100
+#define RANGE_VALIDATOR_MAX_LEN 256
+#define REQUEST_HEADER_MAX_SIZE (64 * 1024)
+#define REQUEST_BODY_MAX_SIZE ((size_t)16 * 1024 * 1024)
 
 #define SUCCESS 0
 #define ERROR (-1)
 
 #define SOCKET_TIMEOUT_SEC 30
+#define KEEPALIVE_TIMEOUT_SEC 15
+
+#define POOL_MAX_IDLE_PER_ORIGIN 8
+#define POOL_MAX_IDLE_TOTAL 256
+#define POOL_IDLE_TIMEOUT_SEC 10
+#define ORIGIN_DOWN_TTL_SEC 5
+
+#define DNS_MAX_ADDRESSES 4
+#define DNS_POSITIVE_TTL_SEC 60
+#define DNS_NEGATIVE_TTL_SEC 5
+#define DNS_RESOLVER_THREADS 2
+#define RESOLVE_PENDING 1
+
+#define UPLOAD_READ_MIN BUFFER_SIZE
+#define UPLOAD_READ_MAX (256 * 1024)
+
+#define DEFAULT_CACHE_MAX_BYTES ((size_t)256 * 1024 * 1024)
+#define DEFAULT_DISK_MAX_BYTES ((size_t)4 * 1024 * 1024 * 1024)
+#define DEFAULT_TRACE_SLOW_MS 1000
+#define DEFAULT_LISTEN_BACKLOG 1024
+#define MAX_LISTENERS 256
 
 extern const char *HTTP_400_BAD_REQUEST;
+extern const char *HTTP_413_CONTENT_TOO_LARGE;
 extern const char *HTTP_500_INTERNAL_ERROR;
 extern const char *HTTP_502_BAD_GATEWAY;
 
@@ -27,37 +55,286 @@ extern int activeClients;
 extern pthread_mutex_t clientsMutex;
 extern pthread_cond_t clientsCond;
 
+typedef enum ServerMode
+{
+    ServerThreads,
+    ServerEventLoop
+} ServerModeT;
+
+typedef struct ProxyConfig
+{
+    int port;
+    size_t cacheMaxBytes;
+    CacheStorageT cacheStorage;
+    const char *diskPath;
+    size_t diskMaxBytes;
+    ServerModeT mode;
+    int workerCount;
+    int listenerCount;
+    int listenBacklog;
+    int isSteered;
+    int adminPort;
+    int traceSlowMs;
+    int traceSampleEvery;
+    const char *tracePath;
+} ProxyConfig;
+
 typedef struct ClientContext
 {
     CacheManagerT *cacheManager;
     int clientSocket;
 } ClientContext;
 
+typedef enum HttpHeaderName
+{
+    HeaderOther,
+    HeaderHost,
+    HeaderContentLength,
+    HeaderTransferEncoding,
+    HeaderCacheControl,
+    HeaderConnection,
+    HeaderProxyConnection,
+    HeaderKeepAlive,
+    HeaderExpires,
+    HeaderDate,
+    HeaderAge,
+    HeaderLastModified,
+    HeaderEtag,
+    HeaderVary,
+    HeaderPragma,
+    HeaderIfNoneMatch,
+    HeaderIfModifiedSince,
+    HeaderRange,
+    HeaderIfRange,
+    HeaderContentRange,
+    HeaderAcceptRanges,
+    HeaderCount
+} HttpHeaderNameT;
+
+typedef struct HttpSlice
+{
+    unsigned offset;
+    unsigned length;
+} HttpSlice;
+
+typedef struct HttpHeader
+{
+    HttpHeaderNameT id;
+    HttpSlice name;
+    HttpSlice value;
+} HttpHeader;
+
+/*
+ * Slices are offsets into the parsed data, so a message stays valid only
+ * while that data is neither moved nor consumed. known[] holds the index
+ * plus one of the first header with each known name.
+ */
+typedef struct HttpMessage
+{
+    HttpSlice method;
+    HttpSlice target;
+    HttpSlice version;
+    int status;
+    int minorVersion;
+    size_t headerLength;
+    size_t headerCount;
+    HttpHeader headers[HTTP_MAX_HEADERS];
+    unsigned char known[HeaderCount];
+} HttpMessage;
+
+typedef struct ByteRange
+{
+    int isRequested;
+    long long first;
+    long long last;
+    char ifRange[RANGE_VALIDATOR_MAX_LEN];
+} ByteRange;
+
+typedef struct CachedBody
+{
+    size_t offset;
+    size_t end;
+    int status;
+} CachedBody;
+
+typedef enum BodyFraming
+{
+    BodyNone,
+    BodyLength,
+    BodyChunked,
+    BodyUntilClose
+} BodyFramingT;
+
+/*
+ * isRequestSent is set by the caller once the whole request went out; an
+ * origin connection is only pooled when both directions ended cleanly.
+ */
+typedef struct ResponseFrame
+{
+    size_t headerLength;
+    BodyFramingT framing;
+    size_t remaining;
+    int chunkState;
+    int status;
+    int keepAlive;
+    int isComplete;
+    int isRequestSent;
+} ResponseFrame;
+
+/*
+ * A request body is framed like a response body: body follows its
+ * Content-Length or chunked encoding, and for chunked bodies totalLength
+ * grows to the end of the chunks scanned so far.
+ */
+typedef struct RequestFrame
+{
+    size_t headerLength;
+    size_t totalLength;
+    int keepAlive;
+    int isValid;
+    int isTooLarge;
+    ResponseFrame body;
+    HttpMessage message;
+} RequestFrame;
+
+typedef enum TracePhase
+{
+    PhaseReceive,
+    PhaseLookup,
+    PhaseResolve,
+    PhaseConnect,
+    PhaseOriginWait,
+    PhaseEntryWait,
+    PhaseSend,
+    PhaseCount
+} TracePhaseT;
+
+/*
+ * Monotonic timings of one request. A phase that repeats, as on a retry
+ * or a revalidation followed by a fill, accumulates; phaseStart is 0 while
+ * the phase is not running.
+ */
+typedef struct RequestTrace
+{
+    uint64_t startTime;
+    uint64_t phaseStart[PhaseCount];
+    uint64_t phaseTime[PhaseCount];
+    size_t sentBytes;
+    int status;
+    const char *cacheResult;
+} RequestTrace;
+
+typedef struct ResolvedHost
+{
+    struct sockaddr_storage addresses[DNS_MAX_ADDRESSES];
+    socklen_t lengths[DNS_MAX_ADDRESSES];
+    int count;
+} ResolvedHost;
+
+typedef struct DnsWaiter DnsWaiter;
+
+struct DnsWaiter
+{
+    void (*notify)(DnsWaiter *waiter);
+    ResolvedHost *result;
+    int status;
+    struct DnsEntry *entry;
+    DnsWaiter *prev;
+    DnsWaiter *next;
+    int isLinked;
+};
+
 typedef struct FileUploadContext
 {
     CacheEntryT *entry;
-    Buffer *buffer;
     int remoteSocket;
+    char host[HOST_MAX_LEN];
+    int port;
+    ResponseFrame frame;
 } FileUploadContext;
 
 int setSocketTimeout(int socket, int timeoutSec);
 
 int parseUrl(const char *url, char *host, char *path, int *port);
 
-int connectToHost(const char *host, int port);
+int connectToHost(const char *host, int port, RequestTrace *trace);
+int startConnect(const ResolvedHost *resolved, int index, int port);
+int getSocketError(int sock);
+int setNonBlocking(int sock);
 ssize_t sendAll(int socket, const char *data, size_t size);
+ssize_t sendFileAll(int socket, int fd, off_t offset, size_t size);
 ssize_t recvUntilHeaderEnd(int socket, Buffer *buffer);
 
 void sendErrorResponse(int socket, const char *status, const char *message);
-int isGetRequest(const char *method);
+int buildErrorResponse(Buffer *out, const char *status, const char *message);
+int findHeaderEnd(Buffer *buffer);
+
+HttpHeaderNameT lookupHeaderName(const char *name, size_t length);
+int parseHttpRequest(const char *data, size_t headerLength, HttpMessage *message);
+int parseHttpResponse(const char *data, size_t headerLength, HttpMessage *message);
+const char *httpHeader(const char *data, const HttpMessage *message,
+                       HttpHeaderNameT id, size_t *valueLength);
+int isHttpSlice(const char *data, HttpSlice slice, const char *text);
+int copyHttpSlice(const char *data, HttpSlice slice, char *out, size_t size);
+
+int parseRequestFrame(Buffer *buffer, RequestFrame *frame);
+int advanceRequestFrame(const Buffer *buffer, RequestFrame *frame);
+int buildUpstreamRequest(const Buffer *request, const RequestFrame *frame, Buffer *upstream);
+void parseByteRange(const char *data, const HttpMessage *message, ByteRange *range);
+int refreshEntryHeaders(CacheEntryT *entry, const char *headers, const HttpMessage *update);
+int buildCachedResponseHead(CacheEntryT *entry, const ByteRange *range, int keepAlive,
+                            Buffer *head, int *isKeptAlive, CachedBody *body);
+int buildRelayedResponseHead(const char *headers, const ResponseFrame *frame,
+                             int keepAlive, Buffer *head, int *isKeptAlive);
+int isIdempotentRequest(const Buffer *request);
+int isHeadRequest(const Buffer *request);
+
+void parseResponseFrame(const char *headers, size_t headerLength, int isHead,
+                        ResponseFrame *frame, HttpMessage *message);
+size_t advanceResponseFrame(ResponseFrame *frame, const char *data, size_t size);
+size_t limitResponseRead(const ResponseFrame *frame, size_t size);
+void endResponseFrame(ResponseFrame *frame);
+
+int acquireOriginSocket(const char *host, int port);
+void releaseOriginSocket(const char *host, int port, int socket);
+int connectToOrigin(const char *host, int port, int *isReused, RequestTrace *trace);
+void finishOriginSocket(const char *host, int port, int socket, const ResponseFrame *frame);
+void closeOriginPool(void);
+void markOriginDown(const char *host, int port);
+int isOriginDown(const char *host, int port);
+
+int startResolver(void);
+void stopResolver(void);
+int resolveHost(const char *host, ResolvedHost *resolved);
+int resolveHostAsync(const char *host, DnsWaiter *waiter);
+void cancelResolve(DnsWaiter *waiter);
+
+int isStatusCacheable(int status);
+int isResponseStorable(const char *headers, const HttpMessage *message);
+void updateEntryFreshness(CacheEntryT *entry, const char *headers, const HttpMessage *message);
+int buildConditionalRequest(Buffer *request, CacheEntryT *entry, Buffer *conditional);
 
 ssize_t recvToBuffer(int socket, Buffer *buffer);
 ssize_t recvWithTimeout(int socket, char *buffer, size_t size, int timeoutSec);
-void startProxyServer(int port);
+void startProxyServer(const ProxyConfig *config);
 void *handleClientThread(void *args);
+int runEventLoopServer(const int *serverSockets, int socketCount, CacheManagerT *cache,
+                       int workerCount, int isSteered);
+int startAdminServer(int port, CacheManagerT *cache);
+void stopAdminServer(void);
+
+int startTracing(int slowMs, int sampleEvery, const char *path);
+void stopTracing(void);
+void traceStart(RequestTrace *trace, uint64_t receiveTime);
+void traceEnter(RequestTrace *trace, TracePhaseT phase);
+uint64_t traceLeave(RequestTrace *trace, TracePhaseT phase);
+void traceSwitch(RequestTrace *trace, TracePhaseT from, TracePhaseT to);
+void traceSent(RequestTrace *trace, size_t bytes);
+void traceFinish(RequestTrace *trace, const char *url, int isError);
 
-int startBackgroundUpload(CacheEntryT *entry, Buffer *buffer,
-                          int remoteSocket);
+int startBackgroundUpload(CacheEntryT *entry, int remoteSocket,
+                          const char *host, int port, const ResponseFrame *frame);
+size_t adaptReadSize(size_t current, size_t requested, size_t received);
 void *fileUploadThread(void *args);
 int waitForReadable(int sock, int timeoutSec);
 
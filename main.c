@@ -1,23 +1,223 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
+#include "log.h"
 #include "proxy.h"
 
+static void printUsage(const char *name)
+{
+  fprintf(stderr, "Usage: %s [-m cache_bytes[K|M|G]] [-s heap|hugepage|memfd] [-d disk_dir] [-D disk_bytes[K|M|G]] [-M threads|epoll] [-w workers] [-l listeners] [-b backlog] [-C] [-a admin_port] [-L debug|info|error|none] [-S slow_ms] [-R sample_every] [-T trace_file] <port>\n", name);
+}
+
+static int parseSize(const char *text, size_t *size)
+{
+  char *end = NULL;
+  unsigned long long value = strtoull(text, &end, 10);
+
+  if (end == text)
+  {
+    return ERROR;
+  }
+
+  switch (*end)
+  {
+  case 'G':
+  case 'g':
+    value *= 1024;
+    /* fall through */
+  case 'M':
+  case 'm':
+    value *= 1024;
+    /* fall through */
+  case 'K':
+  case 'k':
+    value *= 1024;
+    end++;
+    break;
+  default:
+    break;
+  }
+
+  if (*end != '\0')
+  {
+    return ERROR;
+  }
+
+  *size = value;
+  return SUCCESS;
+}
+
 int main(int argc, char **argv)
 {
-  if (argc < 2)
+  ProxyConfig config = {
+      .port = 0,
+      .cacheMaxBytes = DEFAULT_CACHE_MAX_BYTES,
+      .cacheStorage = StorageHeap,
+      .diskPath = NULL,
+      .diskMaxBytes = DEFAULT_DISK_MAX_BYTES,
+      .mode = ServerThreads,
+      .workerCount = (int)sysconf(_SC_NPROCESSORS_ONLN),
+      .listenerCount = 0,
+      .listenBacklog = DEFAULT_LISTEN_BACKLOG,
+      .isSteered = 0,
+      .adminPort = 0,
+      .traceSlowMs = DEFAULT_TRACE_SLOW_MS,
+      .traceSampleEvery = 0,
+      .tracePath = NULL,
+  };
+  int opt;
+
+  while ((opt = getopt(argc, argv, "m:s:d:D:M:w:l:b:Ca:L:S:R:T:")) != -1)
   {
-    fprintf(stderr, "Usage: %s <port>\n", argv[0]);
+    switch (opt)
+    {
+    case 'm':
+      if (parseSize(optarg, &config.cacheMaxBytes) != SUCCESS)
+      {
+        fprintf(stderr, "Invalid cache size: %s\n", optarg);
+        return ERROR;
+      }
+      break;
+    case 's':
+      if (strcmp(optarg, "heap") == 0)
+      {
+        config.cacheStorage = StorageHeap;
+      }
+      else if (strcmp(optarg, "hugepage") == 0)
+      {
+        config.cacheStorage = StorageHugePages;
+      }
+      else if (strcmp(optarg, "memfd") == 0)
+      {
+        config.cacheStorage = StorageMemfd;
+      }
+      else
+      {
+        fprintf(stderr, "Invalid cache storage: %s\n", optarg);
+        return ERROR;
+      }
+      break;
+    case 'd':
+      config.diskPath = optarg;
+      break;
+    case 'D':
+      if (parseSize(optarg, &config.diskMaxBytes) != SUCCESS)
+      {
+        fprintf(stderr, "Invalid disk cache size: %s\n", optarg);
+        return ERROR;
+      }
+      break;
+    case 'M':
+      if (strcmp(optarg, "threads") == 0)
+      {
+        config.mode = ServerThreads;
+      }
+      else if (strcmp(optarg, "epoll") == 0)
+      {
+        config.mode = ServerEventLoop;
+      }
+      else
+      {
+        fprintf(stderr, "Invalid server mode: %s\n", optarg);
+        return ERROR;
+      }
+      break;
+    case 'w':
+      config.workerCount = atoi(optarg);
+      if (config.workerCount <= 0)
+      {
+        fprintf(stderr, "Invalid worker count: %s\n", optarg);
+        return ERROR;
+      }
+      break;
+    case 'l':
+      config.listenerCount = atoi(optarg);
+      if (config.listenerCount <= 0 || config.listenerCount > MAX_LISTENERS)
+      {
+        fprintf(stderr, "Invalid listener count: %s\n", optarg);
+        return ERROR;
+      }
+      break;
+    case 'b':
+      config.listenBacklog = atoi(optarg);
+      if (config.listenBacklog <= 0)
+      {
+        fprintf(stderr, "Invalid listen backlog: %s\n", optarg);
+        return ERROR;
+      }
+      break;
+    case 'C':
+      config.isSteered = 1;
+      break;
+    case 'a':
+      config.adminPort = atoi(optarg);
+      if (config.adminPort <= 0 || config.adminPort > 65535)
+      {
+        fprintf(stderr, "Invalid admin port: %s\n", optarg);
+        return ERROR;
+      }
+      break;
+    case 'L':
+      if (logParseLevel(optarg) < 0)
+      {
+        fprintf(stderr, "Invalid log level: %s\n", optarg);
+        return ERROR;
+      }
+      logSetLevel(logParseLevel(optarg));
+      break;
+    case 'S':
+      config.traceSlowMs = atoi(optarg);
+      if (config.traceSlowMs < 0)
+      {
+        fprintf(stderr, "Invalid slow request threshold: %s\n", optarg);
+        return ERROR;
+      }
+      break;
+    case 'R':
+      config.traceSampleEvery = atoi(optarg);
+      if (config.traceSampleEvery < 0)
+      {
+        fprintf(stderr, "Invalid trace sample rate: %s\n", optarg);
+        return ERROR;
+      }
+      break;
+    case 'T':
+      config.tracePath = optarg;
+      break;
+    default:
+      printUsage(argv[0]);
+      return ERROR;
+    }
+  }
+
+  if (optind >= argc)
+  {
+    printUsage(argv[0]);
     return ERROR;
   }
 
-  const int port = atoi(argv[1]);
-  if (port <= 0 || port > 65535)
+  config.port = atoi(argv[optind]);
+  if (config.port <= 0 || config.port > 65535)
   {
-    fprintf(stderr, "Invalid port number: %s\n", argv[1]);
+    fprintf(stderr, "Invalid port number: %s\n", argv[optind]);
     return ERROR;
   }
-  startProxyServer(port);
+
+  if (config.workerCount <= 0)
+  {
+    config.workerCount = 1;
+  }
+
+  if (logStart() != 0)
+  {
+    fprintf(stderr, "Failed to start the log writer, logging synchronously\n");
+  }
+
+  startProxyServer(&config);
+
+  logStop();
 
   return 0;
 }
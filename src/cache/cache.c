@@ -2,7 +2,10 @@
 #include <stdlib.h>
 #include <string.h>
 
-CacheManagerT *CacheManagerT_new(void)
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define FNV_PRIME        0x100000001b3ULL
+
+CacheManagerT *CacheManagerT_new(size_t maxBytes, CacheStorageT storage)
 {
     CacheManagerT *manager = calloc(1, sizeof(CacheManagerT));
     if (manager == NULL)
@@ -10,17 +13,57 @@ CacheManagerT *CacheManagerT_new(void)
         goto fail;
     }
 
-    if (pthread_mutex_init(&manager->entriesMutex, NULL) != 0)
+    manager->maxBytes = maxBytes;
+    manager->storage = storage;
+    atomic_init(&manager->usedBytes, 0);
+
+    if (CachePolicyT_init(&manager->policy) != 0)
+    {
+        free(manager);
+        goto fail;
+    }
+
+    if (CacheSlabT_init(&manager->slab, storage == StorageHugePages,
+                        storage == StorageMemfd) != 0)
     {
+        CachePolicyT_destroy(&manager->policy);
         free(manager);
         goto fail;
     }
 
+    for (size_t i = 0; i < CACHE_SHARD_COUNT; i++)
+    {
+        if (CacheShardT_init(&manager->shards[i], CACHE_SHARD_INITIAL_CAPACITY) != 0)
+        {
+            CacheManagerT_delete(manager);
+            goto fail;
+        }
+    }
+
     return manager;
 fail:
     return NULL;
 }
 
+/* Persists whatever is still only in memory so the next start is warm. */
+static void flushToDisk(CacheManagerT *manager)
+{
+    for (size_t i = 0; i < CACHE_SHARD_COUNT; i++)
+    {
+        CacheShardT *shard = &manager->shards[i];
+
+        pthread_mutex_lock(&shard->mutex);
+        for (size_t j = 0; j < shard->capacity; j++)
+        {
+            if (shard->slots[j].entry != NULL)
+            {
+                CacheDiskT_spill(manager->disk, shard->slots[j].entry, 1);
+            }
+        }
+        pthread_mutex_unlock(&shard->mutex);
+    }
+}
+
 void CacheManagerT_delete(CacheManagerT *manager)
 {
     if (manager == NULL)
@@ -28,49 +71,265 @@ void CacheManagerT_delete(CacheManagerT *manager)
         return;
     }
 
-    CacheNodeT *node = manager->nodes;
-    while (node != NULL)
+    if (manager->disk != NULL)
     {
-        CacheNodeT *next = node->next;
-        CacheNodeT_delete(node);
-        node = next;
+        flushToDisk(manager);
+        CacheDiskT_close(manager->disk);
+        free(manager->disk);
+        manager->disk = NULL;
     }
 
-    pthread_mutex_destroy(&manager->entriesMutex);
+    for (size_t i = 0; i < CACHE_SHARD_COUNT; i++)
+    {
+        CacheShardT_destroy(&manager->shards[i]);
+    }
+
+    CachePolicyT_destroy(&manager->policy);
+    CacheSlabT_destroy(&manager->slab);
     free(manager);
 }
 
-CacheNodeT *CacheManagerT_get_CacheNodeT(CacheManagerT *cache, const char *url)
+void CacheManagerT_memoryStats(CacheManagerT *cache, CacheMemoryStatsT *stats)
+{
+    stats->reservedBytes = atomic_load(&cache->slab.reservedBytes);
+    stats->residentBytes = atomic_load(&cache->slab.residentBytes);
+    stats->allocatedBytes = atomic_load(&cache->slab.allocatedBytes);
+    stats->usedBytes = atomic_load(&cache->usedBytes);
+    stats->diskBytes = (cache->disk != NULL) ? atomic_load(&cache->disk->totalBytes) : 0;
+}
+
+int CacheManagerT_attachDisk(CacheManagerT *cache, const char *path, size_t maxBytes)
+{
+    CacheDiskT *disk = malloc(sizeof(CacheDiskT));
+    if (disk == NULL)
+    {
+        return -1;
+    }
+
+    if (CacheDiskT_open(disk, cache, path, maxBytes) != 0)
+    {
+        free(disk);
+        return -1;
+    }
+
+    cache->disk = disk;
+    return 0;
+}
+
+uint64_t CacheManagerT_hashUrl(const char *url)
+{
+    uint64_t hash = FNV_OFFSET_BASIS;
+
+    for (const unsigned char *p = (const unsigned char *)url; *p != '\0'; p++)
+    {
+        hash ^= *p;
+        hash *= FNV_PRIME;
+    }
+
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+static CacheShardT *shardFor(CacheManagerT *cache, uint64_t hash)
+{
+    return &cache->shards[hash >> (64 - CACHE_SHARD_BITS)];
+}
+
+static CacheEntryT *createPlaceholder(CacheManagerT *cache, const char *url, uint64_t hash)
+{
+    CacheEntryT *entry = CacheEntryT_new();
+    if (entry == NULL)
+    {
+        return NULL;
+    }
+
+    entry->url = strdup(url);
+    if (entry->url == NULL)
+    {
+        CacheEntryT_delete(entry);
+        return NULL;
+    }
+
+    entry->urlHash = hash;
+    entry->owner = cache;
+    return entry;
+}
+
+static void chargeEntry(CacheManagerT *cache, CacheEntryT *entry)
+{
+    pthread_mutex_lock(&entry->dataMutex);
+    entry->chargedSize = sizeof(CacheEntryT) + strlen(entry->url) + 1 + entry->downloadedSize -
+                         entry->diskSize;
+    entry->isCharged = 1;
+    CacheManagerT_charge(cache, entry->chargedSize);
+    pthread_mutex_unlock(&entry->dataMutex);
+}
+
+static void unchargeEntry(CacheManagerT *cache, CacheEntryT *entry)
+{
+    pthread_mutex_lock(&entry->dataMutex);
+    if (entry->isCharged)
+    {
+        atomic_fetch_sub(&cache->usedBytes, entry->chargedSize);
+        entry->isCharged = 0;
+    }
+    pthread_mutex_unlock(&entry->dataMutex);
+}
+
+void CacheManagerT_charge(CacheManagerT *cache, size_t bytes)
+{
+    atomic_fetch_add(&cache->usedBytes, bytes);
+}
+
+static void dropEntry(CacheManagerT *cache, CacheEntryT *entry)
+{
+    CacheShardT *shard = shardFor(cache, entry->urlHash);
+
+    pthread_mutex_lock(&shard->mutex);
+    int removed = CacheShardT_remove(shard, entry);
+    pthread_mutex_unlock(&shard->mutex);
+
+    if (removed == 0)
+    {
+        CachePolicyT_unlink(&cache->policy, entry);
+        unchargeEntry(cache, entry);
+        CacheEntryT_release(entry);
+    }
+}
+
+void CacheManagerT_evict(CacheManagerT *cache)
 {
-    CacheNodeT *node = cache->nodes;
+    if (cache->maxBytes == 0)
+    {
+        return;
+    }
 
-    while (node != NULL)
+    while (atomic_load(&cache->usedBytes) > cache->maxBytes)
     {
-        if (node->entry && node->entry->url && strcmp(node->entry->url, url) == 0)
+        CacheEntryT *victim = CachePolicyT_pickVictim(&cache->policy);
+        if (victim == NULL)
         {
-            return node;
+            break;
         }
-        node = node->next;
+
+        if (cache->disk != NULL)
+        {
+            CacheDiskT_spill(cache->disk, victim, 0);
+        }
+        dropEntry(cache, victim);
+        CacheEntryT_release(victim);
     }
+}
 
-    return NULL;
+static int isLargeObject(const CacheEntryT *entry)
+{
+    return entry->downloadedSize - entry->headerSize >= CACHE_DISK_LARGE_OBJECT;
 }
 
-void CacheManagerT_put_CacheNodeT(CacheManagerT *cache, CacheNodeT *node)
+void CacheManagerT_onComplete(CacheManagerT *cache, CacheEntryT *entry)
 {
-    if (node == NULL)
+    if (cache->disk != NULL && isLargeObject(entry))
     {
-        return;
+        CacheDiskT_spill(cache->disk, entry, 0);
     }
+}
 
-    if (cache->nodes == NULL)
+/* Large objects are served from their segment once written; memory is freed. */
+void CacheManagerT_onSpilled(CacheManagerT *cache, CacheEntryT *entry)
+{
+    if (isLargeObject(entry))
     {
-        cache->nodes = node;
-        cache->lastNode = node;
+        dropEntry(cache, entry);
     }
-    else
+}
+
+CacheEntryT *CacheManagerT_acquire_CacheEntryT(CacheManagerT *cache,
+                                               const char *url,
+                                               int *isNew)
+{
+    uint64_t hash = CacheManagerT_hashUrl(url);
+    CacheShardT *shard = shardFor(cache, hash);
+
+    *isNew = 0;
+
+    pthread_mutex_lock(&shard->mutex);
+
+    CacheEntryT *entry = CacheShardT_find(shard, hash, url);
+    int isLoaded = 0;
+
+    if (entry == NULL && cache->disk != NULL)
+    {
+        pthread_mutex_unlock(&shard->mutex);
+        CacheEntryT *loaded = CacheDiskT_load(cache->disk, hash, url);
+        pthread_mutex_lock(&shard->mutex);
+
+        entry = CacheShardT_find(shard, hash, url);
+        if (entry != NULL || loaded == NULL)
+        {
+            CacheEntryT_release(loaded);
+        }
+        else if (CacheShardT_insert(shard, loaded) == 0)
+        {
+            entry = loaded;
+            isLoaded = 1;
+        }
+        else
+        {
+            CacheEntryT_delete(loaded);
+        }
+    }
+
+    if (entry == NULL)
+    {
+        entry = createPlaceholder(cache, url, hash);
+        if (entry == NULL)
+        {
+            goto unlock;
+        }
+
+        if (CacheShardT_insert(shard, entry) != 0)
+        {
+            CacheEntryT_delete(entry);
+            entry = NULL;
+            goto unlock;
+        }
+        *isNew = 1;
+    }
+    else if (!isLoaded)
+    {
+        CachePolicyT_touch(entry);
+    }
+
+    /*
+     * Charged and queued before the shard lock is dropped, so a concurrent
+     * dropEntry always finds the entry in the policy and uncharges it.
+     */
+    if (*isNew || isLoaded)
+    {
+        chargeEntry(cache, entry);
+        CachePolicyT_insert(&cache->policy, entry);
+    }
+
+    CacheEntryT_acquire(entry);
+
+unlock:
+    pthread_mutex_unlock(&shard->mutex);
+
+    if (*isNew || isLoaded)
+    {
+        CacheManagerT_evict(cache);
+    }
+
+    return entry;
+}
+
+void CacheManagerT_remove_CacheEntryT(CacheManagerT *cache, CacheEntryT *entry)
+{
+    if (cache->disk != NULL)
     {
-        cache->lastNode->next = node;
-        cache->lastNode = node;
+        CacheDiskT_remove(cache->disk, entry);
     }
+    dropEntry(cache, entry);
 }
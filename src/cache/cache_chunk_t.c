@@ -17,8 +17,57 @@ CacheEntryChunkT *CacheEntryChunkT_new(size_t dataSize)
     }
 
     chunk->maxDataSize = dataSize;
-    chunk->curDataSize = 0;
-    chunk->next = NULL;
+    atomic_init(&chunk->curDataSize, 0);
+    chunk->fd = -1;
+    chunk->fileOffset = 0;
+    chunk->slab = NULL;
+    chunk->segment = NULL;
+    atomic_init(&chunk->next, NULL);
+
+    return chunk;
+}
+
+CacheEntryChunkT *CacheEntryChunkT_newSlab(CacheSlabT *slab, size_t dataSize)
+{
+    CacheEntryChunkT *chunk = malloc(sizeof(CacheEntryChunkT));
+    if (chunk == NULL)
+    {
+        return NULL;
+    }
+
+    chunk->data = CacheSlabT_alloc(slab, dataSize, &chunk->maxDataSize,
+                                   &chunk->fd, &chunk->fileOffset);
+    if (chunk->data == NULL)
+    {
+        free(chunk);
+        return NULL;
+    }
+
+    atomic_init(&chunk->curDataSize, 0);
+    chunk->slab = slab;
+    chunk->segment = NULL;
+    atomic_init(&chunk->next, NULL);
+
+    return chunk;
+}
+
+/* A chunk whose bytes stay in a disk segment; it is only ever sent with sendfile. */
+CacheEntryChunkT *CacheEntryChunkT_newFile(CacheDiskSegmentT *segment, off_t offset, size_t dataSize)
+{
+    CacheEntryChunkT *chunk = malloc(sizeof(CacheEntryChunkT));
+    if (chunk == NULL)
+    {
+        return NULL;
+    }
+
+    chunk->data = NULL;
+    chunk->maxDataSize = dataSize;
+    atomic_init(&chunk->curDataSize, dataSize);
+    chunk->fd = segment->fd;
+    chunk->fileOffset = offset;
+    chunk->slab = NULL;
+    chunk->segment = CacheDiskSegmentT_acquire(segment);
+    atomic_init(&chunk->next, NULL);
 
     return chunk;
 }
@@ -29,6 +78,18 @@ void CacheEntryChunkT_delete(CacheEntryChunkT *chunk)
     {
         return;
     }
-    free(chunk->data);
+
+    if (chunk->segment != NULL)
+    {
+        CacheDiskSegmentT_release(chunk->segment);
+    }
+    else if (chunk->slab != NULL)
+    {
+        CacheSlabT_free(chunk->slab, chunk->data, chunk->maxDataSize);
+    }
+    else
+    {
+        free(chunk->data);
+    }
     free(chunk);
 }
@@ -0,0 +1,76 @@
+#include "cache.h"
+
+#define CURSOR_UNPLACED ((size_t)-1)
+
+void CacheCursorT_init(CacheCursorT *cursor, CacheEntryT *entry, size_t position)
+{
+    cursor->entry = entry;
+    cursor->position = position;
+    cursor->index = CURSOR_UNPLACED;
+}
+
+static size_t findChunk(const CacheChunkIndexT *index, size_t count, size_t position)
+{
+    size_t low = 0;
+    size_t high = count - 1;
+
+    while (low < high)
+    {
+        size_t middle = low + (high - low + 1) / 2;
+        if (index->refs[middle].offset <= position)
+        {
+            low = middle;
+        }
+        else
+        {
+            high = middle - 1;
+        }
+    }
+    return low;
+}
+
+/*
+ * A cursor that has been placed only moves forward, so it steps to the
+ * following descriptors; the binary search is paid once per cursor.
+ */
+size_t CacheCursorT_readable(CacheCursorT *cursor, CacheEntryChunkT **chunk, size_t *from)
+{
+    CacheEntryT *entry = cursor->entry;
+    size_t count = atomic_load_explicit(&entry->chunkCount, memory_order_acquire);
+
+    if (count == 0)
+    {
+        return 0;
+    }
+
+    const CacheChunkIndexT *index = atomic_load_explicit(&entry->chunkIndex, memory_order_acquire);
+    size_t i = cursor->index;
+
+    if (i == CURSOR_UNPLACED)
+    {
+        i = findChunk(index, count, cursor->position);
+    }
+    while (i + 1 < count && index->refs[i + 1].offset <= cursor->position)
+    {
+        i++;
+    }
+    cursor->index = i;
+
+    const CacheChunkRefT *ref = &index->refs[i];
+    size_t available = atomic_load_explicit(&ref->chunk->curDataSize, memory_order_acquire);
+    size_t offset = cursor->position - ref->offset;
+
+    if (offset >= available)
+    {
+        return 0;
+    }
+
+    *chunk = ref->chunk;
+    *from = offset;
+    return available - offset;
+}
+
+void CacheCursorT_advance(CacheCursorT *cursor, size_t count)
+{
+    cursor->position += count;
+}
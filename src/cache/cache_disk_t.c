@@ -0,0 +1,982 @@
+#include "cache.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define DISK_RECORD_MAGIC 0x43505244u
+#define DISK_LOAD_NUM 3
+#define DISK_LOAD_DEN 4
+
+/*
+ * Segment record: this header, then the url, etag and Last-Modified
+ * strings, then the stored response exactly as it sits in memory.
+ */
+typedef struct DiskRecordHeader
+{
+    uint32_t magic;
+    uint32_t urlLength;
+    uint32_t etagLength;
+    uint32_t lastModifiedLength;
+    uint64_t headerSize;
+    uint64_t dataSize;
+    int64_t expiresAt;
+    uint32_t status;
+    uint32_t reserved;
+} DiskRecordHeader;
+
+/* Index file entry; later records for the same hash supersede earlier ones. */
+typedef struct DiskIndexRecord
+{
+    uint64_t hash;
+    uint32_t segment;
+    uint32_t isRemoved;
+    uint64_t offset;
+    uint64_t length;
+} DiskIndexRecord;
+
+static void formatPath(const CacheDiskT *disk, const char *name, char *path)
+{
+    snprintf(path, PATH_MAX, "%s/%s", disk->path, name);
+}
+
+static void segmentPath(const CacheDiskT *disk, uint32_t id, char *path)
+{
+    snprintf(path, PATH_MAX, "%s/segment-%08u.dat", disk->path, id);
+}
+
+CacheDiskSegmentT *CacheDiskSegmentT_acquire(CacheDiskSegmentT *segment)
+{
+    if (segment != NULL)
+    {
+        atomic_fetch_add(&segment->refCount, 1);
+    }
+    return segment;
+}
+
+void CacheDiskSegmentT_release(CacheDiskSegmentT *segment)
+{
+    if (segment != NULL && atomic_fetch_sub(&segment->refCount, 1) == 1)
+    {
+        close(segment->fd);
+        free(segment);
+    }
+}
+
+static CacheDiskSegmentT *findSegment(const CacheDiskT *disk, uint32_t id)
+{
+    for (CacheDiskSegmentT *segment = disk->oldest; segment != NULL; segment = segment->next)
+    {
+        if (segment->id == id)
+        {
+            return segment;
+        }
+    }
+    return NULL;
+}
+
+static CacheDiskSegmentT *openSegment(CacheDiskT *disk, uint32_t id, int isCreating)
+{
+    char path[PATH_MAX];
+    segmentPath(disk, id, path);
+
+    int fd = open(path, O_RDWR | O_CLOEXEC | (isCreating ? O_CREAT | O_TRUNC : 0), 0644);
+    if (fd < 0)
+    {
+        return NULL;
+    }
+
+    struct stat info;
+    CacheDiskSegmentT *segment = malloc(sizeof(CacheDiskSegmentT));
+    if (segment == NULL || fstat(fd, &info) != 0)
+    {
+        free(segment);
+        close(fd);
+        return NULL;
+    }
+
+    segment->id = id;
+    segment->fd = fd;
+    segment->size = info.st_size;
+    atomic_init(&segment->refCount, 1);
+    segment->next = NULL;
+
+    if (disk->active == NULL)
+    {
+        disk->oldest = segment;
+    }
+    else
+    {
+        disk->active->next = segment;
+    }
+    disk->active = segment;
+    atomic_fetch_add(&disk->totalBytes, (size_t)segment->size);
+    return segment;
+}
+
+static size_t findSlot(const CacheDiskT *disk, uint64_t hash)
+{
+    size_t mask = disk->capacity - 1;
+    size_t i = hash & mask;
+
+    while (disk->slots[i].segment != 0)
+    {
+        if (disk->slots[i].hash == hash)
+        {
+            return i;
+        }
+        i = (i + 1) & mask;
+    }
+    return SIZE_MAX;
+}
+
+static void placeSlot(CacheDiskSlotT *slots, size_t capacity, CacheDiskSlotT slot)
+{
+    size_t mask = capacity - 1;
+    size_t i = slot.hash & mask;
+
+    while (slots[i].segment != 0)
+    {
+        i = (i + 1) & mask;
+    }
+    slots[i] = slot;
+}
+
+static int rebuildSlots(CacheDiskT *disk, size_t capacity)
+{
+    CacheDiskSlotT *slots = calloc(capacity, sizeof(CacheDiskSlotT));
+    if (slots == NULL)
+    {
+        return -1;
+    }
+
+    size_t count = 0;
+    for (size_t i = 0; i < disk->capacity; i++)
+    {
+        if (disk->slots[i].segment != 0)
+        {
+            placeSlot(slots, capacity, disk->slots[i]);
+            count++;
+        }
+    }
+
+    free(disk->slots);
+    disk->slots = slots;
+    disk->capacity = capacity;
+    disk->count = count;
+    return 0;
+}
+
+static int insertSlot(CacheDiskT *disk, CacheDiskSlotT slot)
+{
+    size_t i = findSlot(disk, slot.hash);
+    if (i != SIZE_MAX)
+    {
+        disk->slots[i] = slot;
+        return 0;
+    }
+
+    if ((disk->count + 1) * DISK_LOAD_DEN > disk->capacity * DISK_LOAD_NUM &&
+        rebuildSlots(disk, disk->capacity * 2) != 0)
+    {
+        return -1;
+    }
+
+    placeSlot(disk->slots, disk->capacity, slot);
+    disk->count++;
+    return 0;
+}
+
+/* Backward-shift deletion, as in the shard table. */
+static void removeSlotAt(CacheDiskT *disk, size_t i)
+{
+    size_t mask = disk->capacity - 1;
+    size_t j = i;
+
+    while (1)
+    {
+        j = (j + 1) & mask;
+        if (disk->slots[j].segment == 0)
+        {
+            break;
+        }
+
+        size_t home = disk->slots[j].hash & mask;
+        int inRange = (i <= j) ? (i < home && home <= j)
+                               : (i < home || home <= j);
+        if (!inRange)
+        {
+            disk->slots[i] = disk->slots[j];
+            i = j;
+        }
+    }
+
+    memset(&disk->slots[i], 0, sizeof(CacheDiskSlotT));
+    disk->count--;
+}
+
+static void appendIndex(CacheDiskT *disk, const CacheDiskSlotT *slot, int isRemoved)
+{
+    DiskIndexRecord record = {
+        .hash = slot->hash,
+        .segment = slot->segment,
+        .isRemoved = (uint32_t)isRemoved,
+        .offset = (uint64_t)slot->offset,
+        .length = (uint64_t)slot->length,
+    };
+
+    if (disk->indexFd >= 0 && write(disk->indexFd, &record, sizeof(record)) != sizeof(record))
+    {
+        close(disk->indexFd);
+        disk->indexFd = -1;
+    }
+}
+
+/*
+ * The index is read through a private mapping and replayed in order.
+ * Records that point past the end of a segment, or at a segment that no
+ * longer exists, are skipped; a torn record at the tail is ignored.
+ */
+static void replayIndex(CacheDiskT *disk)
+{
+    char path[PATH_MAX];
+    formatPath(disk, "index.dat", path);
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return;
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size < (off_t)sizeof(DiskIndexRecord))
+    {
+        close(fd);
+        return;
+    }
+
+    const DiskIndexRecord *records = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (records == MAP_FAILED)
+    {
+        return;
+    }
+
+    size_t count = info.st_size / sizeof(DiskIndexRecord);
+    for (size_t i = 0; i < count; i++)
+    {
+        const DiskIndexRecord *record = &records[i];
+
+        if (record->isRemoved)
+        {
+            size_t slot = findSlot(disk, record->hash);
+            if (slot != SIZE_MAX)
+            {
+                removeSlotAt(disk, slot);
+            }
+            continue;
+        }
+
+        CacheDiskSegmentT *segment = findSegment(disk, record->segment);
+        if (segment == NULL || record->offset + record->length > (uint64_t)segment->size)
+        {
+            continue;
+        }
+
+        CacheDiskSlotT slot = {
+            .hash = record->hash,
+            .segment = record->segment,
+            .offset = (off_t)record->offset,
+            .length = (off_t)record->length,
+        };
+        insertSlot(disk, slot);
+    }
+
+    munmap((void *)records, info.st_size);
+}
+
+/* Writes the live slots to a fresh index and reopens it for appending. */
+static int compactIndex(CacheDiskT *disk)
+{
+    char path[PATH_MAX];
+    char tmpPath[PATH_MAX];
+    formatPath(disk, "index.dat", path);
+    formatPath(disk, "index.tmp", tmpPath);
+
+    if (disk->indexFd >= 0)
+    {
+        close(disk->indexFd);
+        disk->indexFd = -1;
+    }
+
+    disk->indexFd = open(tmpPath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (disk->indexFd < 0)
+    {
+        return -1;
+    }
+
+    for (size_t i = 0; i < disk->capacity && disk->indexFd >= 0; i++)
+    {
+        if (disk->slots[i].segment != 0)
+        {
+            appendIndex(disk, &disk->slots[i], 0);
+        }
+    }
+
+    if (disk->indexFd < 0 || rename(tmpPath, path) != 0)
+    {
+        unlink(tmpPath);
+        return -1;
+    }
+
+    close(disk->indexFd);
+    disk->indexFd = open(path, O_WRONLY | O_APPEND | O_CLOEXEC);
+    return (disk->indexFd >= 0) ? 0 : -1;
+}
+
+static int compareIds(const void *a, const void *b)
+{
+    uint32_t left = *(const uint32_t *)a;
+    uint32_t right = *(const uint32_t *)b;
+    return (left > right) - (left < right);
+}
+
+static int openSegments(CacheDiskT *disk)
+{
+    DIR *dir = opendir(disk->path);
+    if (dir == NULL)
+    {
+        return -1;
+    }
+
+    uint32_t *ids = NULL;
+    size_t count = 0;
+    size_t capacity = 0;
+    struct dirent *item;
+
+    while ((item = readdir(dir)) != NULL)
+    {
+        unsigned id;
+        char tail;
+        if (sscanf(item->d_name, "segment-%8u.da%c", &id, &tail) != 2 || tail != 't' || id == 0)
+        {
+            continue;
+        }
+
+        if (count == capacity)
+        {
+            capacity = (capacity == 0) ? 16 : capacity * 2;
+            uint32_t *grown = realloc(ids, capacity * sizeof(uint32_t));
+            if (grown == NULL)
+            {
+                break;
+            }
+            ids = grown;
+        }
+        ids[count++] = id;
+    }
+    closedir(dir);
+
+    qsort(ids, count, sizeof(uint32_t), compareIds);
+    for (size_t i = 0; i < count; i++)
+    {
+        openSegment(disk, ids[i], 0);
+    }
+
+    free(ids);
+    return 0;
+}
+
+/*
+ * Drops the oldest segment; readers still holding it keep the fd alive. Its
+ * slots are removed in place, so this cannot fail part way. A backward shift
+ * can move a later slot into i, which is why i only advances on a keep.
+ */
+static void dropOldestSegment(CacheDiskT *disk)
+{
+    CacheDiskSegmentT *segment = disk->oldest;
+    char path[PATH_MAX];
+
+    for (size_t i = 0; i < disk->capacity;)
+    {
+        if (disk->slots[i].segment == segment->id)
+        {
+            removeSlotAt(disk, i);
+        }
+        else
+        {
+            i++;
+        }
+    }
+
+    segmentPath(disk, segment->id, path);
+    unlink(path);
+
+    disk->oldest = segment->next;
+    atomic_fetch_sub(&disk->totalBytes, (size_t)segment->size);
+    CacheDiskSegmentT_release(segment);
+}
+
+static void enforceLimit(CacheDiskT *disk)
+{
+    while (atomic_load(&disk->totalBytes) > disk->maxBytes && disk->oldest != disk->active)
+    {
+        dropOldestSegment(disk);
+    }
+}
+
+static int writeAll(int fd, const char *data, size_t size, off_t offset)
+{
+    while (size > 0)
+    {
+        ssize_t written = pwrite(fd, data, size, offset);
+        if (written < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (written <= 0)
+        {
+            return -1;
+        }
+        data += written;
+        size -= written;
+        offset += written;
+    }
+    return 0;
+}
+
+/* Writes the entry's data from position start up to end. */
+static int writeData(int fd, CacheEntryT *entry, size_t start, size_t end, off_t offset)
+{
+    CacheCursorT cursor;
+    CacheCursorT_init(&cursor, entry, start);
+
+    while (cursor.position < end)
+    {
+        CacheEntryChunkT *chunk;
+        size_t from;
+        size_t available = CacheCursorT_readable(&cursor, &chunk, &from);
+
+        if (available == 0 || chunk->data == NULL)
+        {
+            return -1;
+        }
+        if (available > end - cursor.position)
+        {
+            available = end - cursor.position;
+        }
+        if (writeAll(fd, chunk->data + from, available, offset + (off_t)(cursor.position - start)) != 0)
+        {
+            return -1;
+        }
+        CacheCursorT_advance(&cursor, available);
+    }
+    return 0;
+}
+
+/*
+ * Builds everything the record holds ahead of the entry's own data. After a
+ * 304 the refreshed header block goes in here too, in place of the stored
+ * one, so it matches the etag and expiry written beside it; *bodyStart is
+ * then where the data left to write begins.
+ */
+static char *buildPrefix(CacheEntryT *entry, size_t *prefixSize, size_t *bodyStart, size_t *dataEnd)
+{
+    pthread_mutex_lock(&entry->dataMutex);
+
+    size_t urlLength = strlen(entry->url);
+    size_t etagLength = (entry->etag != NULL) ? strlen(entry->etag) : 0;
+    size_t lastModifiedLength = (entry->lastModified != NULL) ? strlen(entry->lastModified) : 0;
+    size_t refreshedSize = (entry->refreshedHeaders != NULL) ? entry->refreshedHeaderSize : 0;
+    size_t headerSize = (refreshedSize > 0) ? refreshedSize : entry->headerSize;
+    size_t start = (refreshedSize > 0) ? entry->headerSize : 0;
+    size_t size = sizeof(DiskRecordHeader) + urlLength + etagLength + lastModifiedLength + refreshedSize;
+    char *prefix = malloc(size);
+
+    if (prefix != NULL)
+    {
+        DiskRecordHeader header = {
+            .magic = DISK_RECORD_MAGIC,
+            .urlLength = (uint32_t)urlLength,
+            .etagLength = (uint32_t)etagLength,
+            .lastModifiedLength = (uint32_t)lastModifiedLength,
+            .headerSize = headerSize,
+            .dataSize = refreshedSize + entry->downloadedSize - start,
+            .expiresAt = (int64_t)entry->expiresAt,
+            .status = (uint32_t)entry->responseStatus,
+        };
+        char *p = prefix;
+
+        memcpy(p, &header, sizeof(header));
+        p += sizeof(header);
+        memcpy(p, entry->url, urlLength);
+        p += urlLength;
+        if (etagLength > 0)
+        {
+            memcpy(p, entry->etag, etagLength);
+            p += etagLength;
+        }
+        if (lastModifiedLength > 0)
+        {
+            memcpy(p, entry->lastModified, lastModifiedLength);
+            p += lastModifiedLength;
+        }
+        if (refreshedSize > 0)
+        {
+            memcpy(p, entry->refreshedHeaders, refreshedSize);
+        }
+
+        *prefixSize = size;
+        *bodyStart = start;
+        *dataEnd = entry->downloadedSize;
+    }
+
+    pthread_mutex_unlock(&entry->dataMutex);
+    return prefix;
+}
+
+static CacheDiskSegmentT *writableSegment(CacheDiskT *disk, off_t length)
+{
+    CacheDiskSegmentT *segment = disk->active;
+    if (segment != NULL && segment->size + length <= CACHE_DISK_SEGMENT_SIZE)
+    {
+        return segment;
+    }
+
+    uint32_t id = (segment != NULL) ? segment->id + 1 : 1;
+
+    pthread_mutex_lock(&disk->mutex);
+    segment = openSegment(disk, id, 1);
+    pthread_mutex_unlock(&disk->mutex);
+    return segment;
+}
+
+/*
+ * Runs on the writer thread, which is the only one that appends to
+ * segments, so the data is written without holding the disk mutex.
+ */
+static int writeEntry(CacheDiskT *disk, CacheEntryT *entry)
+{
+    size_t prefixSize;
+    size_t bodyStart;
+    size_t dataEnd;
+    char *prefix = buildPrefix(entry, &prefixSize, &bodyStart, &dataEnd);
+    if (prefix == NULL)
+    {
+        return -1;
+    }
+
+    off_t length = (off_t)(prefixSize + dataEnd - bodyStart);
+    CacheDiskSegmentT *segment = (length <= CACHE_DISK_SEGMENT_SIZE) ? writableSegment(disk, length)
+                                                                      : NULL;
+    if (segment == NULL)
+    {
+        free(prefix);
+        return -1;
+    }
+
+    off_t offset = segment->size;
+    int result = writeAll(segment->fd, prefix, prefixSize, offset);
+    if (result == 0)
+    {
+        result = writeData(segment->fd, entry, bodyStart, dataEnd, offset + (off_t)prefixSize);
+    }
+    free(prefix);
+
+    if (result != 0)
+    {
+        int isTruncated = ftruncate(segment->fd, offset) == 0;
+
+        /* a tail that could not be cut off still takes up space */
+        pthread_mutex_lock(&disk->mutex);
+        if (!isTruncated)
+        {
+            segment->size += length;
+            atomic_fetch_add(&disk->totalBytes, (size_t)length);
+        }
+        disk->writing = NULL;
+        enforceLimit(disk);
+        pthread_mutex_unlock(&disk->mutex);
+        return -1;
+    }
+
+    CacheDiskSlotT slot = {
+        .hash = entry->urlHash,
+        .segment = segment->id,
+        .offset = offset,
+        .length = length,
+    };
+
+    pthread_mutex_lock(&disk->mutex);
+    segment->size += length;
+    atomic_fetch_add(&disk->totalBytes, (size_t)length);
+    if (disk->writing == entry && insertSlot(disk, slot) == 0)
+    {
+        appendIndex(disk, &slot, 0);
+    }
+    else
+    {
+        result = -1;
+    }
+    disk->writing = NULL;
+    enforceLimit(disk);
+    pthread_mutex_unlock(&disk->mutex);
+
+    return result;
+}
+
+static void *writerMain(void *arg)
+{
+    CacheDiskT *disk = arg;
+
+    while (1)
+    {
+        pthread_mutex_lock(&disk->mutex);
+        while (disk->queueHead == NULL && !disk->isStopping)
+        {
+            pthread_cond_wait(&disk->cond, &disk->mutex);
+        }
+
+        CacheDiskSpillT *spill = disk->queueHead;
+        if (spill == NULL)
+        {
+            pthread_mutex_unlock(&disk->mutex);
+            break;
+        }
+
+        disk->queueHead = spill->next;
+        if (disk->queueHead == NULL)
+        {
+            disk->queueTail = NULL;
+        }
+        disk->queuedBytes -= spill->size;
+        disk->writing = spill->entry;
+        pthread_mutex_unlock(&disk->mutex);
+
+        if (writeEntry(disk, spill->entry) == 0)
+        {
+            CacheManagerT_onSpilled(disk->owner, spill->entry);
+        }
+
+        CacheEntryT_release(spill->entry);
+        free(spill);
+    }
+
+    return NULL;
+}
+
+int CacheDiskT_open(CacheDiskT *disk, CacheManagerT *owner, const char *path, size_t maxBytes)
+{
+    memset(disk, 0, sizeof(*disk));
+    disk->owner = owner;
+    disk->maxBytes = maxBytes;
+    disk->indexFd = -1;
+    atomic_init(&disk->totalBytes, 0);
+
+    if (mkdir(path, 0755) != 0 && errno != EEXIST)
+    {
+        return -1;
+    }
+
+    disk->path = strdup(path);
+    disk->capacity = CACHE_DISK_INITIAL_CAPACITY;
+    disk->slots = calloc(disk->capacity, sizeof(CacheDiskSlotT));
+    if (disk->path == NULL || disk->slots == NULL)
+    {
+        goto fail0;
+    }
+
+    if (openSegments(disk) != 0)
+    {
+        goto fail1;
+    }
+
+    replayIndex(disk);
+    enforceLimit(disk);
+    if (compactIndex(disk) != 0)
+    {
+        goto fail1;
+    }
+
+    if (pthread_mutex_init(&disk->mutex, NULL) != 0)
+    {
+        goto fail1;
+    }
+    if (pthread_cond_init(&disk->cond, NULL) != 0)
+    {
+        goto fail2;
+    }
+    if (pthread_create(&disk->writer, NULL, writerMain, disk) != 0)
+    {
+        goto fail3;
+    }
+
+    return 0;
+
+fail3:
+    pthread_cond_destroy(&disk->cond);
+fail2:
+    pthread_mutex_destroy(&disk->mutex);
+fail1:
+    if (disk->indexFd >= 0)
+    {
+        close(disk->indexFd);
+    }
+    while (disk->oldest != NULL)
+    {
+        CacheDiskSegmentT *next = disk->oldest->next;
+        CacheDiskSegmentT_release(disk->oldest);
+        disk->oldest = next;
+    }
+fail0:
+    free(disk->slots);
+    free(disk->path);
+    return -1;
+}
+
+/* Drains the spill queue, then leaves a compacted index behind. */
+void CacheDiskT_close(CacheDiskT *disk)
+{
+    pthread_mutex_lock(&disk->mutex);
+    disk->isStopping = 1;
+    pthread_cond_signal(&disk->cond);
+    pthread_mutex_unlock(&disk->mutex);
+
+    pthread_join(disk->writer, NULL);
+
+    compactIndex(disk);
+    if (disk->indexFd >= 0)
+    {
+        close(disk->indexFd);
+    }
+
+    while (disk->oldest != NULL)
+    {
+        CacheDiskSegmentT *next = disk->oldest->next;
+        CacheDiskSegmentT_release(disk->oldest);
+        disk->oldest = next;
+    }
+
+    pthread_cond_destroy(&disk->cond);
+    pthread_mutex_destroy(&disk->mutex);
+    free(disk->slots);
+    free(disk->path);
+}
+
+/* Queues a complete, cached entry for the writer. Returns 0 if queued. */
+int CacheDiskT_spill(CacheDiskT *disk, CacheEntryT *entry, int isFlushing)
+{
+    pthread_mutex_lock(&entry->dataMutex);
+    int isEligible = entry->status == Success && entry->isCharged && entry->diskSize == 0;
+    size_t size = entry->downloadedSize;
+    pthread_mutex_unlock(&entry->dataMutex);
+
+    if (!isEligible || atomic_exchange(&entry->isSpilled, 1) != 0)
+    {
+        return -1;
+    }
+
+    pthread_mutex_lock(&disk->mutex);
+
+    CacheDiskSpillT *spill = NULL;
+    if (!disk->isStopping && (isFlushing || disk->queuedBytes + size <= CACHE_DISK_QUEUE_MAX_BYTES))
+    {
+        spill = malloc(sizeof(CacheDiskSpillT));
+    }
+
+    if (spill == NULL)
+    {
+        pthread_mutex_unlock(&disk->mutex);
+        atomic_store(&entry->isSpilled, 0);
+        return -1;
+    }
+
+    spill->entry = CacheEntryT_acquire(entry);
+    spill->size = size;
+    spill->next = NULL;
+    if (disk->queueTail != NULL)
+    {
+        disk->queueTail->next = spill;
+    }
+    else
+    {
+        disk->queueHead = spill;
+    }
+    disk->queueTail = spill;
+    disk->queuedBytes += size;
+
+    pthread_cond_signal(&disk->cond);
+    pthread_mutex_unlock(&disk->mutex);
+    return 0;
+}
+
+/*
+ * Forgets the stored copy of an entry's URL and cancels a pending spill of
+ * the entry itself, so a response the proxy has dropped is not reloaded.
+ */
+void CacheDiskT_remove(CacheDiskT *disk, CacheEntryT *entry)
+{
+    CacheDiskSpillT *cancelled = NULL;
+
+    pthread_mutex_lock(&disk->mutex);
+
+    size_t i = findSlot(disk, entry->urlHash);
+    if (i != SIZE_MAX)
+    {
+        CacheDiskSlotT slot = disk->slots[i];
+        removeSlotAt(disk, i);
+        appendIndex(disk, &slot, 1);
+    }
+
+    if (disk->writing == entry)
+    {
+        disk->writing = NULL;
+    }
+
+    CacheDiskSpillT **link = &disk->queueHead;
+    CacheDiskSpillT *previous = NULL;
+    while (*link != NULL)
+    {
+        CacheDiskSpillT *spill = *link;
+        if (spill->entry != entry)
+        {
+            previous = spill;
+            link = &spill->next;
+            continue;
+        }
+
+        *link = spill->next;
+        if (disk->queueTail == spill)
+        {
+            disk->queueTail = previous;
+        }
+        disk->queuedBytes -= spill->size;
+        cancelled = spill;
+        break;
+    }
+
+    pthread_mutex_unlock(&disk->mutex);
+
+    if (cancelled != NULL)
+    {
+        CacheEntryT_release(cancelled->entry);
+        free(cancelled);
+    }
+}
+
+static CacheEntryT *readRecord(CacheDiskT *disk, CacheDiskSegmentT *segment,
+                               const CacheDiskSlotT *slot, const char *url)
+{
+    DiskRecordHeader header;
+    if (pread(segment->fd, &header, sizeof(header), slot->offset) != sizeof(header))
+    {
+        return NULL;
+    }
+
+    size_t urlLength = strlen(url);
+    size_t stringsSize = (size_t)header.urlLength + header.etagLength + header.lastModifiedLength;
+    if (header.magic != DISK_RECORD_MAGIC || header.urlLength != urlLength ||
+        header.headerSize == 0 || header.headerSize > header.dataSize ||
+        header.headerSize > CACHE_CHUNK_MAX_SIZE ||
+        sizeof(header) + stringsSize + header.dataSize != (uint64_t)slot->length)
+    {
+        return NULL;
+    }
+
+    size_t prefixSize = stringsSize + header.headerSize;
+    char *prefix = malloc(prefixSize);
+    if (prefix == NULL)
+    {
+        return NULL;
+    }
+
+    off_t dataOffset = slot->offset + (off_t)(sizeof(header) + stringsSize);
+    if (pread(segment->fd, prefix, prefixSize, slot->offset + sizeof(header)) != (ssize_t)prefixSize ||
+        memcmp(prefix, url, urlLength) != 0)
+    {
+        free(prefix);
+        return NULL;
+    }
+
+    CacheEntryT *entry = CacheEntryT_new();
+    if (entry == NULL)
+    {
+        free(prefix);
+        return NULL;
+    }
+
+    const char *etag = prefix + header.urlLength;
+    const char *lastModified = etag + header.etagLength;
+    size_t bodySize = header.dataSize - header.headerSize;
+
+    entry->url = strdup(url);
+    entry->urlHash = slot->hash;
+    entry->owner = disk->owner;
+    entry->headerSize = header.headerSize;
+    entry->expiresAt = (time_t)header.expiresAt;
+    entry->responseStatus = (int)header.status;
+    entry->etag = (header.etagLength > 0) ? strndup(etag, header.etagLength) : NULL;
+    entry->lastModified = (header.lastModifiedLength > 0)
+                              ? strndup(lastModified, header.lastModifiedLength)
+                              : NULL;
+    entry->diskSize = bodySize;
+    atomic_store(&entry->isSpilled, 1);
+
+    int isLoaded = entry->url != NULL &&
+                   CacheEntryT_appendData(entry, lastModified + header.lastModifiedLength,
+                                          header.headerSize, (bodySize > 0) ? InProcess : Success) != NULL;
+    free(prefix);
+
+    if (isLoaded && bodySize > 0)
+    {
+        CacheEntryChunkT *chunk = CacheEntryChunkT_newFile(segment, dataOffset + header.headerSize,
+                                                           bodySize);
+        if (chunk == NULL || CacheEntryT_appendChunk(entry, chunk, Success) == NULL)
+        {
+            CacheEntryChunkT_delete(chunk);
+            isLoaded = 0;
+        }
+    }
+
+    if (!isLoaded)
+    {
+        CacheEntryT_delete(entry);
+        return NULL;
+    }
+    return entry;
+}
+
+/*
+ * Returns a complete entry built from the stored copy of url, or NULL.
+ * Headers are read into memory; the body stays in the segment file and
+ * is sent from there with sendfile.
+ */
+CacheEntryT *CacheDiskT_load(CacheDiskT *disk, uint64_t hash, const char *url)
+{
+    CacheDiskSegmentT *segment = NULL;
+    CacheDiskSlotT slot;
+
+    pthread_mutex_lock(&disk->mutex);
+    size_t i = findSlot(disk, hash);
+    if (i != SIZE_MAX)
+    {
+        slot = disk->slots[i];
+        segment = CacheDiskSegmentT_acquire(findSegment(disk, slot.segment));
+    }
+    pthread_mutex_unlock(&disk->mutex);
+
+    if (segment == NULL)
+    {
+        return NULL;
+    }
+
+    CacheEntryT *entry = readRecord(disk, segment, &slot, url);
+    CacheDiskSegmentT_release(segment);
+    return entry;
+}
@@ -1,8 +1,11 @@
 #include "cache.h"
+#include "probes.h"
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
-
-#define DEFAULT_CHUNK_SIZE (1024 * 1024)
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
 
 CacheEntryT *CacheEntryT_new(void)
 {
@@ -12,18 +15,15 @@ CacheEntryT *CacheEntryT_new(void)
 
     memset(entry, 0, sizeof(CacheEntryT));
     entry->status = InProcess;
+    atomic_init(&entry->refCount, 1);
+    atomic_init(&entry->sequence, 0);
+    atomic_init(&entry->sleepers, 0);
 
     if (pthread_mutex_init(&entry->dataMutex, NULL) != 0)
         goto fail1;
 
-    if (pthread_cond_init(&entry->dataCond, NULL) != 0)
-        goto fail2;
-
     return entry;
 
-fail2:
-    pthread_mutex_destroy(&entry->dataMutex);
-
 fail1:
     free(entry);
 
@@ -46,12 +46,135 @@ void CacheEntryT_delete(CacheEntryT *entry)
         chunk = next;
     }
 
+    CacheChunkIndexT *index = entry->chunkIndex;
+    while (index != NULL)
+    {
+        CacheChunkIndexT *retired = index->retired;
+        free(index);
+        index = retired;
+    }
+
     free(entry->url);
+    free(entry->etag);
+    free(entry->lastModified);
+    free(entry->refreshedHeaders);
     pthread_mutex_destroy(&entry->dataMutex);
-    pthread_cond_destroy(&entry->dataCond);
     free(entry);
 }
 
+CacheEntryT *CacheEntryT_acquire(CacheEntryT *entry)
+{
+    if (entry != NULL)
+    {
+        atomic_fetch_add(&entry->refCount, 1);
+    }
+    return entry;
+}
+
+void CacheEntryT_release(CacheEntryT *entry)
+{
+    if (entry == NULL)
+    {
+        return;
+    }
+
+    if (atomic_fetch_sub(&entry->refCount, 1) == 1)
+    {
+        CacheEntryT_delete(entry);
+    }
+}
+
+/*
+ * Every published change bumps the sequence. Blocking readers sample it,
+ * check the entry, and futex-wait on the sampled value, so a wakeup that
+ * lands in between is never lost.
+ */
+void CacheEntryT_wakeReaders(CacheEntryT *entry)
+{
+    entry->unwokenBytes = 0;
+    atomic_fetch_add(&entry->sequence, 1);
+
+    if (atomic_load(&entry->sleepers) > 0)
+    {
+        syscall(SYS_futex, &entry->sequence, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+    }
+
+    CacheWaiterT *waiter = entry->waiters;
+    entry->waiters = NULL;
+
+    while (waiter != NULL)
+    {
+        CacheWaiterT *next = waiter->next;
+        waiter->prev = NULL;
+        waiter->next = NULL;
+        waiter->isLinked = 0;
+        waiter->notify(waiter);
+        waiter = next;
+    }
+}
+
+unsigned CacheEntryT_sequence(CacheEntryT *entry)
+{
+    return atomic_load(&entry->sequence);
+}
+
+void CacheEntryT_waitChange(CacheEntryT *entry, unsigned sequence)
+{
+    atomic_fetch_add(&entry->sleepers, 1);
+    PROXY_PROBE2(entry_wait_start, entry, sequence);
+
+    while (atomic_load(&entry->sequence) == sequence)
+    {
+        syscall(SYS_futex, &entry->sequence, FUTEX_WAIT_PRIVATE, sequence, NULL, NULL, 0);
+    }
+
+    PROXY_PROBE1(entry_wait_done, entry);
+    atomic_fetch_sub(&entry->sleepers, 1);
+}
+
+void CacheEntryT_addWaiter(CacheEntryT *entry, CacheWaiterT *waiter)
+{
+    if (waiter->isLinked)
+    {
+        return;
+    }
+
+    waiter->prev = NULL;
+    waiter->next = entry->waiters;
+    if (entry->waiters != NULL)
+    {
+        entry->waiters->prev = waiter;
+    }
+    entry->waiters = waiter;
+    waiter->isLinked = 1;
+}
+
+void CacheEntryT_removeWaiter(CacheEntryT *entry, CacheWaiterT *waiter)
+{
+    if (!waiter->isLinked)
+    {
+        return;
+    }
+
+    if (waiter->prev != NULL)
+    {
+        waiter->prev->next = waiter->next;
+    }
+    else
+    {
+        entry->waiters = waiter->next;
+    }
+
+    if (waiter->next != NULL)
+    {
+        waiter->next->prev = waiter->prev;
+    }
+
+    waiter->prev = NULL;
+    waiter->next = NULL;
+    waiter->isLinked = 0;
+}
+
 void CacheEntryT_updateStatus(CacheEntryT *entry, CacheStatusT status)
 {
     if (entry == NULL)
@@ -60,12 +183,86 @@ void CacheEntryT_updateStatus(CacheEntryT *entry, CacheStatusT status)
     }
     pthread_mutex_lock(&entry->dataMutex);
     entry->status = status;
-    pthread_cond_broadcast(&entry->dataCond);
+    CacheEntryT_wakeReaders(entry);
     pthread_mutex_unlock(&entry->dataMutex);
+
+    if (status == Success && entry->owner != NULL)
+    {
+        CacheManagerT_onComplete(entry->owner, entry);
+    }
 }
 
-static void appendChunk(CacheEntryT *entry, CacheEntryChunkT *chunk)
+/*
+ * Chunks grow geometrically through the slab classes, so a small response
+ * takes one small slot and a large one quickly reaches full-size chunks.
+ */
+static size_t nextChunkSize(const CacheEntryT *entry)
 {
+    size_t count = entry->chunkCount;
+
+    if (count >= CACHE_SLAB_CLASSES - 1)
+    {
+        return CACHE_CHUNK_MAX_SIZE;
+    }
+    return (size_t)CACHE_CHUNK_MIN_SIZE << (CACHE_SLAB_CLASS_SHIFT * count);
+}
+
+static CacheEntryChunkT *newChunk(CacheEntryT *entry)
+{
+    size_t size = nextChunkSize(entry);
+    CacheManagerT *owner = entry->owner;
+
+    if (owner != NULL)
+    {
+        CacheEntryChunkT *chunk = CacheEntryChunkT_newSlab(&owner->slab, size);
+        if (chunk != NULL)
+        {
+            return chunk;
+        }
+    }
+
+    return CacheEntryChunkT_new(size);
+}
+
+static int indexChunk(CacheEntryT *entry, CacheEntryChunkT *chunk)
+{
+    CacheChunkIndexT *index = entry->chunkIndex;
+    size_t count = entry->chunkCount;
+
+    if (index == NULL || count == index->capacity)
+    {
+        size_t capacity = (index == NULL) ? 16 : index->capacity * 2;
+        CacheChunkIndexT *grown = malloc(sizeof(CacheChunkIndexT) + capacity * sizeof(CacheChunkRefT));
+        if (grown == NULL)
+        {
+            return -1;
+        }
+
+        grown->capacity = capacity;
+        grown->retired = index;
+        if (count > 0)
+        {
+            memcpy(grown->refs, index->refs, count * sizeof(CacheChunkRefT));
+        }
+        atomic_store_explicit(&entry->chunkIndex, grown, memory_order_release);
+        index = grown;
+    }
+
+    index->refs[count].chunk = chunk;
+    index->refs[count].offset = (count == 0) ? 0
+                                             : index->refs[count - 1].offset +
+                                                   index->refs[count - 1].chunk->curDataSize;
+    atomic_store_explicit(&entry->chunkCount, count + 1, memory_order_release);
+    return 0;
+}
+
+static int appendChunk(CacheEntryT *entry, CacheEntryChunkT *chunk)
+{
+    if (indexChunk(entry, chunk) != 0)
+    {
+        return -1;
+    }
+
     if (entry->dataChunks == NULL)
     {
         entry->dataChunks = chunk;
@@ -76,7 +273,64 @@ static void appendChunk(CacheEntryT *entry, CacheEntryChunkT *chunk)
         entry->lastChunk->next = chunk;
         entry->lastChunk = chunk;
     }
-    entry->downloadedSize += chunk->maxDataSize;
+    return 0;
+}
+
+static CacheEntryChunkT *growLocked(CacheEntryT *entry)
+{
+    CacheEntryChunkT *chunk = newChunk(entry);
+    if (chunk != NULL && appendChunk(entry, chunk) != 0)
+    {
+        CacheEntryChunkT_delete(chunk);
+        chunk = NULL;
+    }
+
+    if (chunk == NULL)
+    {
+        entry->status = Failed;
+        CacheEntryT_wakeReaders(entry);
+        return NULL;
+    }
+
+    PROXY_PROBE2(chunk_alloc, entry, chunk->maxDataSize);
+    return chunk;
+}
+
+static CacheManagerT *publishLocked(CacheEntryT *entry,
+                                    size_t dataSize,
+                                    CacheStatusT status,
+                                    int isLazy)
+{
+    CacheManagerT *chargedTo = NULL;
+
+    entry->downloadedSize += dataSize;
+    if (entry->isCharged)
+    {
+        entry->chargedSize += dataSize;
+        chargedTo = entry->owner;
+        CacheManagerT_charge(chargedTo, dataSize);
+    }
+
+    entry->status = status;
+    entry->unwokenBytes += dataSize;
+
+    if (!isLazy || status != InProcess || entry->unwokenBytes >= CACHE_WAKE_THRESHOLD)
+    {
+        CacheEntryT_wakeReaders(entry);
+    }
+    return chargedTo;
+}
+
+static void afterPublish(CacheEntryT *entry, CacheManagerT *chargedTo, CacheStatusT status)
+{
+    if (chargedTo != NULL)
+    {
+        CacheManagerT_evict(chargedTo);
+    }
+    if (status == Success && entry->owner != NULL)
+    {
+        CacheManagerT_onComplete(entry->owner, entry);
+    }
 }
 
 CacheEntryChunkT *CacheEntryT_appendData(CacheEntryT *entry,
@@ -91,17 +345,10 @@ CacheEntryChunkT *CacheEntryT_appendData(CacheEntryT *entry,
 
     pthread_mutex_lock(&entry->dataMutex);
 
-    if (entry->dataChunks == NULL)
+    if (entry->dataChunks == NULL && growLocked(entry) == NULL)
     {
-        CacheEntryChunkT *chunk = CacheEntryChunkT_new(DEFAULT_CHUNK_SIZE);
-        if (chunk == NULL)
-        {
-            entry->status = Failed;
-            pthread_cond_broadcast(&entry->dataCond);
-            pthread_mutex_unlock(&entry->dataMutex);
-            return NULL;
-        }
-        appendChunk(entry, chunk);
+        pthread_mutex_unlock(&entry->dataMutex);
+        return NULL;
     }
 
     size_t copied = 0;
@@ -113,16 +360,12 @@ CacheEntryChunkT *CacheEntryT_appendData(CacheEntryT *entry,
 
         if (freeSpace == 0)
         {
-            CacheEntryChunkT *newChunk = CacheEntryChunkT_new(DEFAULT_CHUNK_SIZE);
-            if (newChunk == NULL)
+            current = growLocked(entry);
+            if (current == NULL)
             {
-                entry->status = Failed;
-                pthread_cond_broadcast(&entry->dataCond);
                 pthread_mutex_unlock(&entry->dataMutex);
                 return NULL;
             }
-            appendChunk(entry, newChunk);
-            current = newChunk;
             freeSpace = current->maxDataSize;
         }
 
@@ -132,9 +375,97 @@ CacheEntryChunkT *CacheEntryT_appendData(CacheEntryT *entry,
         copied += toCopy;
     }
 
-    entry->status = status;
-    pthread_cond_broadcast(&entry->dataCond);
+    CacheManagerT *chargedTo = publishLocked(entry, dataSize, status, 0);
     pthread_mutex_unlock(&entry->dataMutex);
 
+    afterPublish(entry, chargedTo, status);
     return (CacheEntryChunkT *)current;
 }
+
+/* Appends a chunk that already holds its data, e.g. one backed by a disk segment. */
+CacheEntryChunkT *CacheEntryT_appendChunk(CacheEntryT *entry, CacheEntryChunkT *chunk,
+                                          CacheStatusT status)
+{
+    pthread_mutex_lock(&entry->dataMutex);
+
+    if (appendChunk(entry, chunk) != 0)
+    {
+        pthread_mutex_unlock(&entry->dataMutex);
+        return NULL;
+    }
+
+    CacheManagerT *chargedTo = publishLocked(entry, chunk->curDataSize, status, 0);
+    pthread_mutex_unlock(&entry->dataMutex);
+
+    afterPublish(entry, chargedTo, status);
+    return chunk;
+}
+
+char *CacheEntryT_reserve(CacheEntryT *entry, size_t *available)
+{
+    pthread_mutex_lock(&entry->dataMutex);
+
+    CacheEntryChunkT *current = entry->lastChunk;
+    if (current == NULL || current->curDataSize == current->maxDataSize)
+    {
+        current = growLocked(entry);
+        if (current == NULL)
+        {
+            pthread_mutex_unlock(&entry->dataMutex);
+            return NULL;
+        }
+    }
+
+    char *slice = current->data + current->curDataSize;
+    *available = current->maxDataSize - current->curDataSize;
+
+    pthread_mutex_unlock(&entry->dataMutex);
+    return slice;
+}
+
+void CacheEntryT_commit(CacheEntryT *entry, size_t dataSize, CacheStatusT status)
+{
+    pthread_mutex_lock(&entry->dataMutex);
+
+    entry->lastChunk->curDataSize += dataSize;
+    CacheManagerT *chargedTo = publishLocked(entry, dataSize, status, 1);
+
+    pthread_mutex_unlock(&entry->dataMutex);
+
+    afterPublish(entry, chargedTo, status);
+}
+
+void CacheEntryT_flush(CacheEntryT *entry)
+{
+    if (entry->unwokenBytes == 0)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&entry->dataMutex);
+    CacheEntryT_wakeReaders(entry);
+    pthread_mutex_unlock(&entry->dataMutex);
+}
+
+int CacheEntryT_hasHeaders(CacheEntryT *entry)
+{
+    size_t committed = 0;
+
+    for (CacheEntryChunkT *chunk = entry->dataChunks; chunk != NULL; chunk = chunk->next)
+    {
+        size_t available = chunk->curDataSize;
+        if (available == 0)
+        {
+            break;
+        }
+
+        committed += available;
+        if (committed >= entry->headerSize)
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
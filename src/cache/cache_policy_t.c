@@ -0,0 +1,236 @@
+#include "cache.h"
+#include <stdlib.h>
+
+/*
+ * S3-FIFO: new objects enter a small FIFO; those hit again before they reach
+ * its tail are promoted to the main FIFO, the rest are evicted and remembered
+ * in a ghost table so a quick re-request goes straight to main. One-hit scans
+ * therefore never displace the working set.
+ */
+
+#define GHOST_SIZE ((size_t)1 << CACHE_GHOST_BITS)
+
+int CachePolicyT_init(CachePolicyT *policy)
+{
+    policy->ghost = calloc(GHOST_SIZE, sizeof(uint64_t));
+    if (policy->ghost == NULL)
+    {
+        return -1;
+    }
+
+    if (pthread_mutex_init(&policy->mutex, NULL) != 0)
+    {
+        free(policy->ghost);
+        policy->ghost = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+void CachePolicyT_destroy(CachePolicyT *policy)
+{
+    if (policy->ghost == NULL)
+    {
+        return;
+    }
+
+    free(policy->ghost);
+    policy->ghost = NULL;
+    pthread_mutex_destroy(&policy->mutex);
+}
+
+static void queuePush(CacheQueueT *queue, CacheEntryT *entry)
+{
+    entry->queuePrev = NULL;
+    entry->queueNext = queue->head;
+
+    if (queue->head != NULL)
+    {
+        queue->head->queuePrev = entry;
+    }
+    else
+    {
+        queue->tail = entry;
+    }
+
+    queue->head = entry;
+    queue->count++;
+}
+
+static void queueRemove(CacheQueueT *queue, CacheEntryT *entry)
+{
+    if (entry->queuePrev != NULL)
+    {
+        entry->queuePrev->queueNext = entry->queueNext;
+    }
+    else
+    {
+        queue->head = entry->queueNext;
+    }
+
+    if (entry->queueNext != NULL)
+    {
+        entry->queueNext->queuePrev = entry->queuePrev;
+    }
+    else
+    {
+        queue->tail = entry->queuePrev;
+    }
+
+    entry->queuePrev = NULL;
+    entry->queueNext = NULL;
+    queue->count--;
+}
+
+static CacheQueueT *queueOf(CachePolicyT *policy, CacheQueueIdT id)
+{
+    return (id == QueueSmall) ? &policy->small : &policy->main;
+}
+
+static int isInFlight(CacheEntryT *entry)
+{
+    pthread_mutex_lock(&entry->dataMutex);
+    int inFlight = (entry->status == InProcess);
+    pthread_mutex_unlock(&entry->dataMutex);
+
+    return inFlight;
+}
+
+void CachePolicyT_insert(CachePolicyT *policy, CacheEntryT *entry)
+{
+    pthread_mutex_lock(&policy->mutex);
+
+    atomic_store(&entry->frequency, 0);
+
+    if (policy->ghost[entry->urlHash & (GHOST_SIZE - 1)] == entry->urlHash)
+    {
+        entry->queue = QueueMain;
+    }
+    else
+    {
+        entry->queue = QueueSmall;
+    }
+    queuePush(queueOf(policy, entry->queue), entry);
+
+    pthread_mutex_unlock(&policy->mutex);
+}
+
+void CachePolicyT_unlink(CachePolicyT *policy, CacheEntryT *entry)
+{
+    pthread_mutex_lock(&policy->mutex);
+
+    if (entry->queue != QueueNone)
+    {
+        queueRemove(queueOf(policy, entry->queue), entry);
+        entry->queue = QueueNone;
+    }
+
+    pthread_mutex_unlock(&policy->mutex);
+}
+
+void CachePolicyT_touch(CacheEntryT *entry)
+{
+    if (atomic_load_explicit(&entry->frequency, memory_order_relaxed) < CACHE_MAX_FREQUENCY)
+    {
+        atomic_fetch_add_explicit(&entry->frequency, 1, memory_order_relaxed);
+    }
+}
+
+static int shouldEvictSmall(const CachePolicyT *policy)
+{
+    size_t total = policy->small.count + policy->main.count;
+
+    if (policy->small.count == 0)
+    {
+        return 0;
+    }
+
+    return policy->main.count == 0 ||
+           policy->small.count * 100 >= total * CACHE_SMALL_QUEUE_PERCENT;
+}
+
+static CacheQueueIdT chooseQueue(const CachePolicyT *policy,
+                                 size_t smallPinned,
+                                 size_t mainPinned)
+{
+    int smallUsable = smallPinned < policy->small.count;
+    int mainUsable = mainPinned < policy->main.count;
+
+    if (smallUsable && (shouldEvictSmall(policy) || !mainUsable))
+    {
+        return QueueSmall;
+    }
+    if (mainUsable)
+    {
+        return QueueMain;
+    }
+    return QueueNone;
+}
+
+CacheEntryT *CachePolicyT_pickVictim(CachePolicyT *policy)
+{
+    CacheEntryT *victim = NULL;
+    size_t smallPinned = 0;
+    size_t mainPinned = 0;
+
+    pthread_mutex_lock(&policy->mutex);
+
+    size_t budget = (policy->small.count + policy->main.count) * (CACHE_MAX_FREQUENCY + 2);
+
+    while (victim == NULL && budget-- > 0)
+    {
+        CacheQueueIdT from = chooseQueue(policy, smallPinned, mainPinned);
+        if (from == QueueNone)
+        {
+            break;
+        }
+
+        CacheQueueT *queue = queueOf(policy, from);
+        CacheEntryT *entry = queue->tail;
+
+        queueRemove(queue, entry);
+
+        if (isInFlight(entry))
+        {
+            queuePush(queue, entry);
+            if (from == QueueSmall)
+            {
+                smallPinned++;
+            }
+            else
+            {
+                mainPinned++;
+            }
+            continue;
+        }
+
+        unsigned frequency = atomic_load(&entry->frequency);
+
+        if (from == QueueSmall && frequency > 1)
+        {
+            atomic_store(&entry->frequency, 0);
+            entry->queue = QueueMain;
+            queuePush(&policy->main, entry);
+            continue;
+        }
+
+        if (from == QueueMain && frequency > 0)
+        {
+            atomic_store(&entry->frequency, frequency - 1);
+            queuePush(queue, entry);
+            continue;
+        }
+
+        if (from == QueueSmall)
+        {
+            policy->ghost[entry->urlHash & (GHOST_SIZE - 1)] = entry->urlHash;
+        }
+
+        entry->queue = QueueNone;
+        victim = CacheEntryT_acquire(entry);
+    }
+
+    pthread_mutex_unlock(&policy->mutex);
+    return victim;
+}
@@ -0,0 +1,152 @@
+#include "cache.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define SHARD_LOAD_NUM 3
+#define SHARD_LOAD_DEN 4
+
+int CacheShardT_init(CacheShardT *shard, size_t capacity)
+{
+    shard->slots = calloc(capacity, sizeof(CacheSlotT));
+    if (shard->slots == NULL)
+    {
+        return -1;
+    }
+
+    if (pthread_mutex_init(&shard->mutex, NULL) != 0)
+    {
+        free(shard->slots);
+        shard->slots = NULL;
+        return -1;
+    }
+
+    shard->capacity = capacity;
+    shard->count = 0;
+    return 0;
+}
+
+void CacheShardT_destroy(CacheShardT *shard)
+{
+    if (shard->slots == NULL)
+    {
+        return;
+    }
+
+    for (size_t i = 0; i < shard->capacity; i++)
+    {
+        CacheEntryT_release(shard->slots[i].entry);
+    }
+
+    free(shard->slots);
+    shard->slots = NULL;
+    pthread_mutex_destroy(&shard->mutex);
+}
+
+CacheEntryT *CacheShardT_find(const CacheShardT *shard, uint64_t hash, const char *url)
+{
+    size_t mask = shard->capacity - 1;
+    size_t i = hash & mask;
+
+    while (shard->slots[i].entry != NULL)
+    {
+        if (shard->slots[i].hash == hash &&
+            strcmp(shard->slots[i].entry->url, url) == 0)
+        {
+            return shard->slots[i].entry;
+        }
+        i = (i + 1) & mask;
+    }
+
+    return NULL;
+}
+
+static void placeSlot(CacheSlotT *slots, size_t capacity, CacheSlotT slot)
+{
+    size_t mask = capacity - 1;
+    size_t i = slot.hash & mask;
+
+    while (slots[i].entry != NULL)
+    {
+        i = (i + 1) & mask;
+    }
+    slots[i] = slot;
+}
+
+static int grow(CacheShardT *shard)
+{
+    size_t newCapacity = shard->capacity * 2;
+    CacheSlotT *newSlots = calloc(newCapacity, sizeof(CacheSlotT));
+    if (newSlots == NULL)
+    {
+        return -1;
+    }
+
+    for (size_t i = 0; i < shard->capacity; i++)
+    {
+        if (shard->slots[i].entry != NULL)
+        {
+            placeSlot(newSlots, newCapacity, shard->slots[i]);
+        }
+    }
+
+    free(shard->slots);
+    shard->slots = newSlots;
+    shard->capacity = newCapacity;
+    return 0;
+}
+
+int CacheShardT_insert(CacheShardT *shard, CacheEntryT *entry)
+{
+    if ((shard->count + 1) * SHARD_LOAD_DEN > shard->capacity * SHARD_LOAD_NUM)
+    {
+        if (grow(shard) != 0)
+        {
+            return -1;
+        }
+    }
+
+    CacheSlotT slot = {.hash = entry->urlHash, .entry = entry};
+    placeSlot(shard->slots, shard->capacity, slot);
+    shard->count++;
+    return 0;
+}
+
+/* Backward-shift deletion keeps probe sequences intact without tombstones. */
+int CacheShardT_remove(CacheShardT *shard, const CacheEntryT *entry)
+{
+    size_t mask = shard->capacity - 1;
+    size_t i = entry->urlHash & mask;
+
+    while (shard->slots[i].entry != entry)
+    {
+        if (shard->slots[i].entry == NULL)
+        {
+            return -1;
+        }
+        i = (i + 1) & mask;
+    }
+
+    size_t j = i;
+    while (1)
+    {
+        j = (j + 1) & mask;
+        if (shard->slots[j].entry == NULL)
+        {
+            break;
+        }
+
+        size_t home = shard->slots[j].hash & mask;
+        int inRange = (i <= j) ? (i < home && home <= j)
+                               : (i < home || home <= j);
+        if (!inRange)
+        {
+            shard->slots[i] = shard->slots[j];
+            i = j;
+        }
+    }
+
+    shard->slots[i].entry = NULL;
+    shard->slots[i].hash = 0;
+    shard->count--;
+    return 0;
+}
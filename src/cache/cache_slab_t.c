@@ -0,0 +1,308 @@
+#include "cache.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define HUGE_PAGE_SIZE ((size_t)2 * 1024 * 1024)
+
+static size_t classSize(size_t index)
+{
+    return (size_t)CACHE_CHUNK_MIN_SIZE << (CACHE_SLAB_CLASS_SHIFT * index);
+}
+
+static int classFor(size_t dataSize)
+{
+    for (size_t i = 0; i < CACHE_SLAB_CLASSES; i++)
+    {
+        if (dataSize <= classSize(i))
+        {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Arenas are aligned to the huge page size so that THP can back them
+ * whole. Pages only become resident when a slot is first written.
+ */
+static char *reserveArena(int useHugePages)
+{
+    size_t length = CACHE_SLAB_ARENA_SIZE + HUGE_PAGE_SIZE;
+    char *raw = mmap(NULL, length, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (raw == MAP_FAILED)
+    {
+        return NULL;
+    }
+
+    char *base = (char *)(((uintptr_t)raw + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+    size_t head = base - raw;
+    size_t tail = length - head - CACHE_SLAB_ARENA_SIZE;
+
+    if (head > 0)
+    {
+        munmap(raw, head);
+    }
+    if (tail > 0)
+    {
+        munmap(base + CACHE_SLAB_ARENA_SIZE, tail);
+    }
+
+    if (useHugePages)
+    {
+        madvise(base, CACHE_SLAB_ARENA_SIZE, MADV_HUGEPAGE);
+    }
+    return base;
+}
+
+/*
+ * A memfd arena is a shared mapping of its own file, so the chunks carved
+ * from it can be sent with sendfile() from the arena's fd.
+ */
+static char *mapArenaFile(int *fd)
+{
+    *fd = memfd_create("cache-arena", MFD_CLOEXEC);
+    if (*fd < 0)
+    {
+        return NULL;
+    }
+
+    if (ftruncate(*fd, CACHE_SLAB_ARENA_SIZE) == 0)
+    {
+        char *base = mmap(NULL, CACHE_SLAB_ARENA_SIZE, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_NORESERVE, *fd, 0);
+        if (base != MAP_FAILED)
+        {
+            return base;
+        }
+    }
+
+    close(*fd);
+    *fd = -1;
+    return NULL;
+}
+
+static void unmapArena(CacheSlabArenaT *arena)
+{
+    munmap(arena->base, CACHE_SLAB_ARENA_SIZE);
+    if (arena->fd >= 0)
+    {
+        close(arena->fd);
+    }
+}
+
+static int addArena(CacheSlabT *slab, CacheSlabClassT *slabClass)
+{
+    size_t slots = CACHE_SLAB_ARENA_SIZE / slabClass->slotSize;
+    CacheSlabArenaT *arena = malloc(sizeof(CacheSlabArenaT));
+    void **freeSlots = realloc(slabClass->freeSlots,
+                               (slabClass->freeCapacity + slots) * sizeof(void *));
+
+    if (freeSlots != NULL)
+    {
+        slabClass->freeSlots = freeSlots;
+        slabClass->freeCapacity += slots;
+    }
+
+    if (arena == NULL || freeSlots == NULL)
+    {
+        free(arena);
+        return -1;
+    }
+
+    arena->fd = -1;
+    arena->liveSlots = 0;
+    arena->base = slab->useMemfd ? mapArenaFile(&arena->fd) : reserveArena(slab->useHugePages);
+    if (arena->base == NULL)
+    {
+        free(arena);
+        return -1;
+    }
+
+    arena->next = slabClass->arenas;
+    slabClass->arenas = arena;
+    slabClass->carve = arena->base;
+    slabClass->carveEnd = arena->base + CACHE_SLAB_ARENA_SIZE;
+    atomic_fetch_add(&slab->reservedBytes, CACHE_SLAB_ARENA_SIZE);
+    return 0;
+}
+
+int CacheSlabT_init(CacheSlabT *slab, int useHugePages, int useMemfd)
+{
+    memset(slab, 0, sizeof(*slab));
+    slab->useHugePages = useHugePages;
+    slab->useMemfd = useMemfd;
+    atomic_init(&slab->reservedBytes, 0);
+    atomic_init(&slab->residentBytes, 0);
+    atomic_init(&slab->allocatedBytes, 0);
+
+    for (size_t i = 0; i < CACHE_SLAB_CLASSES; i++)
+    {
+        CacheSlabClassT *slabClass = &slab->classes[i];
+
+        slabClass->slotSize = classSize(i);
+        slabClass->isReleasing = !useHugePages && slabClass->slotSize >= CACHE_SLAB_RELEASE_SIZE;
+        if (pthread_mutex_init(&slabClass->mutex, NULL) != 0)
+        {
+            slab->classCount = i;
+            CacheSlabT_destroy(slab);
+            return -1;
+        }
+    }
+
+    slab->classCount = CACHE_SLAB_CLASSES;
+    return 0;
+}
+
+void CacheSlabT_destroy(CacheSlabT *slab)
+{
+    for (size_t i = 0; i < slab->classCount; i++)
+    {
+        CacheSlabClassT *slabClass = &slab->classes[i];
+        CacheSlabArenaT *arena = slabClass->arenas;
+
+        while (arena != NULL)
+        {
+            CacheSlabArenaT *next = arena->next;
+            unmapArena(arena);
+            free(arena);
+            arena = next;
+        }
+
+        free(slabClass->freeSlots);
+        pthread_mutex_destroy(&slabClass->mutex);
+    }
+    slab->classCount = 0;
+}
+
+/* Returns the link that points at the arena holding slot. */
+static CacheSlabArenaT **findArena(CacheSlabClassT *slabClass, const char *slot)
+{
+    CacheSlabArenaT **link = &slabClass->arenas;
+
+    while (*link != NULL &&
+           (slot < (*link)->base || slot >= (*link)->base + CACHE_SLAB_ARENA_SIZE))
+    {
+        link = &(*link)->next;
+    }
+    return link;
+}
+
+/*
+ * Unlinks an arena none of whose slots is in use and takes its slots off
+ * the free list. Called with the class mutex held; the caller unmaps it.
+ */
+static void dropArena(CacheSlabT *slab, CacheSlabClassT *slabClass, CacheSlabArenaT **link)
+{
+    CacheSlabArenaT *arena = *link;
+    size_t slots = CACHE_SLAB_ARENA_SIZE / slabClass->slotSize;
+    size_t kept = 0;
+
+    *link = arena->next;
+
+    for (size_t i = 0; i < slabClass->freeCount; i++)
+    {
+        char *slot = slabClass->freeSlots[i];
+        if (slot < arena->base || slot >= arena->base + CACHE_SLAB_ARENA_SIZE)
+        {
+            slabClass->freeSlots[kept++] = slot;
+        }
+    }
+    slabClass->freeCount = kept;
+    slabClass->freeCapacity -= slots;
+
+    atomic_fetch_sub(&slab->reservedBytes, CACHE_SLAB_ARENA_SIZE);
+    if (!slabClass->isReleasing)
+    {
+        atomic_fetch_sub(&slab->residentBytes, slots * slabClass->slotSize);
+    }
+}
+
+/*
+ * Returns a slot of the smallest class that fits dataSize and stores the
+ * slot size in *slotSize, and for memfd arenas the file and offset the
+ * slot maps in *fd and *offset (*fd is -1 otherwise). Freed slots are
+ * reused before new ones are carved from the current arena.
+ */
+char *CacheSlabT_alloc(CacheSlabT *slab, size_t dataSize, size_t *slotSize, int *fd, off_t *offset)
+{
+    int index = classFor(dataSize);
+    if (index < 0)
+    {
+        return NULL;
+    }
+
+    CacheSlabClassT *slabClass = &slab->classes[index];
+    char *slot = NULL;
+
+    pthread_mutex_lock(&slabClass->mutex);
+
+    if (slabClass->freeCount > 0)
+    {
+        slot = slabClass->freeSlots[--slabClass->freeCount];
+        if (slabClass->isReleasing)
+        {
+            atomic_fetch_add(&slab->residentBytes, slabClass->slotSize);
+        }
+    }
+    else if (slabClass->carve != slabClass->carveEnd || addArena(slab, slabClass) == 0)
+    {
+        slot = slabClass->carve;
+        slabClass->carve += slabClass->slotSize;
+        atomic_fetch_add(&slab->residentBytes, slabClass->slotSize);
+    }
+
+    if (slot != NULL)
+    {
+        CacheSlabArenaT *arena = *findArena(slabClass, slot);
+
+        arena->liveSlots++;
+        *fd = arena->fd;
+        *offset = slot - arena->base;
+    }
+
+    pthread_mutex_unlock(&slabClass->mutex);
+
+    if (slot != NULL)
+    {
+        atomic_fetch_add(&slab->allocatedBytes, slabClass->slotSize);
+        *slotSize = slabClass->slotSize;
+    }
+    return slot;
+}
+
+void CacheSlabT_free(CacheSlabT *slab, char *slot, size_t slotSize)
+{
+    CacheSlabClassT *slabClass = &slab->classes[classFor(slotSize)];
+
+    if (slabClass->isReleasing)
+    {
+        /* Dropping pages of a shared mapping leaves them in the file; MADV_REMOVE frees them. */
+        madvise(slot, slotSize, slab->useMemfd ? MADV_REMOVE : MADV_DONTNEED);
+        atomic_fetch_sub(&slab->residentBytes, slotSize);
+    }
+    atomic_fetch_sub(&slab->allocatedBytes, slotSize);
+
+    pthread_mutex_lock(&slabClass->mutex);
+
+    CacheSlabArenaT **link = findArena(slabClass, slot);
+    CacheSlabArenaT *empty = NULL;
+
+    slabClass->freeSlots[slabClass->freeCount++] = slot;
+    if (--(*link)->liveSlots == 0 && *link != slabClass->arenas)
+    {
+        empty = *link;
+        dropArena(slab, slabClass, link);
+    }
+
+    pthread_mutex_unlock(&slabClass->mutex);
+
+    if (empty != NULL)
+    {
+        unmapArena(empty);
+        free(empty);
+    }
+}
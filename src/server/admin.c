@@ -0,0 +1,171 @@
+#include "proxy.h"
+#include "log.h"
+#include "metrics.h"
+#include "buffer.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define ADMIN_BACKLOG 16
+
+static int adminSocket = -1;
+static pthread_t adminThread;
+static CacheManagerT *adminCache = NULL;
+
+static int renderCacheMetrics(Buffer *out, CacheManagerT *cache)
+{
+    CacheMemoryStatsT stats;
+
+    CacheManagerT_memoryStats(cache, &stats);
+
+    if (metricsAppendGauge(out, "proxy_cache_reserved_bytes",
+                           "Address space reserved for cache chunks", stats.reservedBytes) != 0 ||
+        metricsAppendGauge(out, "proxy_cache_resident_bytes",
+                           "Cache chunk memory backed by pages", stats.residentBytes) != 0 ||
+        metricsAppendGauge(out, "proxy_cache_allocated_bytes",
+                           "Cache chunk slots handed out", stats.allocatedBytes) != 0 ||
+        metricsAppendGauge(out, "proxy_cache_used_bytes",
+                           "Bytes charged to cached entries", stats.usedBytes) != 0 ||
+        metricsAppendGauge(out, "proxy_cache_disk_bytes",
+                           "Bytes held by the disk tier", stats.diskBytes) != 0)
+    {
+        return ERROR;
+    }
+    return SUCCESS;
+}
+
+static void serveAdminRequest(int clientSocket, Buffer *request, Buffer *body)
+{
+    HttpMessage message;
+    const char *status = "404 Not Found";
+
+    Buffer_clear(request);
+    Buffer_clear(body);
+
+    int headerEnd = (recvUntilHeaderEnd(clientSocket, request) > 0) ? findHeaderEnd(request) : -1;
+    if (headerEnd < 0 ||
+        parseHttpRequest(get_Buffer_data(request), headerEnd, &message) != SUCCESS)
+    {
+        sendErrorResponse(clientSocket, HTTP_400_BAD_REQUEST, "Invalid request");
+        return;
+    }
+
+    const char *data = get_Buffer_data(request);
+    if (isHttpSlice(data, message.method, "GET") && isHttpSlice(data, message.target, "/metrics"))
+    {
+        if (metricsRender(body) != 0 || renderCacheMetrics(body, adminCache) != SUCCESS)
+        {
+            sendErrorResponse(clientSocket, HTTP_500_INTERNAL_ERROR, "Failed to render metrics");
+            return;
+        }
+        status = "200 OK";
+    }
+
+    char head[256];
+    int length = snprintf(head, sizeof(head),
+                          "HTTP/1.1 %s\r\n"
+                          "Content-Type: text/plain; version=0.0.4\r\n"
+                          "Content-Length: %zu\r\n"
+                          "Connection: close\r\n\r\n",
+                          status, get_Buffer_size(body));
+
+    if (sendAll(clientSocket, head, length) < 0 ||
+        sendAll(clientSocket, get_Buffer_data(body), get_Buffer_size(body)) < 0)
+    {
+        logError("Failed to send admin response");
+    }
+}
+
+/* Scrapes are rare and cheap, so one thread serves them one at a time. */
+static void *adminServerThread(void *args)
+{
+    (void)args;
+
+    Buffer *request = Buffer_create(BUFFER_SIZE);
+    Buffer *body = Buffer_create(BUFFER_SIZE);
+
+    if (request == NULL || body == NULL)
+    {
+        logError("Failed to create admin buffers");
+        goto cleanup;
+    }
+
+    while (1)
+    {
+        int clientSocket = accept4(adminSocket, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (clientSocket < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+            break;
+        }
+
+        serveAdminRequest(clientSocket, request, body);
+        close(clientSocket);
+    }
+
+cleanup:
+    Buffer_destroy(request);
+    Buffer_destroy(body);
+    return NULL;
+}
+
+int startAdminServer(int port, CacheManagerT *cache)
+{
+    int opt = 1;
+    struct sockaddr_in addr = {0};
+
+    adminSocket = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_TCP);
+    if (adminSocket < 0)
+    {
+        logError("Failed to create admin socket");
+        return ERROR;
+    }
+
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+
+    if (setsockopt(adminSocket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0 ||
+        bind(adminSocket, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(adminSocket, ADMIN_BACKLOG) < 0)
+    {
+        logError("Failed to listen on admin port %d", port);
+        goto cleanup;
+    }
+
+    adminCache = cache;
+    if (pthread_create(&adminThread, NULL, adminServerThread, NULL) != 0)
+    {
+        logError("Failed to create admin thread");
+        goto cleanup;
+    }
+
+    logInfo("Metrics available at http://127.0.0.1:%d/metrics", port);
+    return SUCCESS;
+
+cleanup:
+    close(adminSocket);
+    adminSocket = -1;
+    return ERROR;
+}
+
+void stopAdminServer(void)
+{
+    if (adminSocket < 0)
+    {
+        return;
+    }
+
+    /* Wakes the blocked accept so the thread can be joined. */
+    shutdown(adminSocket, SHUT_RDWR);
+    pthread_join(adminThread, NULL);
+    close(adminSocket);
+    adminSocket = -1;
+}
@@ -1,265 +1,670 @@
 #include "proxy.h"
 #include "log.h"
+#include "metrics.h"
+#include "probes.h"
 #include "buffer.h"
 
+#include <errno.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <time.h>
 
-#define METHOD_MAX_LEN 16
-#define URL_MAX_LEN 2048
-#define PROTOCOL_MAX_LEN 16
+#define MAX_LOOKUP_ATTEMPTS 3
 
-static void waitForFirstChunk(CacheNodeT *node)
+static CacheStatusT waitForHeaders(CacheEntryT *entry)
 {
-    CacheEntryT *entry = node->entry;
-
-    pthread_mutex_lock(&entry->dataMutex);
-    while (entry->status != Failed && entry->dataChunks == NULL)
+    while (1)
     {
-        pthread_cond_wait(&entry->dataCond, &entry->dataMutex);
+        unsigned sequence = CacheEntryT_sequence(entry);
+        CacheStatusT status = entry->status;
+
+        if (status != InProcess || CacheEntryT_hasHeaders(entry))
+        {
+            return status;
+        }
+
+        CacheEntryT_waitChange(entry, sequence);
     }
-    pthread_mutex_unlock(&entry->dataMutex);
 }
 
-static void waitForMoreData(CacheEntryT *entry,
-                            CacheEntryChunkT *chunk,
-                            size_t currentSent)
+static ssize_t sendChunkData(int clientSocket, const CacheEntryChunkT *chunk,
+                             size_t from, size_t to)
 {
-    pthread_mutex_lock(&entry->dataMutex);
-    while (entry->status == InProcess &&
-           chunk->next == NULL &&
-           chunk->curDataSize == currentSent)
+    if (chunk->fd >= 0)
     {
-        pthread_cond_wait(&entry->dataCond, &entry->dataMutex);
+        return sendFileAll(clientSocket, chunk->fd, chunk->fileOffset + from, to - from);
     }
-    pthread_mutex_unlock(&entry->dataMutex);
+    return sendAll(clientSocket, chunk->data + from, to - from);
 }
 
-static int sendAllChunks(int clientSocket, CacheEntryT *entry)
+static int sendAllChunks(int clientSocket, CacheEntryT *entry, const CachedBody *body,
+                         RequestTrace *trace)
 {
-    CacheEntryChunkT *chunk = entry->dataChunks;
+    CacheCursorT cursor;
+    size_t remaining = body->end - body->offset;
 
-    while (chunk != NULL)
+    CacheCursorT_init(&cursor, entry, body->offset);
+
+    while (remaining > 0)
     {
-        size_t sent = 0;
+        unsigned sequence = CacheEntryT_sequence(entry);
+        CacheStatusT status = entry->status;
+        CacheEntryChunkT *chunk = NULL;
+        size_t from = 0;
+        size_t available = CacheCursorT_readable(&cursor, &chunk, &from);
 
-        while (1)
+        if (status == Failed)
         {
-            if (entry->status == Failed)
-            {
-                logError("Cache entry failed during send");
-                return ERROR;
-            }
-
-            size_t available = chunk->curDataSize;
-
-            if (sent < available)
-            {
-                if (sendAll(clientSocket, chunk->data + sent, available - sent) < 0)
-                {
-                    logError("Failed to send chunk data");
-                    return ERROR;
-                }
-                sent = available;
-            }
+            logError("Cache entry failed during send");
+            return ERROR;
+        }
 
-            if (chunk->next != NULL || entry->status != InProcess)
+        if (available > 0)
+        {
+            size_t count = (available < remaining) ? available : remaining;
+            if (sendChunkData(clientSocket, chunk, from, from + count) < 0)
             {
-                break;
+                logError("Failed to send chunk data");
+                return ERROR;
             }
+            traceSent(trace, count);
+            CacheCursorT_advance(&cursor, count);
+            remaining -= count;
+            continue;
+        }
 
-            waitForMoreData(entry, chunk, sent);
+        if (status != InProcess)
+        {
+            break;
         }
 
-        chunk = chunk->next;
+        traceSwitch(trace, PhaseSend, PhaseEntryWait);
+        CacheEntryT_waitChange(entry, sequence);
+        traceSwitch(trace, PhaseEntryWait, PhaseSend);
     }
 
-    return (entry->status == Failed) ? ERROR : SUCCESS;
+    if (remaining > 0 && body->end != SIZE_MAX)
+    {
+        logError("Cache entry ended before the requested range");
+        return ERROR;
+    }
+
+    return SUCCESS;
 }
 
-static int sendFromCache(int clientSocket, CacheNodeT *node)
+static int sendFromCache(int clientSocket, CacheEntryT *entry, const ByteRange *range,
+                         Buffer *head, int *keepAlive, RequestTrace *trace)
 {
+    CachedBody body;
+
     logDebug("Sending data from cache");
 
-    waitForFirstChunk(node);
+    traceEnter(trace, PhaseEntryWait);
+    waitForHeaders(entry);
+    traceSwitch(trace, PhaseEntryWait, PhaseSend);
 
-    if (node->entry->dataChunks == NULL)
+    if (!CacheEntryT_hasHeaders(entry))
     {
         logError("No data chunks available");
         return ERROR;
     }
 
-    return sendAllChunks(clientSocket, node->entry);
+    if (buildCachedResponseHead(entry, range, *keepAlive, head, keepAlive, &body) != SUCCESS ||
+        sendAll(clientSocket, get_Buffer_data(head), get_Buffer_size(head)) < 0)
+    {
+        logError("Failed to send response headers");
+        return ERROR;
+    }
+    trace->status = body.status;
+    traceSent(trace, get_Buffer_size(head));
+
+    return sendAllChunks(clientSocket, entry, &body, trace);
 }
 
-static int forwardResponse(int clientSocket, int remoteSocket, Buffer *buffer)
+static int exchangeWithOrigin(const Buffer *request,
+                              const char *host,
+                              int port,
+                              Buffer *response,
+                              RequestTrace *trace)
 {
-    logDebug("Forwarding response without caching");
+    int isReused = 0;
+    int canRetry = isIdempotentRequest(request);
 
     while (1)
     {
-        Buffer_clear(buffer);
+        logDebug("Connecting to %s:%d", host, port);
 
-        ssize_t n = recvToBuffer(remoteSocket, buffer);
+        int remoteSocket = connectToOrigin(host, port, &isReused, trace);
+        if (remoteSocket < 0)
+        {
+            logError("Failed to connect to %s:%d", host, port);
+            return ERROR;
+        }
 
-        if (n <= 0)
+        if (sendAll(remoteSocket, get_Buffer_data(request), get_Buffer_size(request)) >= 0)
         {
-            break;
+            traceEnter(trace, PhaseOriginWait);
+
+            ssize_t received = recvUntilHeaderEnd(remoteSocket, response);
+            uint64_t firstByte = traceLeave(trace, PhaseOriginWait);
+
+            if (received > 0)
+            {
+                metricsObserve(HistogramOriginFirstByte, firstByte);
+                logDebug("Received response headers");
+                return remoteSocket;
+            }
         }
 
-        if (sendAll(clientSocket, get_Buffer_data(buffer), get_Buffer_size(buffer)) < 0)
+        close(remoteSocket);
+
+        if (!isReused || !canRetry)
         {
-            logError("Failed to forward response");
+            logError("Failed to receive response from remote");
             return ERROR;
         }
-    }
 
-    return SUCCESS;
+        logDebug("Pooled connection failed, retrying on a fresh one");
+    }
 }
 
-static CacheNodeT *startDownload(Buffer *buffer,
-                                 const char *host,
-                                 int port,
-                                 int clientSocket,
-                                 const char *url,
-                                 int *isCacheable)
+static int relayResponse(int clientSocket,
+                         int remoteSocket,
+                         const char *host,
+                         int port,
+                         Buffer *response,
+                         int isHead,
+                         int *keepAlive,
+                         RequestTrace *trace)
 {
-    int remoteSocket = -1;
-    CacheNodeT *node = NULL;
-    CacheEntryT *entry = NULL;
+    ResponseFrame frame = {0};
+    Buffer *head = NULL;
+    int result = ERROR;
+    int headerEnd = findHeaderEnd(response);
+    const char *data = Buffer_asString(response);
 
-    *isCacheable = 0;
+    logDebug("Forwarding response without caching");
 
-    logDebug("Connecting to remote host");
+    if (headerEnd < 0 || data == NULL)
+    {
+        logError("Malformed response from remote");
+        sendErrorResponse(clientSocket, HTTP_502_BAD_GATEWAY, "Malformed response");
+        goto cleanup;
+    }
 
-    remoteSocket = connectToHost(host, port);
-    if (remoteSocket < 0)
+    head = Buffer_create(BUFFER_SIZE);
+    if (head == NULL)
     {
-        logError("Failed to connect to remote host");
-        sendErrorResponse(clientSocket, HTTP_502_BAD_GATEWAY, "Failed to connect");
-        return NULL;
+        goto cleanup;
     }
 
-    logDebug("Sending request to remote");
+    size_t extra = get_Buffer_size(response) - headerEnd;
+    parseResponseFrame(data, headerEnd, isHead, &frame, NULL);
+    frame.isRequestSent = 1;
+    trace->status = frame.status;
+    traceEnter(trace, PhaseSend);
+    size_t body = advanceResponseFrame(&frame, data + headerEnd, extra);
+    if (body < extra)
+    {
+        frame.keepAlive = 0;
+    }
 
-    if (sendAll(remoteSocket, get_Buffer_data(buffer), get_Buffer_size(buffer)) < 0)
+    if (buildRelayedResponseHead(data, &frame, *keepAlive, head, keepAlive) != SUCCESS ||
+        sendAll(clientSocket, get_Buffer_data(head), get_Buffer_size(head)) < 0 ||
+        sendAll(clientSocket, data + headerEnd, body) < 0)
     {
-        logError("Failed to send request to remote");
-        sendErrorResponse(clientSocket, HTTP_502_BAD_GATEWAY, "Failed to send request");
-        goto cleanup_socket;
+        logError("Failed to send response headers");
+        goto cleanup;
     }
+    traceSent(trace, get_Buffer_size(head) + body);
+
+    while (!frame.isComplete)
+    {
+        Buffer_clear(response);
+
+        char *slice = Buffer_writePtr(response);
+        ssize_t n = recvWithTimeout(remoteSocket, slice,
+                                    limitResponseRead(&frame, Buffer_available(response)),
+                                    SOCKET_TIMEOUT_SEC);
+        if (n < 0)
+        {
+            goto cleanup;
+        }
+
+        if (n == 0)
+        {
+            endResponseFrame(&frame);
+            if (!frame.isComplete)
+            {
+                logError("Remote closed before end of response");
+                goto cleanup;
+            }
+            break;
+        }
 
-    logDebug("Waiting for response headers");
+        size_t used = advanceResponseFrame(&frame, slice, n);
+        if (used < (size_t)n)
+        {
+            frame.keepAlive = 0;
+        }
 
-    ssize_t received = recvUntilHeaderEnd(remoteSocket, buffer);
-    if (received <= 0)
+        if (sendAll(clientSocket, slice, used) < 0)
+        {
+            logError("Failed to forward response");
+            goto cleanup;
+        }
+        traceSent(trace, used);
+    }
+
+    result = SUCCESS;
+
+cleanup:
+    if (result != SUCCESS)
     {
-        logError("Failed to receive response headers");
-        sendErrorResponse(clientSocket, HTTP_502_BAD_GATEWAY, "Failed to receive response");
-        goto cleanup_socket;
+        *keepAlive = 0;
     }
+    finishOriginSocket(host, port, remoteSocket, &frame);
+    Buffer_destroy(head);
+    return result;
+}
 
-    logDebug("Received response headers");
+/*
+ * Stores the origin's response in a new entry. remoteSocket is -1 to send
+ * the request first, or a socket whose response is already in `response`.
+ */
+static int startDownload(CacheEntryT *entry,
+                         Buffer *buffer,
+                         Buffer *response,
+                         int remoteSocket,
+                         const char *host,
+                         int port,
+                         int clientSocket,
+                         int *isCacheable,
+                         int *keepAlive,
+                         RequestTrace *trace)
+{
+    ResponseFrame frame;
+    HttpMessage message;
 
-    const char *responseData = Buffer_asString(buffer);
+    *isCacheable = 0;
 
-    if (!isResponse200(responseData))
+    if (remoteSocket < 0)
     {
-        logDebug("Response is not 200 OK, forwarding without cache");
-        if (sendAll(clientSocket, get_Buffer_data(buffer), get_Buffer_size(buffer)) < 0)
+        remoteSocket = exchangeWithOrigin(buffer, host, port, response, trace);
+        if (remoteSocket < 0)
         {
-            logError("Failed sendall");
+            sendErrorResponse(clientSocket, HTTP_502_BAD_GATEWAY, "Failed to fetch");
+            return ERROR;
         }
-        if (forwardResponse(clientSocket, remoteSocket, buffer) < 0)
+    }
+
+    const char *responseData = Buffer_asString(response);
+    int headerEnd = findHeaderEnd(response);
+
+    if (headerEnd >= 0)
+    {
+        parseResponseFrame(responseData, headerEnd, 0, &frame, &message);
+        frame.isRequestSent = 1;
+    }
+
+    if (headerEnd < 0 || !isStatusCacheable(frame.status) ||
+        !isResponseStorable(responseData, &message))
+    {
+        logDebug("Response is not cacheable, forwarding without cache");
+        if (relayResponse(clientSocket, remoteSocket, host, port, response, 0, keepAlive,
+                          trace) != SUCCESS)
         {
-            logError("Failed sendall");
+            logError("Failed to forward response");
         }
-        goto cleanup_socket;
+        return SUCCESS;
     }
 
-    logDebug("Response is 200 OK, starting cache");
+    logDebug("Response is cacheable, starting cache");
     *isCacheable = 1;
 
-    node = CacheNodeT_new();
-    entry = CacheEntryT_new();
+    size_t extra = get_Buffer_size(response) - headerEnd;
+    size_t body = advanceResponseFrame(&frame, responseData + headerEnd, extra);
+    if (body < extra)
+    {
+        frame.keepAlive = 0;
+    }
+
+    updateEntryFreshness(entry, responseData, &message);
+    entry->headerSize = headerEnd;
 
-    if (node == NULL || entry == NULL)
+    if (CacheEntryT_appendData(entry, responseData, headerEnd + body,
+                               frame.isComplete ? Success : InProcess) == NULL)
     {
-        logError("Failed to create cache structures");
+        logError("Failed to store response headers");
         sendErrorResponse(clientSocket, HTTP_500_INTERNAL_ERROR, "Cache allocation failed");
-        goto cleanup_cache;
+        goto cleanup_socket;
     }
 
-    entry->url = strdup(url);
-    if (entry->url == NULL)
+    if (frame.isComplete)
     {
-        logError("Failed to duplicate URL");
-        sendErrorResponse(clientSocket, HTTP_500_INTERNAL_ERROR, "Memory allocation failed");
-        goto cleanup_cache;
+        metricsObserve(HistogramObjectSize, entry->downloadedSize - entry->headerSize);
+        finishOriginSocket(host, port, remoteSocket, &frame);
+        return SUCCESS;
     }
 
-    CacheEntryT_appendData(entry, get_Buffer_data(buffer), get_Buffer_size(buffer), InProcess);
-
-    if (startBackgroundUpload(entry, buffer, remoteSocket) != SUCCESS)
+    if (startBackgroundUpload(entry, remoteSocket, host, port, &frame) != SUCCESS)
     {
         logError("Failed to start background upload");
         sendErrorResponse(clientSocket, HTTP_500_INTERNAL_ERROR, "Failed to start download");
-        goto cleanup_cache;
+        goto cleanup_socket;
     }
 
-    node->entry = entry;
-    return node;
-
-cleanup_cache:
-    CacheEntryT_delete(entry);
-    CacheNodeT_delete(node);
+    return SUCCESS;
 
 cleanup_socket:
+    close(remoteSocket);
+    return ERROR;
+}
+
+static int handleOther(Buffer *buffer,
+                       Buffer *response,
+                       const char *host,
+                       int port,
+                       int clientSocket,
+                       int *keepAlive,
+                       RequestTrace *trace)
+{
+    logDebug("Handling non-GET request");
+
+    trace->cacheResult = "pass";
+
+    int remoteSocket = exchangeWithOrigin(buffer, host, port, response, trace);
+    if (remoteSocket < 0)
+    {
+        sendErrorResponse(clientSocket, HTTP_502_BAD_GATEWAY, "Failed to fetch");
+        return ERROR;
+    }
+
+    if (relayResponse(clientSocket, remoteSocket, host, port, response,
+                      isHeadRequest(buffer), keepAlive, trace) != SUCCESS)
+    {
+        logError("Failed to forward response");
+        return ERROR;
+    }
+
+    logDebug("Non-GET request finished");
+    return SUCCESS;
+}
+
+/*
+ * A 304 refreshes the entry. Any other answer is a full response to the
+ * GET; its socket is handed back in *originSocket with the response left
+ * in `response`, so the caller stores it instead of fetching it again.
+ */
+static int revalidateEntry(CacheEntryT *entry,
+                           Buffer *buffer,
+                           Buffer *response,
+                           const char *host,
+                           int port,
+                           int *originSocket,
+                           RequestTrace *trace)
+{
+    int result = ERROR;
+    int remoteSocket = -1;
+    ResponseFrame frame = {0};
+    HttpMessage message;
+    Buffer *conditional = Buffer_create(BUFFER_SIZE);
+
+    if (conditional == NULL)
+    {
+        logError("Failed to create revalidation buffer");
+        return ERROR;
+    }
+
+    if (buildConditionalRequest(buffer, entry, conditional) != SUCCESS)
+    {
+        logDebug("Stale entry has no validators");
+        goto cleanup;
+    }
+
+    remoteSocket = exchangeWithOrigin(conditional, host, port, response, trace);
+    if (remoteSocket < 0)
+    {
+        logError("Failed to revalidate entry");
+        goto cleanup;
+    }
+
+    const char *responseData = Buffer_asString(response);
+    int headerEnd = findHeaderEnd(response);
+    if (headerEnd < 0)
+    {
+        logError("Malformed revalidation response");
+        goto cleanup;
+    }
+
+    parseResponseFrame(responseData, headerEnd, 0, &frame, &message);
+    frame.isRequestSent = 1;
+    if (frame.status != 304)
+    {
+        logDebug("Entry changed at origin");
+        *originSocket = remoteSocket;
+        remoteSocket = -1;
+        result = SUCCESS;
+        goto cleanup;
+    }
+
+    if (get_Buffer_size(response) > (size_t)headerEnd)
+    {
+        frame.keepAlive = 0;
+    }
+
+    if (refreshEntryHeaders(entry, responseData, &message) != SUCCESS)
+    {
+        updateEntryFreshness(entry, responseData, &message);
+    }
+    logDebug("Entry revalidated");
+    result = SUCCESS;
+
+cleanup:
     if (remoteSocket >= 0)
     {
-        close(remoteSocket);
+        finishOriginSocket(host, port, remoteSocket, &frame);
     }
-    return NULL;
+    Buffer_destroy(conditional);
+    return result;
+}
+
+static int ensureFresh(CacheManagerT *cache,
+                       CacheEntryT *entry,
+                       Buffer *buffer,
+                       Buffer *response,
+                       const char *host,
+                       int port,
+                       int *originSocket,
+                       RequestTrace *trace)
+{
+    while (1)
+    {
+        unsigned sequence = CacheEntryT_sequence(entry);
+
+        pthread_mutex_lock(&entry->dataMutex);
+        if (!entry->isRevalidating)
+        {
+            break;
+        }
+        pthread_mutex_unlock(&entry->dataMutex);
+
+        CacheEntryT_waitChange(entry, sequence);
+    }
+
+    if (entry->isDropped)
+    {
+        pthread_mutex_unlock(&entry->dataMutex);
+        return ERROR;
+    }
+
+    if (entry->status == Failed)
+    {
+        pthread_mutex_unlock(&entry->dataMutex);
+        logDebug("Dropping failed entry");
+        CacheManagerT_remove_CacheEntryT(cache, entry);
+        return ERROR;
+    }
+
+    int isFresh = (entry->status != Success || time(NULL) < entry->expiresAt);
+    if (!isFresh)
+    {
+        entry->isRevalidating = 1;
+    }
+    pthread_mutex_unlock(&entry->dataMutex);
+
+    if (isFresh)
+    {
+        return SUCCESS;
+    }
+
+    logDebug("Revalidating stale entry");
+    metricsAdd(CounterRevalidations, 1);
+
+    int result = revalidateEntry(entry, buffer, response, host, port, originSocket, trace);
+    int isDropped = (result != SUCCESS || *originSocket >= 0);
+    if (isDropped)
+    {
+        CacheManagerT_remove_CacheEntryT(cache, entry);
+    }
+
+    pthread_mutex_lock(&entry->dataMutex);
+    entry->isDropped = isDropped;
+    entry->isRevalidating = 0;
+    CacheEntryT_wakeReaders(entry);
+    pthread_mutex_unlock(&entry->dataMutex);
+
+    return result;
+}
+
+static int fillEntry(CacheManagerT *cache,
+                     CacheEntryT *entry,
+                     Buffer *buffer,
+                     Buffer *response,
+                     int remoteSocket,
+                     const char *host,
+                     int port,
+                     int clientSocket,
+                     int *isCacheable,
+                     int *keepAlive,
+                     RequestTrace *trace)
+{
+    int result = startDownload(entry, buffer, response, remoteSocket, host, port,
+                               clientSocket, isCacheable, keepAlive, trace);
+
+    if (result != SUCCESS || !*isCacheable)
+    {
+        CacheManagerT_remove_CacheEntryT(cache, entry);
+        CacheEntryT_updateStatus(entry, (result == SUCCESS) ? Uncacheable : Failed);
+    }
+
+    return result;
 }
 
 static int handleGet(CacheManagerT *cache,
                      Buffer *buffer,
+                     Buffer *response,
                      const char *host,
                      int port,
                      int clientSocket,
-                     const char *url)
+                     const char *url,
+                     const ByteRange *range,
+                     int *keepAlive,
+                     RequestTrace *trace)
 {
     int result = ERROR;
+    int isNew = 0;
+    int originSocket = -1;
+    CacheEntryT *entry = NULL;
+
+    for (int attempt = 0; attempt < MAX_LOOKUP_ATTEMPTS && entry == NULL; attempt++)
+    {
+        traceEnter(trace, PhaseLookup);
+        entry = CacheManagerT_acquire_CacheEntryT(cache, url, &isNew);
+        metricsObserve(HistogramCacheLookup, traceLeave(trace, PhaseLookup));
+        if (entry == NULL)
+        {
+            logError("Failed to create cache entry");
+            sendErrorResponse(clientSocket, HTTP_500_INTERNAL_ERROR, "Cache allocation failed");
+            return ERROR;
+        }
+
+        if (isNew)
+        {
+            break;
+        }
 
-    pthread_mutex_lock(&cache->entriesMutex);
+        int isFresh = (ensureFresh(cache, entry, buffer, response, host, port,
+                                   &originSocket, trace) == SUCCESS);
+        if (isFresh && originSocket >= 0)
+        {
+            /* The origin sent a new response instead of a 304; it fills a new entry. */
+            CacheEntryT_release(entry);
+            entry = CacheManagerT_acquire_CacheEntryT(cache, url, &isNew);
+            break;
+        }
 
-    CacheNodeT *node = CacheManagerT_get_CacheNodeT(cache, url);
+        if (!isFresh || (waitForHeaders(entry) == Failed && entry->dataChunks == NULL))
+        {
+            CacheEntryT_release(entry);
+            entry = NULL;
+        }
+    }
 
-    if (node == NULL)
+    if (originSocket >= 0 && (entry == NULL || !isNew))
     {
-        logDebug("Cache MISS");
+        close(originSocket);
+        originSocket = -1;
+    }
+
+    if (entry == NULL)
+    {
+        logError("Failed to obtain a fresh cache entry for %s", url);
+        sendErrorResponse(clientSocket, HTTP_502_BAD_GATEWAY, "Failed to refresh");
+        return ERROR;
+    }
+
+    if (isNew)
+    {
+        logDebug("Cache MISS %s", url);
+        metricsAdd(CounterCacheMisses, 1);
+        PROXY_PROBE1(cache_miss, url);
+        trace->cacheResult = "miss";
 
         int isCacheable = 0;
-        node = startDownload(buffer, host, port, clientSocket, url, &isCacheable);
+        result = fillEntry(cache, entry, buffer, response, originSocket, host, port,
+                           clientSocket, &isCacheable, keepAlive, trace);
 
-        if (node == NULL)
+        if (result != SUCCESS || !isCacheable)
         {
-            pthread_mutex_unlock(&cache->entriesMutex);
-            return ERROR;
+            CacheEntryT_release(entry);
+            return result;
         }
-
-        CacheManagerT_put_CacheNodeT(cache, node);
     }
     else
     {
-        logDebug("Cache HIT");
-    }
+        logDebug("Cache HIT %s", url);
+        metricsAdd(CounterCacheHits, 1);
+        PROXY_PROBE1(cache_hit, url);
+        trace->cacheResult = "hit";
+
+        traceEnter(trace, PhaseEntryWait);
+        CacheStatusT status = waitForHeaders(entry);
+        traceLeave(trace, PhaseEntryWait);
 
-    pthread_mutex_unlock(&cache->entriesMutex);
+        if (status == Uncacheable)
+        {
+            logDebug("Coalesced response is not cacheable, fetching directly");
+            CacheEntryT_release(entry);
+            return handleOther(buffer, response, host, port, clientSocket, keepAlive, trace);
+        }
+    }
 
-    result = sendFromCache(clientSocket, node);
+    result = sendFromCache(clientSocket, entry, range, buffer, keepAlive, trace);
+    CacheEntryT_release(entry);
 
     if (result == SUCCESS)
     {
@@ -273,131 +678,188 @@ static int handleGet(CacheManagerT *cache,
     return result;
 }
 
-static int handleOther(Buffer *buffer,
-                       const char *host,
-                       int port,
-                       int clientSocket)
+static int waitForNextRequest(int clientSocket)
 {
-    int remoteSocket = -1;
-    int result = ERROR;
-
-    logDebug("Handling non-GET request");
-
-    remoteSocket = connectToHost(host, port);
-    if (remoteSocket < 0)
+    for (int waited = 0; waited < KEEPALIVE_TIMEOUT_SEC && !serverShutdown; waited++)
     {
-        logError("Failed to connect to remote host");
-        sendErrorResponse(clientSocket, HTTP_502_BAD_GATEWAY, "Failed to connect");
-        return ERROR;
+        if (waitForReadable(clientSocket, 1) == SUCCESS)
+        {
+            return SUCCESS;
+        }
+        if (errno != ETIMEDOUT)
+        {
+            return ERROR;
+        }
     }
 
-    if (sendAll(remoteSocket, get_Buffer_data(buffer), get_Buffer_size(buffer)) < 0)
-    {
-        logError("Failed to send request");
-        sendErrorResponse(clientSocket, HTTP_502_BAD_GATEWAY, "Failed to send request");
-        goto cleanup;
-    }
+    logDebug("Keep-alive connection idle, closing");
+    return ERROR;
+}
 
-    ssize_t received = recvUntilHeaderEnd(remoteSocket, buffer);
-    if (received <= 0)
-    {
-        logError("Failed to receive response");
-        sendErrorResponse(clientSocket, HTTP_502_BAD_GATEWAY, "Failed to receive response");
-        goto cleanup;
-    }
+/* *receiveTime is when the request started arriving, after any keep-alive idle wait. */
+static int recvRequest(int clientSocket, Buffer *request, RequestFrame *frame, int isFirst,
+                       uint64_t *receiveTime)
+{
+    *receiveTime = metricsNow();
 
-    if (sendAll(clientSocket, get_Buffer_data(buffer), get_Buffer_size(buffer)) < 0)
+    while (parseRequestFrame(request, frame) != SUCCESS)
     {
-        logError("Failed to send response headers");
-        goto cleanup;
+        if (!isFirst && get_Buffer_size(request) == 0)
+        {
+            if (waitForNextRequest(clientSocket) != SUCCESS)
+            {
+                return ERROR;
+            }
+            *receiveTime = metricsNow();
+        }
+        if (recvToBuffer(clientSocket, request) <= 0)
+        {
+            return ERROR;
+        }
     }
 
-    if (forwardResponse(clientSocket, remoteSocket, buffer) < 0)
+    while (advanceRequestFrame(request, frame) != SUCCESS)
     {
-        logError("Failed to forward response body");
-        goto cleanup;
+        if (recvToBuffer(clientSocket, request) <= 0)
+        {
+            return ERROR;
+        }
     }
 
-    logDebug("Non-GET request finished");
-    result = SUCCESS;
+    return SUCCESS;
+}
 
-cleanup:
-    if (remoteSocket >= 0)
-    {
-        close(remoteSocket);
-    }
+static int finishTrace(RequestTrace *trace, const char *url, int result)
+{
+    traceFinish(trace, url, result != SUCCESS);
     return result;
 }
 
-static int processRequest(CacheManagerT *cache, Buffer *buffer, int clientSocket)
+static int processRequest(CacheManagerT *cache,
+                          Buffer *request,
+                          Buffer *buffer,
+                          Buffer *response,
+                          int clientSocket,
+                          int isFirst,
+                          int *keepAlive)
 {
-    char method[METHOD_MAX_LEN];
     char url[URL_MAX_LEN];
-    char protocol[PROTOCOL_MAX_LEN];
     char host[HOST_MAX_LEN];
     char path[PATH_MAX_LEN];
     int port;
+    RequestFrame frame;
+    RequestTrace trace;
+    uint64_t receiveTime = 0;
 
-    logDebug("Processing new request");
+    *keepAlive = 0;
 
-    if (recvUntilHeaderEnd(clientSocket, buffer) <= 0)
+    if (recvRequest(clientSocket, request, &frame, isFirst, &receiveTime) != SUCCESS)
     {
-        logError("Failed to receive request");
-        sendErrorResponse(clientSocket, HTTP_400_BAD_REQUEST, "Failed to read request");
+        if (isFirst || get_Buffer_size(request) > 0)
+        {
+            logError("Failed to receive request");
+            sendErrorResponse(clientSocket, HTTP_400_BAD_REQUEST, "Failed to read request");
+        }
         return ERROR;
     }
 
-    const char *requestData = Buffer_asString(buffer);
+    logDebug("Processing new request");
+
+    traceStart(&trace, receiveTime);
+    url[0] = '\0';
+
+    const char *requestData = get_Buffer_data(request);
 
-    if (sscanf(requestData, "%15s %2047s %15s", method, url, protocol) != 3)
+    if (!frame.isValid ||
+        copyHttpSlice(requestData, frame.message.target, url, sizeof(url)) != SUCCESS)
     {
         logError("Invalid request format");
         sendErrorResponse(clientSocket, HTTP_400_BAD_REQUEST, "Invalid request format");
-        return ERROR;
+        return finishTrace(&trace, url, ERROR);
+    }
+
+    if (frame.isTooLarge)
+    {
+        logError("Request body too large");
+        sendErrorResponse(clientSocket, HTTP_413_CONTENT_TOO_LARGE, "Request body too large");
+        return finishTrace(&trace, url, ERROR);
     }
 
+    int isGet = isHttpSlice(requestData, frame.message.method, "GET");
+    ByteRange range;
+
+    parseByteRange(requestData, &frame.message, &range);
+
     logDebug("Request parsed successfully");
 
     if (parseUrl(url, host, path, &port) != SUCCESS)
     {
-        logError("Invalid URL in request");
+        logError("Invalid URL in request: %s", url);
         sendErrorResponse(clientSocket, HTTP_400_BAD_REQUEST, "Invalid URL");
-        return ERROR;
+        return finishTrace(&trace, url, ERROR);
     }
 
-    if (isGetRequest(method))
+    if (buildUpstreamRequest(request, &frame, buffer) != SUCCESS)
+    {
+        sendErrorResponse(clientSocket, HTTP_500_INTERNAL_ERROR, "Memory allocation failed");
+        return finishTrace(&trace, url, ERROR);
+    }
+    Buffer_consume(request, frame.totalLength);
+
+    if (isGet)
     {
         logDebug("Handling GET request");
-        return handleGet(cache, buffer, host, port, clientSocket, url);
+        *keepAlive = frame.keepAlive;
+        return finishTrace(&trace, url, handleGet(cache, buffer, response, host, port,
+                                                  clientSocket, url, &range, keepAlive, &trace));
     }
     else
     {
         logDebug("Handling non-GET request");
-        return handleOther(buffer, host, port, clientSocket);
+        *keepAlive = frame.keepAlive;
+        return finishTrace(&trace, url, handleOther(buffer, response, host, port,
+                                                    clientSocket, keepAlive, &trace));
     }
 }
 
 void *handleClientThread(void *args)
 {
     ClientContext *ctx = args;
+    Buffer *request = NULL;
     Buffer *buffer = NULL;
+    Buffer *response = NULL;
+    int keepAlive = 1;
 
     logDebug("Client thread started");
+    metricsAdd(GaugeClientConnections, 1);
 
+    request = Buffer_create(BUFFER_SIZE);
     buffer = Buffer_create(BUFFER_SIZE);
-    if (buffer == NULL)
+    response = Buffer_create(BUFFER_SIZE);
+    if (request == NULL || buffer == NULL || response == NULL)
     {
         logError("Failed to create buffer");
         sendErrorResponse(ctx->clientSocket, HTTP_500_INTERNAL_ERROR, "Memory allocation failed");
         goto cleanup;
     }
 
-    processRequest(ctx->cacheManager, buffer, ctx->clientSocket);
+    for (int isFirst = 1; keepAlive && !serverShutdown; isFirst = 0)
+    {
+        if (processRequest(ctx->cacheManager, request, buffer, response,
+                           ctx->clientSocket, isFirst, &keepAlive) != SUCCESS)
+        {
+            break;
+        }
+    }
 
 cleanup:
+    Buffer_destroy(request);
     Buffer_destroy(buffer);
+    Buffer_destroy(response);
+    PROXY_PROBE1(conn_close, ctx->clientSocket);
     close(ctx->clientSocket);
     free(ctx);
+    metricsAdd(GaugeClientConnections, -1);
 
     pthread_mutex_lock(&clientsMutex);
     activeClients--;
@@ -0,0 +1,1864 @@
+#include "proxy.h"
+#include "log.h"
+#include "metrics.h"
+#include "probes.h"
+#include "buffer.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+
+#define MAX_EVENTS 256
+#define LOOP_TICK_MS 1000
+#define ACCEPT_BATCH 64
+#define CLIENT_IDLE_TIMEOUT_SEC 60
+#define ORIGIN_IDLE_TIMEOUT_SEC 30
+#define MAX_LOOKUP_ATTEMPTS 3
+
+#define CONTAINER_OF(ptr, type, member) ((type *)((char *)(ptr) - offsetof(type, member)))
+
+typedef struct EventWorker EventWorker;
+typedef struct EventHandler EventHandler;
+typedef struct EventConnection EventConnection;
+typedef struct EventUpload EventUpload;
+
+struct EventHandler
+{
+    void (*onEvent)(EventHandler *handler, uint32_t events);
+};
+
+typedef enum ConnectionState
+{
+    ReadingRequest,
+    Resolving,
+    Connecting,
+    SendingRequest,
+    ReadingResponse,
+    Relaying,
+    StreamingCache,
+    WaitingEntry,
+    SendingError
+} ConnectionStateT;
+
+typedef enum OriginPurpose
+{
+    OriginFill,
+    OriginRevalidate,
+    OriginForward
+} OriginPurposeT;
+
+struct EventConnection
+{
+    EventHandler clientHandler;
+    EventHandler originHandler;
+    EventWorker *worker;
+    ConnectionStateT state;
+    OriginPurposeT purpose;
+    int clientSocket;
+    int originSocket;
+    int originEof;
+    Buffer *request;
+    Buffer *upstream;
+    Buffer *conditional;
+    Buffer *response;
+    const Buffer *outgoing;
+    size_t sentBytes;
+    int keepAlive;
+    unsigned servedRequests;
+    ResponseFrame frame;
+    int isOriginReused;
+    RequestTrace trace;
+    uint64_t receiveTime;
+    RequestFrame requestFrame;
+    int isRequestParsed;
+    DnsWaiter dnsWaiter;
+    ResolvedHost resolved;
+    int addressIndex;
+
+    CacheEntryT *entry;
+    CacheCursorT cursor;
+    int isStreaming;
+    size_t bodyRemaining;
+    int isBodyBounded;
+    ByteRange range;
+    CacheWaiterT waiter;
+    int isFilling;
+    int isRevalidating;
+    int lookupAttempts;
+
+    char url[URL_MAX_LEN];
+    char host[HOST_MAX_LEN];
+    int port;
+
+    time_t lastActivity;
+    int isClosed;
+    int isWakeQueued;
+    EventConnection *wakePrev;
+    EventConnection *wakeNext;
+    EventConnection *prev;
+    EventConnection *next;
+};
+
+struct EventUpload
+{
+    EventHandler handler;
+    EventWorker *worker;
+    int remoteSocket;
+    CacheEntryT *entry;
+    size_t readSize;
+    char host[HOST_MAX_LEN];
+    int port;
+    ResponseFrame frame;
+    time_t lastActivity;
+    EventUpload *prev;
+    EventUpload *next;
+};
+
+struct EventWorker
+{
+    EventHandler acceptHandler;
+    EventHandler wakeHandler;
+    pthread_t thread;
+    int epollFd;
+    int wakeFd;
+    int serverSocket;
+    CacheManagerT *cache;
+
+    pthread_mutex_t wakeMutex;
+    EventConnection *wakeHead;
+
+    EventConnection *connections;
+    EventConnection *closed;
+    EventUpload *uploads;
+};
+
+static void lookupEntry(EventConnection *conn);
+static void checkEntry(EventConnection *conn);
+static void streamCache(EventConnection *conn);
+static int sendHead(EventConnection *conn);
+static int isRequestBuffered(EventConnection *conn);
+static void finishRequest(EventConnection *conn);
+static void onResolved(EventConnection *conn);
+
+static int watch(EventWorker *worker, int fd, EventHandler *handler, uint32_t events)
+{
+    struct epoll_event event = {.events = events, .data.ptr = handler};
+    return epoll_ctl(worker->epollFd, EPOLL_CTL_ADD, fd, &event);
+}
+
+static void rewatch(EventWorker *worker, int fd, EventHandler *handler, uint32_t events)
+{
+    struct epoll_event event = {.events = events, .data.ptr = handler};
+    epoll_ctl(worker->epollFd, EPOLL_CTL_MOD, fd, &event);
+}
+
+static void closeSocket(EventWorker *worker, int *fd)
+{
+    if (*fd >= 0)
+    {
+        epoll_ctl(worker->epollFd, EPOLL_CTL_DEL, *fd, NULL);
+        close(*fd);
+        *fd = -1;
+    }
+}
+
+static void releaseOrigin(EventWorker *worker, int *fd, const char *host, int port,
+                          const ResponseFrame *frame)
+{
+    if (*fd >= 0)
+    {
+        epoll_ctl(worker->epollFd, EPOLL_CTL_DEL, *fd, NULL);
+        finishOriginSocket(host, port, *fd, frame);
+        *fd = -1;
+    }
+}
+
+static void unqueueWake(EventConnection *conn)
+{
+    EventWorker *worker = conn->worker;
+
+    pthread_mutex_lock(&worker->wakeMutex);
+    if (conn->isWakeQueued)
+    {
+        if (conn->wakePrev != NULL)
+        {
+            conn->wakePrev->wakeNext = conn->wakeNext;
+        }
+        else
+        {
+            worker->wakeHead = conn->wakeNext;
+        }
+        if (conn->wakeNext != NULL)
+        {
+            conn->wakeNext->wakePrev = conn->wakePrev;
+        }
+        conn->isWakeQueued = 0;
+    }
+    pthread_mutex_unlock(&worker->wakeMutex);
+}
+
+static void releaseEntry(EventConnection *conn)
+{
+    CacheEntryT *entry = conn->entry;
+    CacheManagerT *cache = conn->worker->cache;
+
+    if (entry == NULL)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&entry->dataMutex);
+    CacheEntryT_removeWaiter(entry, &conn->waiter);
+    if (conn->isRevalidating)
+    {
+        entry->isRevalidating = 0;
+        CacheEntryT_wakeReaders(entry);
+    }
+    pthread_mutex_unlock(&entry->dataMutex);
+
+    if (conn->isFilling)
+    {
+        CacheManagerT_remove_CacheEntryT(cache, entry);
+        CacheEntryT_updateStatus(entry, Failed);
+    }
+
+    conn->isFilling = 0;
+    conn->isRevalidating = 0;
+    conn->isStreaming = 0;
+    conn->entry = NULL;
+    CacheEntryT_release(entry);
+}
+
+static void closeConnection(EventConnection *conn)
+{
+    EventWorker *worker = conn->worker;
+
+    if (conn->isClosed)
+    {
+        return;
+    }
+
+    if (conn->trace.startTime != 0)
+    {
+        traceFinish(&conn->trace, conn->url, 1);
+    }
+    metricsAdd(GaugeClientConnections, -1);
+    PROXY_PROBE1(conn_close, conn->clientSocket);
+
+    releaseEntry(conn);
+    cancelResolve(&conn->dnsWaiter);
+    unqueueWake(conn);
+
+    closeSocket(worker, &conn->originSocket);
+    closeSocket(worker, &conn->clientSocket);
+
+    if (conn->prev != NULL)
+    {
+        conn->prev->next = conn->next;
+    }
+    else
+    {
+        worker->connections = conn->next;
+    }
+    if (conn->next != NULL)
+    {
+        conn->next->prev = conn->prev;
+    }
+
+    conn->isClosed = 1;
+    conn->prev = NULL;
+    conn->next = worker->closed;
+    worker->closed = conn;
+
+    logDebug("Client connection closed");
+}
+
+static void freeClosedConnections(EventWorker *worker)
+{
+    EventConnection *conn = worker->closed;
+    worker->closed = NULL;
+
+    while (conn != NULL)
+    {
+        EventConnection *next = conn->next;
+        Buffer_destroy(conn->request);
+        Buffer_destroy(conn->upstream);
+        Buffer_destroy(conn->conditional);
+        Buffer_destroy(conn->response);
+        free(conn);
+        conn = next;
+    }
+}
+
+/*
+ * The error response goes out through the connection's response buffer, so
+ * a client that does not read gets it flushed from EPOLLOUT instead of
+ * stalling the worker; the connection closes once it is sent.
+ */
+static void failConnection(EventConnection *conn, const char *status, const char *message)
+{
+    releaseEntry(conn);
+    cancelResolve(&conn->dnsWaiter);
+    unqueueWake(conn);
+    closeSocket(conn->worker, &conn->originSocket);
+
+    Buffer_clear(conn->response);
+    if (buildErrorResponse(conn->response, status, message) != SUCCESS)
+    {
+        closeConnection(conn);
+        return;
+    }
+
+    conn->sentBytes = 0;
+    conn->keepAlive = 0;
+    conn->state = SendingError;
+
+    if (sendHead(conn))
+    {
+        closeConnection(conn);
+    }
+}
+
+static void finishUpload(EventUpload *upload, CacheStatusT status)
+{
+    EventWorker *worker = upload->worker;
+
+    if (status == Failed)
+    {
+        CacheManagerT_remove_CacheEntryT(worker->cache, upload->entry);
+    }
+    else
+    {
+        metricsObserve(HistogramObjectSize, upload->entry->downloadedSize - upload->entry->headerSize);
+    }
+    CacheEntryT_updateStatus(upload->entry, status);
+    PROXY_PROBE3(upload_done, upload->entry, upload->entry->downloadedSize, status == Success);
+    CacheEntryT_release(upload->entry);
+    releaseOrigin(worker, &upload->remoteSocket, upload->host, upload->port, &upload->frame);
+
+    if (upload->prev != NULL)
+    {
+        upload->prev->next = upload->next;
+    }
+    else
+    {
+        worker->uploads = upload->next;
+    }
+    if (upload->next != NULL)
+    {
+        upload->next->prev = upload->prev;
+    }
+
+    metricsAdd(GaugeDownloads, -1);
+    if (status == Success)
+    {
+        logInfo("File upload completed successfully");
+    }
+    else
+    {
+        logError("File upload failed");
+    }
+
+    free(upload);
+}
+
+static void onUploadEvent(EventHandler *handler, uint32_t events)
+{
+    EventUpload *upload = CONTAINER_OF(handler, EventUpload, handler);
+
+    (void)events;
+
+    size_t available = 0;
+    char *slice = CacheEntryT_reserve(upload->entry, &available);
+    if (slice == NULL)
+    {
+        logError("Failed to reserve cache space");
+        finishUpload(upload, Failed);
+        return;
+    }
+
+    size_t requested = limitResponseRead(&upload->frame,
+                                         (available < upload->readSize) ? available : upload->readSize);
+    ssize_t n = recv(upload->remoteSocket, slice, requested, 0);
+
+    if (n < 0)
+    {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+        {
+            CacheEntryT_flush(upload->entry);
+            return;
+        }
+        logError("Download receive failed");
+        finishUpload(upload, Failed);
+        return;
+    }
+
+    if (n == 0)
+    {
+        logDebug("Remote connection closed");
+        endResponseFrame(&upload->frame);
+        finishUpload(upload, upload->frame.isComplete ? Success : Failed);
+        return;
+    }
+
+    size_t used = advanceResponseFrame(&upload->frame, slice, n);
+    if (used < (size_t)n)
+    {
+        upload->frame.keepAlive = 0;
+    }
+
+    upload->lastActivity = time(NULL);
+    CacheEntryT_commit(upload->entry, used, InProcess);
+    if (upload->frame.isComplete)
+    {
+        finishUpload(upload, Success);
+        return;
+    }
+    if ((size_t)n < requested)
+    {
+        CacheEntryT_flush(upload->entry);
+    }
+    upload->readSize = adaptReadSize(upload->readSize, requested, n);
+}
+
+static int handOffUpload(EventConnection *conn)
+{
+    EventWorker *worker = conn->worker;
+    EventUpload *upload = calloc(1, sizeof(EventUpload));
+
+    if (upload == NULL)
+    {
+        logError("Failed to allocate upload");
+        return ERROR;
+    }
+
+    upload->handler.onEvent = onUploadEvent;
+    upload->worker = worker;
+    upload->remoteSocket = conn->originSocket;
+    upload->entry = CacheEntryT_acquire(conn->entry);
+    upload->readSize = UPLOAD_READ_MIN;
+    snprintf(upload->host, sizeof(upload->host), "%s", conn->host);
+    upload->port = conn->port;
+    upload->frame = conn->frame;
+    upload->lastActivity = time(NULL);
+
+    rewatch(worker, upload->remoteSocket, &upload->handler, EPOLLIN);
+    conn->originSocket = -1;
+
+    upload->next = worker->uploads;
+    if (worker->uploads != NULL)
+    {
+        worker->uploads->prev = upload;
+    }
+    worker->uploads = upload;
+    metricsAdd(GaugeDownloads, 1);
+    PROXY_PROBE2(upload_start, upload->entry, upload->remoteSocket);
+
+    logDebug("Background upload started");
+    return SUCCESS;
+}
+
+static void queueWake(EventConnection *conn)
+{
+    EventWorker *worker = conn->worker;
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&worker->wakeMutex);
+    if (!conn->isWakeQueued)
+    {
+        conn->wakePrev = NULL;
+        conn->wakeNext = worker->wakeHead;
+        if (worker->wakeHead != NULL)
+        {
+            worker->wakeHead->wakePrev = conn;
+        }
+        worker->wakeHead = conn;
+        conn->isWakeQueued = 1;
+    }
+    pthread_mutex_unlock(&worker->wakeMutex);
+
+    if (write(worker->wakeFd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+    {
+        logError("Failed to signal worker");
+    }
+}
+
+static void notifyConnection(CacheWaiterT *waiter)
+{
+    queueWake(CONTAINER_OF(waiter, EventConnection, waiter));
+}
+
+static void notifyResolved(DnsWaiter *waiter)
+{
+    queueWake(CONTAINER_OF(waiter, EventConnection, dnsWaiter));
+}
+
+static void onWakeEvent(EventHandler *handler, uint32_t events)
+{
+    EventWorker *worker = CONTAINER_OF(handler, EventWorker, wakeHandler);
+    uint64_t count = 0;
+
+    (void)events;
+
+    if (read(worker->wakeFd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+    {
+        logError("Failed to drain worker wakeups");
+    }
+
+    while (1)
+    {
+        pthread_mutex_lock(&worker->wakeMutex);
+        EventConnection *conn = worker->wakeHead;
+        if (conn != NULL)
+        {
+            worker->wakeHead = conn->wakeNext;
+            if (worker->wakeHead != NULL)
+            {
+                worker->wakeHead->wakePrev = NULL;
+            }
+            conn->isWakeQueued = 0;
+            conn->wakeNext = NULL;
+        }
+        pthread_mutex_unlock(&worker->wakeMutex);
+
+        if (conn == NULL)
+        {
+            break;
+        }
+
+        conn->lastActivity = time(NULL);
+
+        if (conn->state == StreamingCache)
+        {
+            streamCache(conn);
+        }
+        else if (conn->state == WaitingEntry)
+        {
+            checkEntry(conn);
+        }
+        else if (conn->state == Resolving && !conn->dnsWaiter.isLinked)
+        {
+            onResolved(conn);
+        }
+    }
+}
+
+static void relayToClient(EventConnection *conn)
+{
+    EventWorker *worker = conn->worker;
+    const char *data = get_Buffer_data(conn->response);
+    size_t size = get_Buffer_size(conn->response);
+
+    while (conn->sentBytes < size)
+    {
+        ssize_t n = send(conn->clientSocket, data + conn->sentBytes,
+                         size - conn->sentBytes, MSG_NOSIGNAL);
+        if (n < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                rewatch(worker, conn->clientSocket, &conn->clientHandler, EPOLLOUT);
+                if (conn->originSocket >= 0)
+                {
+                    rewatch(worker, conn->originSocket, &conn->originHandler, 0);
+                }
+                return;
+            }
+            logError("Failed to forward response");
+            closeConnection(conn);
+            return;
+        }
+        conn->sentBytes += n;
+        traceSent(&conn->trace, n);
+    }
+
+    Buffer_clear(conn->response);
+    conn->sentBytes = 0;
+
+    if (conn->frame.isComplete)
+    {
+        logDebug("Relay finished");
+        finishRequest(conn);
+        return;
+    }
+    if (conn->originEof || conn->originSocket < 0)
+    {
+        logError("Remote closed before end of response");
+        closeConnection(conn);
+        return;
+    }
+
+    rewatch(worker, conn->clientSocket, &conn->clientHandler, 0);
+    rewatch(worker, conn->originSocket, &conn->originHandler, EPOLLIN);
+}
+
+static void relayFromOrigin(EventConnection *conn)
+{
+    char *slice = Buffer_writePtr(conn->response);
+    ssize_t n = recv(conn->originSocket, slice,
+                     limitResponseRead(&conn->frame, Buffer_available(conn->response)), 0);
+
+    if (n < 0)
+    {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+        {
+            return;
+        }
+        logError("Failed to read from remote");
+        closeConnection(conn);
+        return;
+    }
+
+    if (n == 0)
+    {
+        conn->originEof = 1;
+        endResponseFrame(&conn->frame);
+        closeSocket(conn->worker, &conn->originSocket);
+    }
+    else
+    {
+        size_t used = advanceResponseFrame(&conn->frame, slice, n);
+        if (used < (size_t)n)
+        {
+            conn->frame.keepAlive = 0;
+        }
+        Buffer_advanceSize(conn->response, used);
+
+        if (conn->frame.isComplete)
+        {
+            releaseOrigin(conn->worker, &conn->originSocket, conn->host, conn->port, &conn->frame);
+        }
+    }
+
+    relayToClient(conn);
+}
+
+static void beginRelay(EventConnection *conn)
+{
+    const char *data = get_Buffer_data(conn->response);
+    size_t headerLength = conn->frame.headerLength;
+    Buffer *relayed = conn->upstream;
+
+    logDebug("Forwarding response without caching");
+
+    if (buildRelayedResponseHead(data, &conn->frame, conn->keepAlive, relayed,
+                                 &conn->keepAlive) != SUCCESS ||
+        Buffer_append(relayed, data + headerLength,
+                      get_Buffer_size(conn->response) - headerLength) != SUCCESS)
+    {
+        failConnection(conn, HTTP_500_INTERNAL_ERROR, "Memory allocation failed");
+        return;
+    }
+
+    conn->upstream = conn->response;
+    conn->response = relayed;
+    conn->state = Relaying;
+    traceEnter(&conn->trace, PhaseSend);
+    conn->sentBytes = 0;
+    relayToClient(conn);
+}
+
+static void discardEntry(EventConnection *conn)
+{
+    CacheEntryT *entry = conn->entry;
+
+    CacheManagerT_remove_CacheEntryT(conn->worker->cache, entry);
+
+    pthread_mutex_lock(&entry->dataMutex);
+    entry->isDropped = 1;
+    pthread_mutex_unlock(&entry->dataMutex);
+
+    releaseEntry(conn);
+}
+
+static void dropStaleEntry(EventConnection *conn)
+{
+    discardEntry(conn);
+    lookupEntry(conn);
+}
+
+static void connectOrigin(EventConnection *conn, int canReuse);
+static void connectAddress(EventConnection *conn, int index);
+
+static void originFailed(EventConnection *conn)
+{
+    closeSocket(conn->worker, &conn->originSocket);
+
+    if (conn->state == Connecting)
+    {
+        traceLeave(&conn->trace, PhaseConnect);
+    }
+
+    if (conn->state == Connecting && conn->addressIndex + 1 < conn->resolved.count)
+    {
+        logDebug("Trying next address of remote host");
+        connectAddress(conn, conn->addressIndex + 1);
+        return;
+    }
+
+    /* counted once per attempt, as connectToOrigin does, after every address failed */
+    if (conn->state == Connecting && !conn->isOriginReused)
+    {
+        metricsAdd(CounterOriginConnectErrors, 1);
+        markOriginDown(conn->host, conn->port);
+    }
+
+    if (conn->isOriginReused && isIdempotentRequest(conn->outgoing) &&
+        (conn->state != ReadingResponse || get_Buffer_size(conn->response) == 0))
+    {
+        logDebug("Pooled connection failed, retrying on a fresh one");
+        connectOrigin(conn, 0);
+        return;
+    }
+
+    switch (conn->purpose)
+    {
+    case OriginRevalidate:
+        logError("Revalidation failed");
+        dropStaleEntry(conn);
+        break;
+    case OriginFill:
+    case OriginForward:
+    default:
+        logError("Failed to fetch from remote host");
+        failConnection(conn, HTTP_502_BAD_GATEWAY, "Failed to fetch");
+        break;
+    }
+}
+
+static void connectAddress(EventConnection *conn, int index)
+{
+    logDebug("Connecting to remote host");
+
+    conn->addressIndex = index;
+    traceEnter(&conn->trace, PhaseConnect);
+    conn->originSocket = startConnect(&conn->resolved, index, conn->port);
+    conn->state = Connecting;
+
+    if (conn->originSocket < 0 ||
+        watch(conn->worker, conn->originSocket, &conn->originHandler, EPOLLOUT) < 0)
+    {
+        originFailed(conn);
+    }
+}
+
+static void onResolved(EventConnection *conn)
+{
+    traceLeave(&conn->trace, PhaseResolve);
+
+    if (conn->dnsWaiter.status != SUCCESS)
+    {
+        logError("Failed to resolve host");
+        originFailed(conn);
+        return;
+    }
+
+    connectAddress(conn, 0);
+}
+
+static void connectOrigin(EventConnection *conn, int canReuse)
+{
+    conn->sentBytes = 0;
+    conn->originEof = 0;
+    conn->resolved.count = 0;
+    conn->originSocket = canReuse ? acquireOriginSocket(conn->host, conn->port) : -1;
+    conn->isOriginReused = (conn->originSocket >= 0);
+
+    if (conn->isOriginReused)
+    {
+        metricsAdd(CounterOriginReused, 1);
+        conn->state = SendingRequest;
+        if (watch(conn->worker, conn->originSocket, &conn->originHandler, EPOLLOUT) < 0)
+        {
+            originFailed(conn);
+        }
+        return;
+    }
+
+    if (isOriginDown(conn->host, conn->port))
+    {
+        logDebug("Origin recently unreachable, not connecting");
+        originFailed(conn);
+        return;
+    }
+
+    traceEnter(&conn->trace, PhaseResolve);
+
+    switch (resolveHostAsync(conn->host, &conn->dnsWaiter))
+    {
+    case SUCCESS:
+        traceLeave(&conn->trace, PhaseResolve);
+        connectAddress(conn, 0);
+        break;
+    case RESOLVE_PENDING:
+        logDebug("Waiting for host resolution");
+        conn->state = Resolving;
+        break;
+    default:
+        traceLeave(&conn->trace, PhaseResolve);
+        logError("Failed to resolve host");
+        originFailed(conn);
+        break;
+    }
+}
+
+static void startOrigin(EventConnection *conn, OriginPurposeT purpose, const Buffer *outgoing)
+{
+    conn->purpose = purpose;
+    conn->outgoing = outgoing;
+    connectOrigin(conn, 1);
+}
+
+static void sendToOrigin(EventConnection *conn)
+{
+    const char *data = get_Buffer_data(conn->outgoing);
+    size_t size = get_Buffer_size(conn->outgoing);
+
+    while (conn->sentBytes < size)
+    {
+        ssize_t n = send(conn->originSocket, data + conn->sentBytes,
+                         size - conn->sentBytes, MSG_NOSIGNAL);
+        if (n < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return;
+            }
+            originFailed(conn);
+            return;
+        }
+        conn->sentBytes += n;
+    }
+
+    logDebug("Waiting for response headers");
+    traceEnter(&conn->trace, PhaseOriginWait);
+
+    Buffer_clear(conn->response);
+    conn->state = ReadingResponse;
+    rewatch(conn->worker, conn->originSocket, &conn->originHandler, EPOLLIN);
+}
+
+static void onFillHeaders(EventConnection *conn, const char *data, size_t headerLength,
+                          const HttpMessage *message)
+{
+    CacheEntryT *entry = conn->entry;
+    CacheManagerT *cache = conn->worker->cache;
+
+    if (!isStatusCacheable(conn->frame.status) || !isResponseStorable(data, message))
+    {
+        logDebug("Response is not cacheable, forwarding without cache");
+        CacheManagerT_remove_CacheEntryT(cache, entry);
+        CacheEntryT_updateStatus(entry, Uncacheable);
+        conn->isFilling = 0;
+        releaseEntry(conn);
+        beginRelay(conn);
+        return;
+    }
+
+    logDebug("Response is cacheable, starting cache");
+
+    updateEntryFreshness(entry, data, message);
+    entry->headerSize = headerLength;
+
+    if (CacheEntryT_appendData(entry, get_Buffer_data(conn->response),
+                               get_Buffer_size(conn->response),
+                               conn->frame.isComplete ? Success : InProcess) == NULL)
+    {
+        failConnection(conn, HTTP_500_INTERNAL_ERROR, "Cache allocation failed");
+        return;
+    }
+
+    if (conn->frame.isComplete)
+    {
+        metricsObserve(HistogramObjectSize, entry->downloadedSize - entry->headerSize);
+    }
+    else if (handOffUpload(conn) != SUCCESS)
+    {
+        failConnection(conn, HTTP_500_INTERNAL_ERROR, "Failed to start download");
+        return;
+    }
+
+    conn->isFilling = 0;
+    conn->state = StreamingCache;
+    streamCache(conn);
+}
+
+/*
+ * The origin answered a revalidation with a full response; it fills a new
+ * entry in place of the stale one rather than being fetched again.
+ */
+static void replaceStaleEntry(EventConnection *conn, const char *data, size_t headerLength,
+                              const HttpMessage *message)
+{
+    int isNew = 0;
+
+    discardEntry(conn);
+    conn->trace.status = conn->frame.status;
+
+    conn->entry = CacheManagerT_acquire_CacheEntryT(conn->worker->cache, conn->url, &isNew);
+    if (conn->entry == NULL)
+    {
+        logError("Failed to create cache entry");
+        failConnection(conn, HTTP_500_INTERNAL_ERROR, "Cache allocation failed");
+        return;
+    }
+
+    if (!isNew)
+    {
+        closeSocket(conn->worker, &conn->originSocket);
+        checkEntry(conn);
+        return;
+    }
+
+    conn->isFilling = 1;
+    conn->purpose = OriginFill;
+    onFillHeaders(conn, data, headerLength, message);
+}
+
+static void onRevalidateHeaders(EventConnection *conn, const char *data, size_t headerLength,
+                                const HttpMessage *message)
+{
+    CacheEntryT *entry = conn->entry;
+
+    if (conn->frame.status != 304)
+    {
+        logDebug("Entry changed at origin");
+        replaceStaleEntry(conn, data, headerLength, message);
+        return;
+    }
+
+    closeSocket(conn->worker, &conn->originSocket);
+
+    if (refreshEntryHeaders(entry, data, message) != SUCCESS)
+    {
+        updateEntryFreshness(entry, data, message);
+    }
+    logDebug("Entry revalidated");
+
+    pthread_mutex_lock(&entry->dataMutex);
+    entry->isRevalidating = 0;
+    CacheEntryT_wakeReaders(entry);
+    pthread_mutex_unlock(&entry->dataMutex);
+
+    conn->isRevalidating = 0;
+    conn->state = StreamingCache;
+    streamCache(conn);
+}
+
+static void readResponse(EventConnection *conn)
+{
+    Buffer *response = conn->response;
+    HttpMessage message;
+
+    if (Buffer_available(response) == 0 &&
+        Buffer_reserve(response, get_Buffer_capacity(response) * 2) != 0)
+    {
+        originFailed(conn);
+        return;
+    }
+
+    ssize_t n = recv(conn->originSocket, Buffer_writePtr(response), Buffer_available(response), 0);
+
+    if (n < 0)
+    {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+        {
+            return;
+        }
+        originFailed(conn);
+        return;
+    }
+
+    if (n == 0)
+    {
+        if (get_Buffer_size(response) == 0)
+        {
+            originFailed(conn);
+            return;
+        }
+        conn->originEof = 1;
+    }
+    else
+    {
+        Buffer_advanceSize(response, n);
+    }
+
+    int headerEnd = findHeaderEnd(response);
+    if (headerEnd < 0)
+    {
+        if (conn->originEof)
+        {
+            logError("Malformed response from remote");
+            originFailed(conn);
+        }
+        return;
+    }
+
+    logDebug("Received response headers");
+    metricsObserve(HistogramOriginFirstByte, traceLeave(&conn->trace, PhaseOriginWait));
+
+    const char *data = Buffer_asString(response);
+    size_t headerLength = headerEnd;
+    size_t extra = get_Buffer_size(response) - headerLength;
+    int isHead = (conn->purpose == OriginForward) && isHeadRequest(conn->outgoing);
+
+    parseResponseFrame(data, headerLength, isHead, &conn->frame, &message);
+    conn->frame.isRequestSent = (conn->sentBytes == get_Buffer_size(conn->outgoing));
+    if (conn->purpose != OriginRevalidate)
+    {
+        conn->trace.status = conn->frame.status;
+    }
+    size_t body = advanceResponseFrame(&conn->frame, data + headerLength, extra);
+    if (body < extra)
+    {
+        conn->frame.keepAlive = 0;
+        Buffer_truncate(response, headerLength + body);
+    }
+
+    if (conn->originEof)
+    {
+        endResponseFrame(&conn->frame);
+        if (!conn->frame.isComplete && conn->purpose != OriginForward)
+        {
+            logError("Remote closed before end of response");
+            originFailed(conn);
+            return;
+        }
+    }
+
+    if (conn->frame.isComplete)
+    {
+        releaseOrigin(conn->worker, &conn->originSocket, conn->host, conn->port, &conn->frame);
+    }
+
+    switch (conn->purpose)
+    {
+    case OriginFill:
+        onFillHeaders(conn, data, headerLength, &message);
+        break;
+    case OriginRevalidate:
+        onRevalidateHeaders(conn, data, headerLength, &message);
+        break;
+    case OriginForward:
+    default:
+        beginRelay(conn);
+        break;
+    }
+}
+
+static void onOriginEvent(EventHandler *handler, uint32_t events)
+{
+    EventConnection *conn = CONTAINER_OF(handler, EventConnection, originHandler);
+
+    if (conn->isClosed)
+    {
+        return;
+    }
+
+    conn->lastActivity = time(NULL);
+
+    switch (conn->state)
+    {
+    case Connecting:
+        if ((events & EPOLLERR) || getSocketError(conn->originSocket) != 0)
+        {
+            logError("Connection failed");
+            originFailed(conn);
+            return;
+        }
+        logDebug("Connected to remote host");
+        metricsAdd(CounterOriginConnects, 1);
+        metricsObserve(HistogramOriginConnect, traceLeave(&conn->trace, PhaseConnect));
+        conn->state = SendingRequest;
+        sendToOrigin(conn);
+        break;
+    case SendingRequest:
+        sendToOrigin(conn);
+        break;
+    case ReadingResponse:
+        readResponse(conn);
+        break;
+    case Relaying:
+        relayFromOrigin(conn);
+        break;
+    default:
+        break;
+    }
+}
+
+static ssize_t sendChunkData(int clientSocket, const CacheEntryChunkT *chunk,
+                             size_t from, size_t to)
+{
+    if (chunk->fd >= 0)
+    {
+        off_t offset = chunk->fileOffset + from;
+        return sendfile(clientSocket, chunk->fd, &offset, to - from);
+    }
+    return send(clientSocket, chunk->data + from, to - from, MSG_NOSIGNAL);
+}
+
+static int parkOnEntry(EventConnection *conn, unsigned sequence)
+{
+    CacheEntryT *entry = conn->entry;
+    int isParked = 0;
+
+    pthread_mutex_lock(&entry->dataMutex);
+    if (CacheEntryT_sequence(entry) == sequence)
+    {
+        CacheEntryT_addWaiter(entry, &conn->waiter);
+        isParked = 1;
+    }
+    pthread_mutex_unlock(&entry->dataMutex);
+
+    if (isParked)
+    {
+        traceSwitch(&conn->trace, PhaseSend, PhaseEntryWait);
+        rewatch(conn->worker, conn->clientSocket, &conn->clientHandler, 0);
+    }
+    return isParked;
+}
+
+static void finishRequest(EventConnection *conn)
+{
+    EventWorker *worker = conn->worker;
+
+    traceFinish(&conn->trace, conn->url, 0);
+    conn->trace.startTime = 0;
+
+    if (!conn->keepAlive)
+    {
+        logDebug("Request completed successfully");
+        closeConnection(conn);
+        return;
+    }
+
+    logDebug("Request completed, keeping connection alive");
+
+    releaseEntry(conn);
+    Buffer_clear(conn->response);
+    conn->sentBytes = 0;
+    conn->lookupAttempts = 0;
+    conn->servedRequests++;
+    conn->state = ReadingRequest;
+
+    rewatch(worker, conn->clientSocket, &conn->clientHandler,
+            isRequestBuffered(conn) ? EPOLLIN | EPOLLOUT : EPOLLIN);
+}
+
+static int sendHead(EventConnection *conn)
+{
+    const char *data = get_Buffer_data(conn->response);
+    size_t size = get_Buffer_size(conn->response);
+
+    while (conn->sentBytes < size)
+    {
+        ssize_t n = send(conn->clientSocket, data + conn->sentBytes,
+                         size - conn->sentBytes, MSG_NOSIGNAL);
+        if (n < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                rewatch(conn->worker, conn->clientSocket, &conn->clientHandler, EPOLLOUT);
+                return 0;
+            }
+            logError("Failed to send response headers");
+            closeConnection(conn);
+            return 0;
+        }
+        conn->sentBytes += n;
+        traceSent(&conn->trace, n);
+    }
+
+    return 1;
+}
+
+static void streamCache(EventConnection *conn)
+{
+    EventWorker *worker = conn->worker;
+    CacheEntryT *entry = conn->entry;
+
+    traceSwitch(&conn->trace, PhaseEntryWait, PhaseSend);
+
+    while (1)
+    {
+        unsigned sequence = CacheEntryT_sequence(entry);
+        CacheStatusT status = entry->status;
+
+        if (!conn->isStreaming)
+        {
+            if (!CacheEntryT_hasHeaders(entry))
+            {
+                if (status == InProcess)
+                {
+                    if (parkOnEntry(conn, sequence))
+                    {
+                        return;
+                    }
+                    continue;
+                }
+
+                if (status == Uncacheable)
+                {
+                    logDebug("Coalesced response is not cacheable, fetching directly");
+                    releaseEntry(conn);
+                    conn->keepAlive = 0;
+                    startOrigin(conn, OriginForward, conn->upstream);
+                    return;
+                }
+
+                logDebug("Coalesced download failed, retrying");
+                releaseEntry(conn);
+                lookupEntry(conn);
+                return;
+            }
+
+            CachedBody body;
+
+            if (buildCachedResponseHead(entry, &conn->range, conn->keepAlive, conn->response,
+                                        &conn->keepAlive, &body) != SUCCESS)
+            {
+                failConnection(conn, HTTP_500_INTERNAL_ERROR, "Memory allocation failed");
+                return;
+            }
+
+            conn->sentBytes = 0;
+            conn->trace.status = body.status;
+            CacheCursorT_init(&conn->cursor, entry, body.offset);
+            conn->isStreaming = 1;
+            conn->bodyRemaining = body.end - body.offset;
+            conn->isBodyBounded = (body.end != SIZE_MAX);
+        }
+
+        if (!sendHead(conn))
+        {
+            return;
+        }
+
+        if (status == Failed)
+        {
+            logError("Cache entry failed during send");
+            closeConnection(conn);
+            return;
+        }
+
+        if (conn->bodyRemaining == 0)
+        {
+            finishRequest(conn);
+            return;
+        }
+
+        CacheEntryChunkT *chunk = NULL;
+        size_t from = 0;
+        size_t available = CacheCursorT_readable(&conn->cursor, &chunk, &from);
+
+        if (available == 0)
+        {
+            if (status == InProcess)
+            {
+                if (parkOnEntry(conn, sequence))
+                {
+                    return;
+                }
+                continue;
+            }
+
+            if (conn->isBodyBounded)
+            {
+                logError("Cache entry ended before the requested range");
+                closeConnection(conn);
+                return;
+            }
+
+            finishRequest(conn);
+            return;
+        }
+
+        if (available > conn->bodyRemaining)
+        {
+            available = conn->bodyRemaining;
+        }
+
+        ssize_t n = sendChunkData(conn->clientSocket, chunk, from, from + available);
+        if (n < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                rewatch(worker, conn->clientSocket, &conn->clientHandler, EPOLLOUT);
+                return;
+            }
+            logError("Failed to send chunk data");
+            closeConnection(conn);
+            return;
+        }
+
+        CacheCursorT_advance(&conn->cursor, n);
+        conn->bodyRemaining -= n;
+        traceSent(&conn->trace, n);
+    }
+}
+
+static void startRevalidation(EventConnection *conn)
+{
+    logDebug("Revalidating stale entry");
+    metricsAdd(CounterRevalidations, 1);
+
+    conn->isRevalidating = 1;
+
+    if (conn->conditional == NULL)
+    {
+        conn->conditional = Buffer_create(BUFFER_SIZE);
+    }
+
+    if (conn->conditional == NULL ||
+        buildConditionalRequest(conn->upstream, conn->entry, conn->conditional) != SUCCESS)
+    {
+        logDebug("Stale entry has no validators");
+        dropStaleEntry(conn);
+        return;
+    }
+
+    startOrigin(conn, OriginRevalidate, conn->conditional);
+}
+
+static void checkEntry(EventConnection *conn)
+{
+    CacheEntryT *entry = conn->entry;
+
+    traceLeave(&conn->trace, PhaseEntryWait);
+    pthread_mutex_lock(&entry->dataMutex);
+
+    if (entry->isRevalidating)
+    {
+        CacheEntryT_addWaiter(entry, &conn->waiter);
+        pthread_mutex_unlock(&entry->dataMutex);
+        traceEnter(&conn->trace, PhaseEntryWait);
+        conn->state = WaitingEntry;
+        return;
+    }
+
+    if (entry->isDropped)
+    {
+        pthread_mutex_unlock(&entry->dataMutex);
+        releaseEntry(conn);
+        lookupEntry(conn);
+        return;
+    }
+
+    if (entry->status == Failed)
+    {
+        pthread_mutex_unlock(&entry->dataMutex);
+        logDebug("Dropping failed entry");
+        dropStaleEntry(conn);
+        return;
+    }
+
+    if (entry->status == Success && time(NULL) >= entry->expiresAt)
+    {
+        entry->isRevalidating = 1;
+        pthread_mutex_unlock(&entry->dataMutex);
+        startRevalidation(conn);
+        return;
+    }
+
+    pthread_mutex_unlock(&entry->dataMutex);
+
+    conn->state = StreamingCache;
+    streamCache(conn);
+}
+
+static void lookupEntry(EventConnection *conn)
+{
+    int isNew = 0;
+
+    if (++conn->lookupAttempts > MAX_LOOKUP_ATTEMPTS)
+    {
+        logError("Failed to obtain a fresh cache entry for %s", conn->url);
+        failConnection(conn, HTTP_502_BAD_GATEWAY, "Failed to refresh");
+        return;
+    }
+
+    traceEnter(&conn->trace, PhaseLookup);
+    conn->entry = CacheManagerT_acquire_CacheEntryT(conn->worker->cache, conn->url, &isNew);
+    metricsObserve(HistogramCacheLookup, traceLeave(&conn->trace, PhaseLookup));
+    if (conn->entry == NULL)
+    {
+        logError("Failed to create cache entry");
+        failConnection(conn, HTTP_500_INTERNAL_ERROR, "Cache allocation failed");
+        return;
+    }
+
+    if (isNew)
+    {
+        logDebug("Cache MISS %s", conn->url);
+        metricsAdd(CounterCacheMisses, 1);
+        PROXY_PROBE1(cache_miss, conn->url);
+        conn->trace.cacheResult = "miss";
+        conn->isFilling = 1;
+        startOrigin(conn, OriginFill, conn->upstream);
+        return;
+    }
+
+    logDebug("Cache HIT %s", conn->url);
+    metricsAdd(CounterCacheHits, 1);
+    PROXY_PROBE1(cache_hit, conn->url);
+    conn->trace.cacheResult = "hit";
+    checkEntry(conn);
+}
+
+static void dispatchRequest(EventConnection *conn)
+{
+    char path[PATH_MAX_LEN];
+    RequestFrame *frame = &conn->requestFrame;
+
+    conn->isRequestParsed = 0;
+    traceStart(&conn->trace, (conn->receiveTime != 0) ? conn->receiveTime : metricsNow());
+    conn->receiveTime = 0;
+
+    const char *requestData = get_Buffer_data(conn->request);
+
+    if (!frame->isValid ||
+        copyHttpSlice(requestData, frame->message.target, conn->url, sizeof(conn->url)) != SUCCESS)
+    {
+        logError("Invalid request format");
+        failConnection(conn, HTTP_400_BAD_REQUEST, "Invalid request format");
+        return;
+    }
+
+    if (frame->isTooLarge)
+    {
+        logError("Request body too large");
+        failConnection(conn, HTTP_413_CONTENT_TOO_LARGE, "Request body too large");
+        return;
+    }
+
+    int isGet = isHttpSlice(requestData, frame->message.method, "GET");
+
+    parseByteRange(requestData, &frame->message, &conn->range);
+
+    if (parseUrl(conn->url, conn->host, path, &conn->port) != SUCCESS)
+    {
+        logError("Invalid URL in request: %s", conn->url);
+        failConnection(conn, HTTP_400_BAD_REQUEST, "Invalid URL");
+        return;
+    }
+
+    if (buildUpstreamRequest(conn->request, frame, conn->upstream) != SUCCESS)
+    {
+        failConnection(conn, HTTP_500_INTERNAL_ERROR, "Memory allocation failed");
+        return;
+    }
+    Buffer_consume(conn->request, frame->totalLength);
+    conn->keepAlive = frame->keepAlive;
+
+    rewatch(conn->worker, conn->clientSocket, &conn->clientHandler, 0);
+
+    if (isGet)
+    {
+        logDebug("Handling GET request");
+        lookupEntry(conn);
+    }
+    else
+    {
+        logDebug("Handling non-GET request");
+        conn->trace.cacheResult = "pass";
+        startOrigin(conn, OriginForward, conn->upstream);
+    }
+}
+
+/*
+ * The frame is kept on the connection once the headers are in, so a body
+ * is scanned only as it arrives; dispatchRequest() starts the next one.
+ */
+static int isRequestBuffered(EventConnection *conn)
+{
+    if (!conn->isRequestParsed)
+    {
+        if (parseRequestFrame(conn->request, &conn->requestFrame) != SUCCESS)
+        {
+            return 0;
+        }
+        conn->isRequestParsed = 1;
+    }
+
+    return advanceRequestFrame(conn->request, &conn->requestFrame) == SUCCESS;
+}
+
+static void readRequest(EventConnection *conn)
+{
+    Buffer *request = conn->request;
+
+    if (isRequestBuffered(conn))
+    {
+        dispatchRequest(conn);
+        return;
+    }
+
+    if (Buffer_available(request) == 0 &&
+        Buffer_reserve(request, get_Buffer_capacity(request) * 2) != 0)
+    {
+        failConnection(conn, HTTP_500_INTERNAL_ERROR, "Memory allocation failed");
+        return;
+    }
+
+    ssize_t n = recv(conn->clientSocket, Buffer_writePtr(request), Buffer_available(request), 0);
+
+    if (n < 0)
+    {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+        {
+            return;
+        }
+        closeConnection(conn);
+        return;
+    }
+
+    if (n == 0)
+    {
+        if (get_Buffer_size(request) > 0)
+        {
+            failConnection(conn, HTTP_400_BAD_REQUEST, "Failed to read request");
+            return;
+        }
+        closeConnection(conn);
+        return;
+    }
+
+    if (conn->receiveTime == 0)
+    {
+        conn->receiveTime = metricsNow();
+    }
+    Buffer_advanceSize(request, n);
+
+    if (isRequestBuffered(conn))
+    {
+        dispatchRequest(conn);
+    }
+}
+
+static void onClientEvent(EventHandler *handler, uint32_t events)
+{
+    EventConnection *conn = CONTAINER_OF(handler, EventConnection, clientHandler);
+
+    if (conn->isClosed)
+    {
+        return;
+    }
+
+    conn->lastActivity = time(NULL);
+
+    if (conn->state == ReadingRequest)
+    {
+        readRequest(conn);
+        return;
+    }
+
+    if (events & (EPOLLERR | EPOLLHUP))
+    {
+        closeConnection(conn);
+        return;
+    }
+
+    if (conn->state == Relaying)
+    {
+        relayToClient(conn);
+    }
+    else if (conn->state == StreamingCache)
+    {
+        streamCache(conn);
+    }
+    else if (conn->state == SendingError && sendHead(conn))
+    {
+        closeConnection(conn);
+    }
+}
+
+static void newConnection(EventWorker *worker, int clientSocket)
+{
+    EventConnection *conn = calloc(1, sizeof(EventConnection));
+    if (conn == NULL)
+    {
+        logError("Failed to allocate connection");
+        close(clientSocket);
+        return;
+    }
+
+    conn->request = Buffer_create(BUFFER_SIZE);
+    conn->upstream = Buffer_create(BUFFER_SIZE);
+    conn->response = Buffer_create(BUFFER_SIZE);
+    if (conn->request == NULL || conn->upstream == NULL || conn->response == NULL)
+    {
+        logError("Failed to allocate connection buffers");
+        goto cleanup;
+    }
+
+    conn->clientHandler.onEvent = onClientEvent;
+    conn->originHandler.onEvent = onOriginEvent;
+    conn->waiter.notify = notifyConnection;
+    conn->dnsWaiter.notify = notifyResolved;
+    conn->dnsWaiter.result = &conn->resolved;
+    conn->worker = worker;
+    conn->state = ReadingRequest;
+    conn->clientSocket = clientSocket;
+    conn->originSocket = -1;
+    conn->lastActivity = time(NULL);
+
+    if (watch(worker, clientSocket, &conn->clientHandler, EPOLLIN) < 0)
+    {
+        logError("Failed to register client socket");
+        goto cleanup;
+    }
+
+    conn->next = worker->connections;
+    if (worker->connections != NULL)
+    {
+        worker->connections->prev = conn;
+    }
+    worker->connections = conn;
+    metricsAdd(GaugeClientConnections, 1);
+    PROXY_PROBE1(conn_accept, clientSocket);
+
+    logDebug("New client connection accepted");
+    return;
+
+cleanup:
+    Buffer_destroy(conn->request);
+    Buffer_destroy(conn->upstream);
+    Buffer_destroy(conn->response);
+    free(conn);
+    close(clientSocket);
+}
+
+static void onAcceptEvent(EventHandler *handler, uint32_t events)
+{
+    EventWorker *worker = CONTAINER_OF(handler, EventWorker, acceptHandler);
+
+    (void)events;
+
+    for (int i = 0; i < ACCEPT_BATCH; i++)
+    {
+        int clientSocket = accept4(worker->serverSocket, NULL, NULL,
+                                   SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (clientSocket < 0)
+        {
+            return;
+        }
+        newConnection(worker, clientSocket);
+    }
+}
+
+static int isOriginPhase(const EventConnection *conn)
+{
+    return conn->state == Resolving ||
+           conn->state == Connecting ||
+           conn->state == SendingRequest ||
+           conn->state == ReadingResponse;
+}
+
+static void sweepIdle(EventWorker *worker, time_t now)
+{
+    EventConnection *conn = worker->connections;
+    while (conn != NULL)
+    {
+        EventConnection *next = conn->next;
+        int timeout = isOriginPhase(conn) ? ORIGIN_IDLE_TIMEOUT_SEC : CLIENT_IDLE_TIMEOUT_SEC;
+
+        if (conn->state == ReadingRequest && conn->servedRequests > 0)
+        {
+            timeout = KEEPALIVE_TIMEOUT_SEC;
+        }
+
+        if (!conn->waiter.isLinked && now - conn->lastActivity > timeout)
+        {
+            logError("Connection timed out");
+            closeConnection(conn);
+        }
+        conn = next;
+    }
+
+    EventUpload *upload = worker->uploads;
+    while (upload != NULL)
+    {
+        EventUpload *next = upload->next;
+        if (now - upload->lastActivity > ORIGIN_IDLE_TIMEOUT_SEC)
+        {
+            logError("Download receive timed out");
+            finishUpload(upload, Failed);
+        }
+        upload = next;
+    }
+}
+
+static void shutdownWorker(EventWorker *worker)
+{
+    while (worker->connections != NULL)
+    {
+        closeConnection(worker->connections);
+    }
+    freeClosedConnections(worker);
+
+    while (worker->uploads != NULL)
+    {
+        finishUpload(worker->uploads, Failed);
+    }
+}
+
+static void *eventWorkerThread(void *args)
+{
+    EventWorker *worker = args;
+    struct epoll_event events[MAX_EVENTS];
+    time_t lastSweep = time(NULL);
+
+    logDebug("Event worker started");
+
+    while (!serverShutdown)
+    {
+        int count = epoll_wait(worker->epollFd, events, MAX_EVENTS, LOOP_TICK_MS);
+        if (count < 0 && errno != EINTR)
+        {
+            logError("Event wait failed");
+            break;
+        }
+
+        for (int i = 0; i < count; i++)
+        {
+            EventHandler *handler = events[i].data.ptr;
+            handler->onEvent(handler, events[i].events);
+        }
+
+        freeClosedConnections(worker);
+
+        time_t now = time(NULL);
+        if (now != lastSweep)
+        {
+            sweepIdle(worker, now);
+            freeClosedConnections(worker);
+            lastSweep = now;
+        }
+    }
+
+    shutdownWorker(worker);
+    logDebug("Event worker finished");
+    return NULL;
+}
+
+static void destroyWorker(EventWorker *worker)
+{
+    if (worker->wakeFd >= 0)
+    {
+        close(worker->wakeFd);
+    }
+    if (worker->epollFd >= 0)
+    {
+        close(worker->epollFd);
+    }
+    pthread_mutex_destroy(&worker->wakeMutex);
+}
+
+static int initWorker(EventWorker *worker, int serverSocket, CacheManagerT *cache)
+{
+    worker->acceptHandler.onEvent = onAcceptEvent;
+    worker->wakeHandler.onEvent = onWakeEvent;
+    worker->serverSocket = serverSocket;
+    worker->cache = cache;
+    worker->epollFd = epoll_create1(EPOLL_CLOEXEC);
+    worker->wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    pthread_mutex_init(&worker->wakeMutex, NULL);
+
+    if (worker->epollFd < 0 || worker->wakeFd < 0)
+    {
+        logError("Failed to create event worker");
+        return ERROR;
+    }
+
+    if (watch(worker, worker->wakeFd, &worker->wakeHandler, EPOLLIN) < 0 ||
+        watch(worker, serverSocket, &worker->acceptHandler, EPOLLIN | EPOLLEXCLUSIVE) < 0)
+    {
+        logError("Failed to register worker sockets");
+        return ERROR;
+    }
+
+    return SUCCESS;
+}
+
+/*
+ * With steering, connections arriving on CPU c go to listener c modulo the
+ * listener count, so worker i is kept on CPU i to accept them where they
+ * landed.
+ */
+static void pinWorker(EventWorker *worker, int index)
+{
+    cpu_set_t cpus;
+    long cpuCount = sysconf(_SC_NPROCESSORS_ONLN);
+
+    CPU_ZERO(&cpus);
+    CPU_SET(index % ((cpuCount > 0) ? cpuCount : 1), &cpus);
+
+    if (pthread_setaffinity_np(worker->thread, sizeof(cpus), &cpus) != 0)
+    {
+        logError("Failed to pin event worker %d", index);
+    }
+}
+
+/* Worker i accepts on listener i modulo socketCount; workers sharing one take turns. */
+int runEventLoopServer(const int *serverSockets, int socketCount, CacheManagerT *cache,
+                       int workerCount, int isSteered)
+{
+    int started = 0;
+    int result = ERROR;
+    EventWorker *workers = calloc(workerCount, sizeof(EventWorker));
+
+    if (workers == NULL)
+    {
+        logError("Failed to allocate event workers");
+        return ERROR;
+    }
+
+    for (int i = 0; i < workerCount; i++)
+    {
+        workers[i].epollFd = -1;
+        workers[i].wakeFd = -1;
+    }
+
+    for (started = 0; started < workerCount; started++)
+    {
+        if (initWorker(&workers[started], serverSockets[started % socketCount], cache) != SUCCESS ||
+            pthread_create(&workers[started].thread, NULL, eventWorkerThread, &workers[started]) != 0)
+        {
+            logError("Failed to start event worker");
+            serverShutdown = 1;
+            destroyWorker(&workers[started]);
+            break;
+        }
+
+        if (isSteered)
+        {
+            pinWorker(&workers[started], started);
+        }
+    }
+
+    if (started == workerCount)
+    {
+        logInfo("Event loop workers running");
+        result = SUCCESS;
+    }
+
+    for (int i = 0; i < started; i++)
+    {
+        pthread_join(workers[i].thread, NULL);
+        destroyWorker(&workers[i]);
+    }
+
+    free(workers);
+    return result;
+}
@@ -1,73 +1,74 @@
 #include "proxy.h"
 #include "log.h"
+#include "metrics.h"
+#include "probes.h"
 #include "buffer.h"
 
 #include <errno.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <sys/socket.h>
-#include <sys/select.h>
 
 #define DOWNLOAD_TIMEOUT_SEC 30
 
-static ssize_t recvWithTimeoutUpload(int socket, char *buffer, size_t size)
+static ssize_t recvWithTimeoutUpload(CacheEntryT *entry, int socket, char *buffer, size_t size)
 {
-    if (waitForReadable(socket, DOWNLOAD_TIMEOUT_SEC) != SUCCESS)
+    while (1)
     {
-        if (errno == ETIMEDOUT)
+        ssize_t n = recv(socket, buffer, size, 0);
+        if (n >= 0)
         {
-            logError("Download receive timed out");
+            return n;
+        }
+        if (errno == EINTR)
+        {
+            continue;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+        {
+            logError("Download receive failed");
+            return ERROR;
         }
-        return ERROR;
-    }
-
-    ssize_t n = recv(socket, buffer, size, 0);
-
-    if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
-    {
-        logError("Download receive failed");
-        return ERROR;
-    }
-
-    return n;
-}
-
-static ssize_t recvToBufferUpload(int socket, Buffer *buffer)
-{
-    char *ptr = Buffer_writePtr(buffer);
-    size_t available = Buffer_available(buffer);
-
-    if (available == 0)
-    {
-        logError("Buffer is full");
-        return ERROR;
-    }
 
-    ssize_t n = recvWithTimeoutUpload(socket, ptr, available);
+        CacheEntryT_flush(entry);
 
-    if (n > 0)
-    {
-        Buffer_advanceSize(buffer, n);
+        if (waitForReadable(socket, DOWNLOAD_TIMEOUT_SEC) != SUCCESS)
+        {
+            if (errno == ETIMEDOUT)
+            {
+                logError("Download receive timed out");
+            }
+            return ERROR;
+        }
     }
-
-    return n;
 }
 
 void *fileUploadThread(void *args)
 {
     FileUploadContext *ctx = args;
     CacheEntryT *entry = ctx->entry;
-    Buffer *buffer = ctx->buffer;
     int remoteSocket = ctx->remoteSocket;
     CacheStatusT finalStatus = Success;
+    size_t readSize = UPLOAD_READ_MIN;
 
     logDebug("File upload thread started");
+    PROXY_PROBE2(upload_start, entry, remoteSocket);
 
-    while (1)
+    while (!ctx->frame.isComplete)
     {
-        Buffer_clear(buffer);
+        size_t available = 0;
+        char *slice = CacheEntryT_reserve(entry, &available);
 
-        ssize_t received = recvToBufferUpload(remoteSocket, buffer);
+        if (slice == NULL)
+        {
+            logError("Failed to reserve cache space");
+            finalStatus = Failed;
+            break;
+        }
+
+        size_t requested = limitResponseRead(&ctx->frame, (available < readSize) ? available : readSize);
+        ssize_t received = recvWithTimeoutUpload(entry, remoteSocket, slice, requested);
 
         if (received < 0)
         {
@@ -79,25 +80,36 @@ void *fileUploadThread(void *args)
         if (received == 0)
         {
             logDebug("Remote connection closed");
+            endResponseFrame(&ctx->frame);
+            if (!ctx->frame.isComplete)
+            {
+                logError("Remote closed before end of response");
+                finalStatus = Failed;
+            }
             break;
         }
 
-        CacheEntryChunkT *chunk = CacheEntryT_appendData(
-            entry, get_Buffer_data(buffer), get_Buffer_size(buffer), InProcess
-        );
-
-        if (chunk == NULL)
+        size_t used = advanceResponseFrame(&ctx->frame, slice, received);
+        if (used < (size_t)received)
         {
-            logError("Failed to append data to cache");
-            finalStatus = Failed;
-            break;
+            ctx->frame.keepAlive = 0;
         }
+
+        CacheEntryT_commit(entry, used, InProcess);
+        readSize = adaptReadSize(readSize, requested, received);
     }
 
+    if (finalStatus == Failed)
+    {
+        CacheManagerT_remove_CacheEntryT(entry->owner, entry);
+    }
     CacheEntryT_updateStatus(entry, finalStatus);
 
+    metricsAdd(GaugeDownloads, -1);
+    PROXY_PROBE3(upload_done, entry, entry->downloadedSize, finalStatus == Success);
     if (finalStatus == Success)
     {
+        metricsObserve(HistogramObjectSize, entry->downloadedSize - entry->headerSize);
         logInfo("File upload completed successfully");
     }
     else
@@ -105,18 +117,25 @@ void *fileUploadThread(void *args)
         logError("File upload failed");
     }
 
-    close(remoteSocket);
-    Buffer_destroy(buffer);
+    finishOriginSocket(ctx->host, ctx->port, remoteSocket, &ctx->frame);
+    CacheEntryT_release(entry);
     free(ctx);
+
+    pthread_mutex_lock(&clientsMutex);
+    activeClients--;
+    if (activeClients == 0)
+    {
+        pthread_cond_signal(&clientsCond);
+    }
+    pthread_mutex_unlock(&clientsMutex);
+
     return NULL;
 }
 
-int startBackgroundUpload(CacheEntryT *entry,
-                          Buffer *requestBuffer,
-                          int remoteSocket)
+int startBackgroundUpload(CacheEntryT *entry, int remoteSocket,
+                          const char *host, int port, const ResponseFrame *frame)
 {
     FileUploadContext *ctx = NULL;
-    Buffer *uploadBuffer = NULL;
     pthread_t thread;
 
     logDebug("Starting background upload");
@@ -128,20 +147,27 @@ int startBackgroundUpload(CacheEntryT *entry,
         goto cleanup;
     }
 
-    uploadBuffer = Buffer_create(get_Buffer_capacity(requestBuffer));
-    if (uploadBuffer == NULL)
-    {
-        logError("Failed to create upload buffer");
-        goto cleanup;
-    }
-
-    ctx->entry = entry;
-    ctx->buffer = uploadBuffer;
+    ctx->entry = CacheEntryT_acquire(entry);
     ctx->remoteSocket = remoteSocket;
+    snprintf(ctx->host, sizeof(ctx->host), "%s", host);
+    ctx->port = port;
+    ctx->frame = *frame;
+
+    pthread_mutex_lock(&clientsMutex);
+    activeClients++;
+    pthread_mutex_unlock(&clientsMutex);
+    metricsAdd(GaugeDownloads, 1);
 
     if (pthread_create(&thread, NULL, fileUploadThread, ctx) != 0)
     {
         logError("Failed to create upload thread");
+        CacheEntryT_release(entry);
+
+        pthread_mutex_lock(&clientsMutex);
+        activeClients--;
+        pthread_mutex_unlock(&clientsMutex);
+        metricsAdd(GaugeDownloads, -1);
+
         goto cleanup;
     }
 
@@ -150,7 +176,6 @@ int startBackgroundUpload(CacheEntryT *entry,
     return SUCCESS;
 
 cleanup:
-    Buffer_destroy(uploadBuffer);
     free(ctx);
     return ERROR;
 }
\ No newline at end of file
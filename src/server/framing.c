@@ -0,0 +1,952 @@
+#include "proxy.h"
+#include "log.h"
+#include "buffer.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+static const char *HOP_BY_HOP_HEADERS[] = {"Connection", "Proxy-Connection", "Keep-Alive"};
+
+typedef enum ChunkState
+{
+    ChunkSize,
+    ChunkLine,
+    ChunkData,
+    ChunkDataEnd,
+    ChunkTrailer,
+    ChunkTrailerLine
+} ChunkStateT;
+
+static int hasToken(const char *value, size_t length, const char *token)
+{
+    size_t tokenLength = strlen(token);
+    const char *end = value + length;
+
+    while (value < end)
+    {
+        while (value < end && (*value == ' ' || *value == ','))
+        {
+            value++;
+        }
+        if (value >= end)
+        {
+            break;
+        }
+
+        const char *tokenEnd = memchr(value, ',', end - value);
+        if (tokenEnd == NULL)
+        {
+            tokenEnd = end;
+        }
+
+        const char *trimmed = tokenEnd;
+        while (trimmed > value && trimmed[-1] == ' ')
+        {
+            trimmed--;
+        }
+
+        if ((size_t)(trimmed - value) == tokenLength && strncasecmp(value, token, tokenLength) == 0)
+        {
+            return 1;
+        }
+
+        value = tokenEnd;
+    }
+
+    return 0;
+}
+
+static int connectionHas(const char *data, const HttpMessage *message, const char *token)
+{
+    for (size_t i = 0; i < message->headerCount; i++)
+    {
+        const HttpHeader *header = &message->headers[i];
+
+        if ((header->id == HeaderConnection || header->id == HeaderProxyConnection) &&
+            hasToken(data + header->value.offset, header->value.length, token))
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static int isKeptAlive(const char *data, const HttpMessage *message)
+{
+    return (message->minorVersion >= 1) ? !connectionHas(data, message, "close")
+                                        : connectionHas(data, message, "keep-alive");
+}
+
+/*
+ * Reads Content-Length into *length, or -1 when there is none. Repeated
+ * lines and anything but a plain decimal that fits are errors (RFC 9112
+ * 6.1), since peers could disagree on where such a body ends.
+ */
+static int parseContentLength(const char *data, const HttpMessage *message, long long *length)
+{
+    size_t valueLength = 0;
+    const char *value = httpHeader(data, message, HeaderContentLength, &valueLength);
+    int count = 0;
+
+    *length = -1;
+    if (value == NULL)
+    {
+        return SUCCESS;
+    }
+
+    for (size_t i = 0; i < message->headerCount; i++)
+    {
+        count += (message->headers[i].id == HeaderContentLength);
+    }
+
+    if (count > 1 || valueLength == 0)
+    {
+        return ERROR;
+    }
+    for (size_t i = 0; i < valueLength; i++)
+    {
+        if (!isdigit((unsigned char)value[i]))
+        {
+            return ERROR;
+        }
+    }
+
+    errno = 0;
+    *length = strtoll(value, NULL, 10);
+    return (errno == ERANGE) ? ERROR : SUCCESS;
+}
+
+/* Whether chunked is the last coding of the last Transfer-Encoding line. */
+static int isChunkedLast(const char *data, const HttpMessage *message)
+{
+    const HttpHeader *last = NULL;
+
+    for (size_t i = 0; i < message->headerCount; i++)
+    {
+        if (message->headers[i].id == HeaderTransferEncoding)
+        {
+            last = &message->headers[i];
+        }
+    }
+
+    if (last == NULL || last->value.length < 7)
+    {
+        return 0;
+    }
+
+    const char *value = data + last->value.offset;
+    const char *coding = value + last->value.length - 7;
+
+    return strncasecmp(coding, "chunked", 7) == 0 &&
+           (coding == value || coding[-1] == ',' || coding[-1] == ' ' || coding[-1] == '\t');
+}
+
+static int appendSlice(Buffer *out, const char *data, HttpSlice slice)
+{
+    return Buffer_append(out, data + slice.offset, slice.length);
+}
+
+static int appendRequestLine(Buffer *out, const char *data, const HttpMessage *message)
+{
+    static const char version[] = " HTTP/1.1\r\n";
+
+    if (appendSlice(out, data, message->method) != SUCCESS ||
+        Buffer_append(out, " ", 1) != SUCCESS ||
+        appendSlice(out, data, message->target) != SUCCESS ||
+        Buffer_append(out, version, sizeof(version) - 1) != SUCCESS)
+    {
+        return ERROR;
+    }
+
+    return SUCCESS;
+}
+
+static int appendHostHeader(Buffer *out, const char *data, const HttpMessage *message)
+{
+    if (message->known[HeaderHost] != 0)
+    {
+        return SUCCESS;
+    }
+
+    const char *target = data + message->target.offset;
+    const char *authority = memmem(target, message->target.length, "://", 3);
+    if (authority == NULL)
+    {
+        return ERROR;
+    }
+
+    authority += 3;
+    size_t authorityLength = strcspn(authority, "/ \r");
+
+    if (Buffer_append(out, "Host: ", 6) != SUCCESS ||
+        Buffer_append(out, authority, authorityLength) != SUCCESS ||
+        Buffer_append(out, "\r\n", 2) != SUCCESS)
+    {
+        return ERROR;
+    }
+
+    return SUCCESS;
+}
+
+#define HEADER_BIT(id) (1u << (id))
+#define HOP_BY_HOP_MASK \
+    (HEADER_BIT(HeaderConnection) | HEADER_BIT(HeaderProxyConnection) | HEADER_BIT(HeaderKeepAlive))
+
+static int appendHeaders(Buffer *out, const char *data, const HttpMessage *message, unsigned skipMask)
+{
+    for (size_t i = 0; i < message->headerCount; i++)
+    {
+        const HttpHeader *header = &message->headers[i];
+
+        if (header->id != HeaderOther && (skipMask & HEADER_BIT(header->id)))
+        {
+            continue;
+        }
+
+        if (appendSlice(out, data, header->name) != SUCCESS ||
+            Buffer_append(out, ": ", 2) != SUCCESS ||
+            appendSlice(out, data, header->value) != SUCCESS ||
+            Buffer_append(out, "\r\n", 2) != SUCCESS)
+        {
+            return ERROR;
+        }
+    }
+
+    return SUCCESS;
+}
+
+static int isHopByHop(const char *line, size_t length)
+{
+    for (size_t i = 0; i < sizeof(HOP_BY_HOP_HEADERS) / sizeof(HOP_BY_HOP_HEADERS[0]); i++)
+    {
+        size_t nameLength = strlen(HOP_BY_HOP_HEADERS[i]);
+        if (length > nameLength && line[nameLength] == ':' &&
+            strncasecmp(line, HOP_BY_HOP_HEADERS[i], nameLength) == 0)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int copyEndToEndHeaders(Buffer *out, const char *headers, size_t length)
+{
+    const char *end = headers + length;
+    const char *line = headers;
+
+    while (line < end)
+    {
+        const char *lineEnd = memchr(line, '\n', end - line);
+        lineEnd = (lineEnd == NULL) ? end : lineEnd + 1;
+
+        if (!isHopByHop(line, lineEnd - line) &&
+            Buffer_append(out, line, lineEnd - line) != SUCCESS)
+        {
+            return ERROR;
+        }
+
+        line = lineEnd;
+    }
+
+    return SUCCESS;
+}
+
+/*
+ * Returns ERROR until the request headers are buffered; headers that do not
+ * end within REQUEST_HEADER_MAX_SIZE leave the frame invalid. The body is
+ * then read with advanceRequestFrame().
+ */
+int parseRequestFrame(Buffer *buffer, RequestFrame *frame)
+{
+    int headerEnd = findHeaderEnd(buffer);
+
+    frame->isTooLarge = 0;
+    frame->body = (ResponseFrame){.framing = BodyNone, .isComplete = 1};
+
+    if (headerEnd < 0)
+    {
+        if (get_Buffer_size(buffer) <= REQUEST_HEADER_MAX_SIZE)
+        {
+            return ERROR;
+        }
+        frame->headerLength = get_Buffer_size(buffer);
+        frame->totalLength = frame->headerLength;
+        frame->isValid = 0;
+        frame->keepAlive = 0;
+        return SUCCESS;
+    }
+
+    const char *data = get_Buffer_data(buffer);
+    HttpMessage *message = &frame->message;
+
+    frame->headerLength = headerEnd;
+    frame->totalLength = headerEnd;
+    frame->isValid = (parseHttpRequest(data, headerEnd, message) == SUCCESS);
+    if (!frame->isValid)
+    {
+        frame->keepAlive = 0;
+        return SUCCESS;
+    }
+
+    frame->keepAlive = isKeptAlive(data, message);
+
+    /* A body that could be framed two ways is how requests get smuggled. */
+    long long bodyLength = -1;
+    int isChunked = (message->known[HeaderTransferEncoding] != 0);
+
+    if (parseContentLength(data, message, &bodyLength) != SUCCESS ||
+        (isChunked && (bodyLength >= 0 || !isChunkedLast(data, message))))
+    {
+        frame->isValid = 0;
+        frame->keepAlive = 0;
+        return SUCCESS;
+    }
+
+    if (isChunked)
+    {
+        frame->body.framing = BodyChunked;
+        frame->body.isComplete = 0;
+    }
+    else if (bodyLength >= 0)
+    {
+        frame->totalLength += bodyLength;
+        frame->isTooLarge = ((unsigned long long)bodyLength > REQUEST_BODY_MAX_SIZE);
+    }
+
+    return SUCCESS;
+}
+
+int buildUpstreamRequest(const Buffer *request, const RequestFrame *frame, Buffer *upstream)
+{
+    const char *data = get_Buffer_data(request);
+    static const char keepAliveHeader[] = "Connection: keep-alive\r\n\r\n";
+
+    unsigned skipMask = HOP_BY_HOP_MASK;
+
+    Buffer_clear(upstream);
+
+    /* GETs fill the cache with the whole object; ranges are cut from the entry */
+    if (isHttpSlice(data, frame->message.method, "GET"))
+    {
+        skipMask |= HEADER_BIT(HeaderRange) | HEADER_BIT(HeaderIfRange);
+    }
+
+    if (appendRequestLine(upstream, data, &frame->message) != SUCCESS ||
+        appendHostHeader(upstream, data, &frame->message) != SUCCESS ||
+        appendHeaders(upstream, data, &frame->message, skipMask) != SUCCESS ||
+        Buffer_append(upstream, keepAliveHeader, sizeof(keepAliveHeader) - 1) != SUCCESS ||
+        Buffer_append(upstream, data + frame->headerLength,
+                      frame->totalLength - frame->headerLength) != SUCCESS)
+    {
+        logError("Failed to build upstream request");
+        return ERROR;
+    }
+
+    return SUCCESS;
+}
+
+/*
+ * Returns the header block to serve for an entry and its length. The copy
+ * goes to a scratch buffer created here when the block spans chunks or was
+ * refreshed by a 304, since the latter can be replaced under a reader.
+ */
+static const char *entryHeaders(CacheEntryT *entry, Buffer **scratch, size_t *length)
+{
+    CacheEntryChunkT *chunk = entry->dataChunks;
+    size_t headerSize = entry->headerSize;
+    const char *headers = NULL;
+
+    pthread_mutex_lock(&entry->dataMutex);
+    if (entry->refreshedHeaders != NULL)
+    {
+        *scratch = Buffer_create(entry->refreshedHeaderSize);
+        if (*scratch != NULL &&
+            Buffer_append(*scratch, entry->refreshedHeaders, entry->refreshedHeaderSize) == SUCCESS)
+        {
+            headers = get_Buffer_data(*scratch);
+            *length = entry->refreshedHeaderSize;
+        }
+        pthread_mutex_unlock(&entry->dataMutex);
+        return headers;
+    }
+    pthread_mutex_unlock(&entry->dataMutex);
+
+    *length = headerSize;
+    if (chunk->curDataSize >= headerSize)
+    {
+        return chunk->data;
+    }
+
+    *scratch = Buffer_create(headerSize);
+    if (*scratch == NULL)
+    {
+        return NULL;
+    }
+
+    for (; chunk != NULL && get_Buffer_size(*scratch) < headerSize; chunk = chunk->next)
+    {
+        size_t remaining = headerSize - get_Buffer_size(*scratch);
+        size_t available = chunk->curDataSize;
+
+        if (Buffer_append(*scratch, chunk->data, (available < remaining) ? available : remaining) != SUCCESS)
+        {
+            return NULL;
+        }
+    }
+
+    return get_Buffer_data(*scratch);
+}
+
+#define REFRESHED_MASK                                                                   \
+    (HEADER_BIT(HeaderCacheControl) | HEADER_BIT(HeaderExpires) | HEADER_BIT(HeaderDate) | \
+     HEADER_BIT(HeaderEtag) | HEADER_BIT(HeaderLastModified) | HEADER_BIT(HeaderAge))
+
+/*
+ * Merges a 304 into the stored response (RFC 9111 4.3.4): each of the
+ * freshness and validator fields the 304 carries replaces the stored one,
+ * and the stored Age is dropped since it described the original response.
+ * Freshness is then recomputed from the merged headers.
+ */
+int refreshEntryHeaders(CacheEntryT *entry, const char *headers, const HttpMessage *update)
+{
+    HttpMessage stored;
+    Buffer *scratch = NULL;
+    Buffer *merged = NULL;
+    size_t storedLength = 0;
+    unsigned skipMask = HEADER_BIT(HeaderAge);
+    int result = ERROR;
+
+    const char *storedHeaders = entryHeaders(entry, &scratch, &storedLength);
+    if (storedHeaders == NULL || parseHttpResponse(storedHeaders, storedLength, &stored) != SUCCESS)
+    {
+        goto cleanup;
+    }
+
+    for (size_t i = 0; i < update->headerCount; i++)
+    {
+        skipMask |= HEADER_BIT(update->headers[i].id) & REFRESHED_MASK;
+    }
+
+    const char *statusEnd = memchr(storedHeaders, '\n', storedLength);
+    merged = Buffer_create(storedLength + update->headerLength);
+    if (statusEnd == NULL || merged == NULL ||
+        Buffer_append(merged, storedHeaders, statusEnd + 1 - storedHeaders) != SUCCESS ||
+        appendHeaders(merged, storedHeaders, &stored, skipMask) != SUCCESS)
+    {
+        goto cleanup;
+    }
+
+    for (size_t i = 0; i < update->headerCount; i++)
+    {
+        const HttpHeader *header = &update->headers[i];
+
+        if (header->id != HeaderOther && (REFRESHED_MASK & HEADER_BIT(header->id)) &&
+            (appendSlice(merged, headers, header->name) != SUCCESS ||
+             Buffer_append(merged, ": ", 2) != SUCCESS ||
+             appendSlice(merged, headers, header->value) != SUCCESS ||
+             Buffer_append(merged, "\r\n", 2) != SUCCESS))
+        {
+            goto cleanup;
+        }
+    }
+
+    size_t mergedLength = get_Buffer_size(merged) + 2;
+    char *copy = (Buffer_append(merged, "\r\n", 2) == SUCCESS) ? malloc(mergedLength) : NULL;
+    if (copy == NULL)
+    {
+        goto cleanup;
+    }
+    memcpy(copy, get_Buffer_data(merged), mergedLength);
+
+    /* stored now describes the merged copy, which the entry owns from here on */
+    if (parseHttpResponse(copy, mergedLength, &stored) != SUCCESS)
+    {
+        free(copy);
+        goto cleanup;
+    }
+
+    pthread_mutex_lock(&entry->dataMutex);
+    free(entry->refreshedHeaders);
+    entry->refreshedHeaders = copy;
+    entry->refreshedHeaderSize = mergedLength;
+    pthread_mutex_unlock(&entry->dataMutex);
+
+    updateEntryFreshness(entry, copy, &stored);
+    result = SUCCESS;
+
+cleanup:
+    Buffer_destroy(merged);
+    Buffer_destroy(scratch);
+    return result;
+}
+
+void parseByteRange(const char *data, const HttpMessage *message, ByteRange *range)
+{
+    size_t valueLength = 0;
+    const char *value = httpHeader(data, message, HeaderRange, &valueLength);
+
+    range->isRequested = 0;
+    range->ifRange[0] = '\0';
+
+    if (value == NULL || valueLength < 7 || strncasecmp(value, "bytes=", 6) != 0 ||
+        memchr(value, ',', valueLength) != NULL)
+    {
+        return;
+    }
+
+    const char *p = value + 6;
+    const char *end = value + valueLength;
+    char *numberEnd = NULL;
+
+    range->first = -1;
+    range->last = -1;
+
+    if (*p != '-')
+    {
+        range->first = strtoll(p, &numberEnd, 10);
+        if (numberEnd == p || range->first < 0 || *numberEnd != '-')
+        {
+            return;
+        }
+        p = numberEnd;
+    }
+
+    p++;
+    if (p < end)
+    {
+        range->last = strtoll(p, &numberEnd, 10);
+        if (numberEnd != end || range->last < 0 ||
+            (range->first >= 0 && range->last < range->first))
+        {
+            return;
+        }
+    }
+    else if (range->first < 0)
+    {
+        return;
+    }
+
+    value = httpHeader(data, message, HeaderIfRange, &valueLength);
+    if (value != NULL)
+    {
+        if (valueLength == 0 || valueLength >= sizeof(range->ifRange))
+        {
+            return;
+        }
+        memcpy(range->ifRange, value, valueLength);
+        range->ifRange[valueLength] = '\0';
+    }
+
+    range->isRequested = 1;
+}
+
+static int isRangeCurrent(CacheEntryT *entry, const ByteRange *range)
+{
+    const char *validator = range->ifRange;
+    int isCurrent = 0;
+
+    if (validator[0] == '\0')
+    {
+        return 1;
+    }
+
+    pthread_mutex_lock(&entry->dataMutex);
+    if (validator[0] == '"')
+    {
+        isCurrent = entry->etag != NULL && strcmp(entry->etag, validator) == 0;
+    }
+    else if (strncmp(validator, "W/", 2) != 0)
+    {
+        isCurrent = entry->lastModified != NULL && strcmp(entry->lastModified, validator) == 0;
+    }
+    pthread_mutex_unlock(&entry->dataMutex);
+
+    return isCurrent;
+}
+
+/*
+ * Returns the status to answer a range with once the body length is known:
+ * 206 with [first, last] set, 416, or 200 to ignore the range.
+ */
+static int resolveByteRange(CacheEntryT *entry, const ByteRange *range, long long length,
+                            long long *first, long long *last)
+{
+    if (range == NULL || !range->isRequested || length < 0 || !isRangeCurrent(entry, range))
+    {
+        return 200;
+    }
+
+    if (range->first < 0)
+    {
+        if (range->last == 0 || length == 0)
+        {
+            return 416;
+        }
+        *first = (range->last < length) ? length - range->last : 0;
+        *last = length - 1;
+        return 206;
+    }
+
+    if (range->first >= length)
+    {
+        return 416;
+    }
+
+    *first = range->first;
+    *last = (range->last < 0 || range->last >= length) ? length - 1 : range->last;
+    return 206;
+}
+
+int buildCachedResponseHead(CacheEntryT *entry, const ByteRange *range, int keepAlive,
+                            Buffer *head, int *isKeptAlive, CachedBody *body)
+{
+    HttpMessage message;
+    size_t valueLength = 0;
+    size_t headerSize = entry->headerSize;
+    Buffer *scratch = NULL;
+    long long length = -1;
+    long long first = 0;
+    long long last = 0;
+    char line[128];
+    int result = ERROR;
+
+    size_t headersLength = 0;
+
+    Buffer_clear(head);
+    body->offset = headerSize;
+    body->end = SIZE_MAX;
+
+    const char *headers = entryHeaders(entry, &scratch, &headersLength);
+    if (headers == NULL || parseHttpResponse(headers, headersLength, &message) != SUCCESS)
+    {
+        goto cleanup;
+    }
+
+    const char *value = httpHeader(headers, &message, HeaderContentLength, &valueLength);
+    int isChunked = message.known[HeaderTransferEncoding] != 0;
+
+    if (value != NULL && !isChunked)
+    {
+        length = strtoll(value, NULL, 10);
+    }
+    else if (!isChunked && entry->status == Success)
+    {
+        length = entry->downloadedSize - headerSize;
+    }
+
+    int status = (message.status == 200) ? resolveByteRange(entry, range, length, &first, &last)
+                                         : message.status;
+    int isFramed = (value != NULL || isChunked);
+
+    body->status = status;
+
+    if (status == 206)
+    {
+        int lineLength = snprintf(line, sizeof(line),
+                                  "Content-Range: bytes %lld-%lld/%lld\r\nContent-Length: %lld\r\n",
+                                  first, last, length, last - first + 1);
+        static const char statusLine[] = "HTTP/1.1 206 Partial Content\r\n";
+
+        if (Buffer_append(head, statusLine, sizeof(statusLine) - 1) != SUCCESS ||
+            appendHeaders(head, headers, &message,
+                          HOP_BY_HOP_MASK | HEADER_BIT(HeaderContentLength)) != SUCCESS ||
+            Buffer_append(head, line, lineLength) != SUCCESS)
+        {
+            goto cleanup;
+        }
+        body->offset = headerSize + first;
+        body->end = headerSize + last + 1;
+        isFramed = 1;
+    }
+    else if (status == 416)
+    {
+        int lineLength = snprintf(line, sizeof(line),
+                                  "HTTP/1.1 416 Range Not Satisfiable\r\n"
+                                  "Content-Range: bytes */%lld\r\nContent-Length: 0\r\n",
+                                  length);
+        if (Buffer_append(head, line, lineLength) != SUCCESS)
+        {
+            goto cleanup;
+        }
+        body->end = headerSize;
+        isFramed = 1;
+    }
+    else
+    {
+        if (copyEndToEndHeaders(head, headers, headersLength - 2) != SUCCESS)
+        {
+            goto cleanup;
+        }
+
+        if (!isFramed && entry->status == Success)
+        {
+            int lineLength = snprintf(line, sizeof(line), "Content-Length: %lld\r\n", length);
+            if (Buffer_append(head, line, lineLength) != SUCCESS)
+            {
+                goto cleanup;
+            }
+            isFramed = 1;
+        }
+    }
+
+    *isKeptAlive = keepAlive && isFramed;
+
+    const char *connection = *isKeptAlive ? "Connection: keep-alive\r\n\r\n"
+                                          : "Connection: close\r\n\r\n";
+    result = Buffer_append(head, connection, strlen(connection));
+
+cleanup:
+    Buffer_destroy(scratch);
+    return result;
+}
+
+int buildRelayedResponseHead(const char *headers, const ResponseFrame *frame,
+                             int keepAlive, Buffer *head, int *isKeptAlive)
+{
+    Buffer_clear(head);
+
+    if (copyEndToEndHeaders(head, headers, frame->headerLength - 2) != SUCCESS)
+    {
+        return ERROR;
+    }
+
+    *isKeptAlive = keepAlive && frame->framing != BodyUntilClose;
+
+    const char *connection = *isKeptAlive ? "Connection: keep-alive\r\n\r\n"
+                                          : "Connection: close\r\n\r\n";
+    return Buffer_append(head, connection, strlen(connection));
+}
+
+int isIdempotentRequest(const Buffer *request)
+{
+    const char *data = get_Buffer_data(request);
+    size_t size = get_Buffer_size(request);
+
+    return (size >= 4 && strncmp(data, "GET ", 4) == 0) || isHeadRequest(request);
+}
+
+int isHeadRequest(const Buffer *request)
+{
+    return get_Buffer_size(request) >= 5 && strncmp(get_Buffer_data(request), "HEAD ", 5) == 0;
+}
+
+/*
+ * Frames a response from its headers. The parsed headers are left in
+ * *message when it is not NULL; they are only usable when frame->status
+ * is set, which it is not for headers that did not parse.
+ */
+void parseResponseFrame(const char *headers, size_t headerLength, int isHead,
+                        ResponseFrame *frame, HttpMessage *message)
+{
+    HttpMessage local;
+
+    if (message == NULL)
+    {
+        message = &local;
+    }
+
+    memset(frame, 0, sizeof(*frame));
+    frame->headerLength = headerLength;
+    frame->chunkState = ChunkSize;
+
+    if (parseHttpResponse(headers, headerLength, message) != SUCCESS)
+    {
+        goto unframed;
+    }
+
+    int status = message->status;
+
+    frame->status = status;
+    frame->keepAlive = isKeptAlive(headers, message);
+
+    if (isHead || status / 100 == 1 || status == 204 || status == 304)
+    {
+        frame->framing = BodyNone;
+        frame->isComplete = 1;
+        return;
+    }
+
+    long long length = -1;
+    int hasLength = (parseContentLength(headers, message, &length) != SUCCESS || length >= 0);
+
+    if (message->known[HeaderTransferEncoding] != 0)
+    {
+        if (isChunkedLast(headers, message))
+        {
+            frame->framing = BodyChunked;
+            /* Transfer-Encoding wins over Content-Length, but the connection is not reused. */
+            frame->keepAlive = frame->keepAlive && !hasLength;
+            return;
+        }
+        goto unframed;
+    }
+
+    if (length >= 0)
+    {
+        frame->framing = BodyLength;
+        frame->remaining = length;
+        frame->isComplete = (length == 0);
+        return;
+    }
+
+unframed:
+    frame->framing = BodyUntilClose;
+    frame->keepAlive = 0;
+}
+
+static size_t advanceChunked(ResponseFrame *frame, const char *data, size_t size)
+{
+    size_t used = 0;
+
+    while (used < size && !frame->isComplete)
+    {
+        char c = data[used];
+
+        switch (frame->chunkState)
+        {
+        case ChunkSize:
+            if (isxdigit((unsigned char)c))
+            {
+                int digit = isdigit((unsigned char)c) ? c - '0' : (tolower((unsigned char)c) - 'a' + 10);
+                /* Saturate rather than wrap, so an oversized chunk cannot shrink to a small one. */
+                frame->remaining = (frame->remaining > (SIZE_MAX >> 4)) ? SIZE_MAX
+                                                                        : frame->remaining * 16 + digit;
+                used++;
+            }
+            else
+            {
+                frame->chunkState = ChunkLine;
+            }
+            break;
+        case ChunkLine:
+            used++;
+            if (c == '\n')
+            {
+                frame->chunkState = (frame->remaining > 0) ? ChunkData : ChunkTrailer;
+            }
+            break;
+        case ChunkData:
+        {
+            size_t count = size - used;
+            if (count > frame->remaining)
+            {
+                count = frame->remaining;
+            }
+            used += count;
+            frame->remaining -= count;
+            if (frame->remaining == 0)
+            {
+                frame->chunkState = ChunkDataEnd;
+            }
+            break;
+        }
+        case ChunkDataEnd:
+            used++;
+            if (c == '\n')
+            {
+                frame->chunkState = ChunkSize;
+            }
+            break;
+        case ChunkTrailer:
+            used++;
+            if (c == '\n')
+            {
+                frame->isComplete = 1;
+            }
+            else if (c != '\r')
+            {
+                frame->chunkState = ChunkTrailerLine;
+            }
+            break;
+        case ChunkTrailerLine:
+        default:
+            used++;
+            if (c == '\n')
+            {
+                frame->chunkState = ChunkTrailer;
+            }
+            break;
+        }
+    }
+
+    return used;
+}
+
+size_t advanceResponseFrame(ResponseFrame *frame, const char *data, size_t size)
+{
+    if (frame->isComplete)
+    {
+        return 0;
+    }
+
+    switch (frame->framing)
+    {
+    case BodyLength:
+    {
+        size_t count = limitResponseRead(frame, size);
+        frame->remaining -= count;
+        frame->isComplete = (frame->remaining == 0);
+        return count;
+    }
+    case BodyChunked:
+        return advanceChunked(frame, data, size);
+    case BodyUntilClose:
+        return size;
+    case BodyNone:
+    default:
+        return 0;
+    }
+}
+
+/*
+ * Returns SUCCESS once the whole request is buffered, or as soon as it is
+ * known that no more should be read: the frame is invalid or the body is
+ * over REQUEST_BODY_MAX_SIZE. Chunks are scanned as they arrive.
+ */
+int advanceRequestFrame(const Buffer *buffer, RequestFrame *frame)
+{
+    size_t size = get_Buffer_size(buffer);
+
+    if (!frame->isValid || frame->isTooLarge)
+    {
+        return SUCCESS;
+    }
+
+    if (frame->body.framing != BodyChunked)
+    {
+        return (size >= frame->totalLength) ? SUCCESS : ERROR;
+    }
+
+    if (!frame->body.isComplete && size > frame->totalLength)
+    {
+        frame->totalLength += advanceChunked(&frame->body, get_Buffer_data(buffer) + frame->totalLength,
+                                             size - frame->totalLength);
+    }
+
+    frame->isTooLarge = (frame->totalLength - frame->headerLength > REQUEST_BODY_MAX_SIZE);
+    return (frame->body.isComplete || frame->isTooLarge) ? SUCCESS : ERROR;
+}
+
+size_t limitResponseRead(const ResponseFrame *frame, size_t size)
+{
+    if (frame->framing == BodyLength && frame->remaining < size)
+    {
+        return frame->remaining;
+    }
+    return size;
+}
+
+void endResponseFrame(ResponseFrame *frame)
+{
+    if (frame->framing == BodyUntilClose)
+    {
+        frame->isComplete = 1;
+    }
+    frame->keepAlive = 0;
+}
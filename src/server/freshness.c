@@ -0,0 +1,353 @@
+#include "proxy.h"
+#include "log.h"
+#include "buffer.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#define HEURISTIC_FRACTION       10
+#define HEURISTIC_MAX_SEC        (24 * 60 * 60)
+#define HEURISTIC_DEFAULT_SEC    300
+#define NEGATIVE_HEURISTIC_SEC   60
+#define NEGATIVE_MAX_SEC         (10 * 60)
+#define HTTP_DATE_FORMAT         "%a, %d %b %Y %H:%M:%S GMT"
+
+static char *copyHeader(const char *headers, const HttpMessage *message, HttpHeaderNameT id)
+{
+    size_t valueLength = 0;
+    const char *value = httpHeader(headers, message, id, &valueLength);
+
+    if (value == NULL || valueLength == 0)
+    {
+        return NULL;
+    }
+    return strndup(value, valueLength);
+}
+
+static int parseHttpDate(const char *headers, const HttpMessage *message, HttpHeaderNameT id,
+                         time_t *result)
+{
+    char text[64];
+    size_t valueLength = 0;
+    const char *value = httpHeader(headers, message, id, &valueLength);
+
+    if (value == NULL || valueLength >= sizeof(text))
+    {
+        return ERROR;
+    }
+
+    memcpy(text, value, valueLength);
+    text[valueLength] = '\0';
+
+    struct tm tm = {0};
+    if (strptime(text, HTTP_DATE_FORMAT, &tm) == NULL)
+    {
+        return ERROR;
+    }
+
+    *result = timegm(&tm);
+    return SUCCESS;
+}
+
+/*
+ * Looks up a Cache-Control directive. Returns 1 when present and stores its
+ * numeric argument (or -1 when it has none) in *seconds.
+ */
+static int findDirective(const char *value, size_t length, const char *name, long *seconds)
+{
+    size_t nameLength = strlen(name);
+    const char *end = value + length;
+    const char *token = value;
+
+    while (token < end)
+    {
+        while (token < end && (*token == ' ' || *token == ','))
+        {
+            token++;
+        }
+        if (token >= end)
+        {
+            break;
+        }
+
+        const char *tokenEnd = memchr(token, ',', end - token);
+        if (tokenEnd == NULL)
+        {
+            tokenEnd = end;
+        }
+
+        if ((size_t)(tokenEnd - token) >= nameLength &&
+            strncasecmp(token, name, nameLength) == 0 &&
+            (token + nameLength == tokenEnd || token[nameLength] == '=' ||
+             token[nameLength] == ' '))
+        {
+            *seconds = -1;
+            if (token + nameLength < tokenEnd && token[nameLength] == '=')
+            {
+                const char *number = token + nameLength + 1;
+                if (*number == '"')
+                {
+                    number++;
+                }
+                *seconds = strtol(number, NULL, 10);
+            }
+            return 1;
+        }
+
+        token = tokenEnd;
+    }
+
+    return 0;
+}
+
+static int hasDirective(const char *headers, const HttpMessage *message, const char *name, long *seconds)
+{
+    for (size_t i = 0; i < message->headerCount; i++)
+    {
+        const HttpHeader *header = &message->headers[i];
+
+        if (header->id == HeaderCacheControl &&
+            findDirective(headers + header->value.offset, header->value.length, name, seconds))
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+int isResponseStorable(const char *headers, const HttpMessage *message)
+{
+    long unused = 0;
+    size_t valueLength = 0;
+
+    if (hasDirective(headers, message, "no-store", &unused) ||
+        hasDirective(headers, message, "private", &unused))
+    {
+        return 0;
+    }
+
+    const char *vary = httpHeader(headers, message, HeaderVary, &valueLength);
+    if (vary != NULL && valueLength == 1 && vary[0] == '*')
+    {
+        return 0;
+    }
+
+    return 1;
+}
+
+/*
+ * Besides 200, only statuses that RFC 9111 lets a cache store heuristically
+ * and that are worth answering locally: redirects and "not there" answers.
+ */
+int isStatusCacheable(int status)
+{
+    return status == 200 || status == 301 || status == 404 || status == 410;
+}
+
+static int isNegativeStatus(int status)
+{
+    return status == 404 || status == 410;
+}
+
+static long freshnessLifetime(const char *headers, const HttpMessage *message, time_t now)
+{
+    long seconds = 0;
+    time_t date = now;
+    time_t expires = 0;
+    time_t lastModified = 0;
+
+    if (hasDirective(headers, message, "no-cache", &seconds))
+    {
+        return 0;
+    }
+    if (hasDirective(headers, message, "s-maxage", &seconds) && seconds >= 0)
+    {
+        return seconds;
+    }
+    if (hasDirective(headers, message, "max-age", &seconds) && seconds >= 0)
+    {
+        return seconds;
+    }
+
+    parseHttpDate(headers, message, HeaderDate, &date);
+
+    if (message->known[HeaderExpires] != 0)
+    {
+        if (parseHttpDate(headers, message, HeaderExpires, &expires) != SUCCESS)
+        {
+            return 0;
+        }
+        return (expires > date) ? (long)(expires - date) : 0;
+    }
+
+    if (parseHttpDate(headers, message, HeaderLastModified, &lastModified) == SUCCESS &&
+        lastModified < date)
+    {
+        long heuristic = (long)(date - lastModified) / HEURISTIC_FRACTION;
+        return (heuristic < HEURISTIC_MAX_SEC) ? heuristic : HEURISTIC_MAX_SEC;
+    }
+
+    return HEURISTIC_DEFAULT_SEC;
+}
+
+/*
+ * Negative answers get a short heuristic lifetime and a cap on explicit
+ * ones, so a URL that starts to exist is not hidden for long. A 304 keeps
+ * the status of the response it refreshes.
+ */
+static long boundLifetime(long lifetime, int isHeuristic, int status)
+{
+    if (!isNegativeStatus(status))
+    {
+        return lifetime;
+    }
+    if (isHeuristic)
+    {
+        return NEGATIVE_HEURISTIC_SEC;
+    }
+    return (lifetime < NEGATIVE_MAX_SEC) ? lifetime : NEGATIVE_MAX_SEC;
+}
+
+static int hasExplicitLifetime(const char *headers, const HttpMessage *message)
+{
+    long seconds = 0;
+
+    return hasDirective(headers, message, "no-cache", &seconds) ||
+           hasDirective(headers, message, "s-maxage", &seconds) ||
+           hasDirective(headers, message, "max-age", &seconds) ||
+           message->known[HeaderExpires] != 0;
+}
+
+void updateEntryFreshness(CacheEntryT *entry, const char *headers, const HttpMessage *message)
+{
+    time_t now = time(NULL);
+    int status = message->status;
+    size_t ageLength = 0;
+    const char *age = httpHeader(headers, message, HeaderAge, &ageLength);
+
+    if (status == 304)
+    {
+        status = entry->responseStatus;
+    }
+
+    long lifetime = boundLifetime(freshnessLifetime(headers, message, now),
+                                  !hasExplicitLifetime(headers, message), status);
+    if (age != NULL)
+    {
+        lifetime -= strtol(age, NULL, 10);
+    }
+
+    char *etag = copyHeader(headers, message, HeaderEtag);
+    char *lastModified = copyHeader(headers, message, HeaderLastModified);
+
+    pthread_mutex_lock(&entry->dataMutex);
+
+    entry->expiresAt = now + ((lifetime > 0) ? lifetime : 0);
+    entry->responseStatus = status;
+    if (etag != NULL)
+    {
+        free(entry->etag);
+        entry->etag = etag;
+    }
+    if (lastModified != NULL)
+    {
+        free(entry->lastModified);
+        entry->lastModified = lastModified;
+    }
+
+    pthread_mutex_unlock(&entry->dataMutex);
+}
+
+static int appendValidator(Buffer *buffer, const char *name, const char *value)
+{
+    char line[HOST_MAX_LEN];
+    int length = snprintf(line, sizeof(line), "%s: %s\r\n", name, value);
+
+    if (length < 0 || (size_t)length >= sizeof(line))
+    {
+        return ERROR;
+    }
+    return Buffer_append(buffer, line, length);
+}
+
+static int isClientValidator(const char *line, size_t length)
+{
+    static const char *names[] = {"If-None-Match:", "If-Modified-Since:"};
+
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+    {
+        size_t nameLength = strlen(names[i]);
+        if (length >= nameLength && strncasecmp(line, names[i], nameLength) == 0)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int copyUnconditionalHeaders(Buffer *out, const char *headers, size_t length)
+{
+    const char *end = headers + length;
+    const char *line = headers;
+
+    while (line < end)
+    {
+        const char *lineEnd = memchr(line, '\n', end - line);
+        lineEnd = (lineEnd == NULL) ? end : lineEnd + 1;
+
+        if (!isClientValidator(line, lineEnd - line) &&
+            Buffer_append(out, line, lineEnd - line) != SUCCESS)
+        {
+            return ERROR;
+        }
+
+        line = lineEnd;
+    }
+
+    return SUCCESS;
+}
+
+int buildConditionalRequest(Buffer *request, CacheEntryT *entry, Buffer *conditional)
+{
+    int result = ERROR;
+    int headerEnd = findHeaderEnd(request);
+
+    if (headerEnd < 0)
+    {
+        return ERROR;
+    }
+
+    Buffer_clear(conditional);
+
+    pthread_mutex_lock(&entry->dataMutex);
+
+    if (entry->etag == NULL && entry->lastModified == NULL)
+    {
+        goto unlock;
+    }
+
+    if (copyUnconditionalHeaders(conditional, get_Buffer_data(request), headerEnd - 2) != SUCCESS)
+    {
+        goto unlock;
+    }
+    if (entry->etag != NULL &&
+        appendValidator(conditional, "If-None-Match", entry->etag) != SUCCESS)
+    {
+        goto unlock;
+    }
+    if (entry->lastModified != NULL &&
+        appendValidator(conditional, "If-Modified-Since", entry->lastModified) != SUCCESS)
+    {
+        goto unlock;
+    }
+
+    result = Buffer_append(conditional, "\r\n", 2);
+
+unlock:
+    pthread_mutex_unlock(&entry->dataMutex);
+    return result;
+}
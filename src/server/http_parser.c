@@ -0,0 +1,248 @@
+#include "proxy.h"
+
+#include <string.h>
+#include <strings.h>
+
+#define HEADER_HASH_SLOTS 32
+
+typedef struct KnownHeader
+{
+    const char *name;
+    size_t length;
+    HttpHeaderNameT id;
+} KnownHeader;
+
+/*
+ * Slots follow hashHeaderName(); the function was chosen so that every
+ * name below lands in its own slot. A lookup costs one hash and at most
+ * one case-insensitive compare.
+ */
+static const KnownHeader KNOWN_HEADERS[HEADER_HASH_SLOTS] = {
+    [0] = {"ETag", 4, HeaderEtag},
+    [1] = {"Vary", 4, HeaderVary},
+    [2] = {"If-Range", 8, HeaderIfRange},
+    [3] = {"Connection", 10, HeaderConnection},
+    [4] = {"Age", 3, HeaderAge},
+    [7] = {"Last-Modified", 13, HeaderLastModified},
+    [8] = {"Proxy-Connection", 16, HeaderProxyConnection},
+    [11] = {"If-None-Match", 13, HeaderIfNoneMatch},
+    [12] = {"Accept-Ranges", 13, HeaderAcceptRanges},
+    [13] = {"Content-Range", 13, HeaderContentRange},
+    [14] = {"If-Modified-Since", 17, HeaderIfModifiedSince},
+    [15] = {"Host", 4, HeaderHost},
+    [19] = {"Date", 4, HeaderDate},
+    [22] = {"Transfer-Encoding", 17, HeaderTransferEncoding},
+    [24] = {"Expires", 7, HeaderExpires},
+    [25] = {"Cache-Control", 13, HeaderCacheControl},
+    [26] = {"Pragma", 6, HeaderPragma},
+    [27] = {"Content-Length", 14, HeaderContentLength},
+    [29] = {"Range", 5, HeaderRange},
+    [30] = {"Keep-Alive", 10, HeaderKeepAlive},
+};
+
+static unsigned hashHeaderName(const char *name, size_t length)
+{
+    unsigned first = (unsigned char)name[0] | 0x20;
+    unsigned last = (unsigned char)name[length - 1] | 0x20;
+    unsigned middle = (unsigned char)name[length / 2] | 0x20;
+
+    return (length * 4 + first * 10 + last * 27 + middle) % HEADER_HASH_SLOTS;
+}
+
+HttpHeaderNameT lookupHeaderName(const char *name, size_t length)
+{
+    if (length == 0)
+    {
+        return HeaderOther;
+    }
+
+    const KnownHeader *known = &KNOWN_HEADERS[hashHeaderName(name, length)];
+    if (known->length == length && strncasecmp(known->name, name, length) == 0)
+    {
+        return known->id;
+    }
+    return HeaderOther;
+}
+
+static HttpSlice makeSlice(const char *data, const char *start, const char *end)
+{
+    HttpSlice slice = {start - data, end - start};
+    return slice;
+}
+
+static int isTokenChar(char c)
+{
+    return c > ' ' && c < 0x7f && c != ':';
+}
+
+static const char *parseVersion(const char *p, const char *end, HttpMessage *message)
+{
+    if (end - p < 8 || strncmp(p, "HTTP/1.", 7) != 0 || p[7] < '0' || p[7] > '9')
+    {
+        return NULL;
+    }
+    message->minorVersion = p[7] - '0';
+    return p + 8;
+}
+
+static int parseHeaders(const char *data, const char *p, const char *end, HttpMessage *message)
+{
+    message->headerCount = 0;
+    memset(message->known, 0, sizeof(message->known));
+
+    while (p < end)
+    {
+        const char *lineEnd = memchr(p, '\n', end - p);
+        if (lineEnd == NULL || lineEnd == p || lineEnd[-1] != '\r')
+        {
+            return ERROR;
+        }
+        if (lineEnd - 1 == p)
+        {
+            return (lineEnd + 1 == end) ? SUCCESS : ERROR;
+        }
+
+        const char *nameEnd = p;
+        while (nameEnd < lineEnd && isTokenChar(*nameEnd))
+        {
+            nameEnd++;
+        }
+        if (nameEnd == p || *nameEnd != ':' || message->headerCount >= HTTP_MAX_HEADERS)
+        {
+            return ERROR;
+        }
+
+        const char *value = nameEnd + 1;
+        const char *valueEnd = lineEnd - 1;
+        while (value < valueEnd && (*value == ' ' || *value == '\t'))
+        {
+            value++;
+        }
+        while (valueEnd > value && (valueEnd[-1] == ' ' || valueEnd[-1] == '\t'))
+        {
+            valueEnd--;
+        }
+
+        HttpHeader *header = &message->headers[message->headerCount++];
+        header->id = lookupHeaderName(p, nameEnd - p);
+        header->name = makeSlice(data, p, nameEnd);
+        header->value = makeSlice(data, value, valueEnd);
+
+        if (header->id != HeaderOther && message->known[header->id] == 0)
+        {
+            message->known[header->id] = message->headerCount;
+        }
+
+        p = lineEnd + 1;
+    }
+
+    return ERROR;
+}
+
+int parseHttpRequest(const char *data, size_t headerLength, HttpMessage *message)
+{
+    const char *end = data + headerLength;
+    const char *p = data;
+
+    message->headerLength = headerLength;
+    message->status = 0;
+
+    const char *methodEnd = p;
+    while (methodEnd < end && isTokenChar(*methodEnd))
+    {
+        methodEnd++;
+    }
+    if (methodEnd == p || methodEnd == end || *methodEnd != ' ')
+    {
+        return ERROR;
+    }
+    message->method = makeSlice(data, p, methodEnd);
+
+    const char *target = methodEnd + 1;
+    const char *targetEnd = target;
+    while (targetEnd < end && (unsigned char)*targetEnd > ' ')
+    {
+        targetEnd++;
+    }
+    if (targetEnd == target || targetEnd == end || *targetEnd != ' ')
+    {
+        return ERROR;
+    }
+    message->target = makeSlice(data, target, targetEnd);
+
+    const char *version = targetEnd + 1;
+    p = parseVersion(version, end, message);
+    if (p == NULL || end - p < 2 || p[0] != '\r' || p[1] != '\n')
+    {
+        return ERROR;
+    }
+    message->version = makeSlice(data, version, p);
+
+    return parseHeaders(data, p + 2, end, message);
+}
+
+int parseHttpResponse(const char *data, size_t headerLength, HttpMessage *message)
+{
+    const char *end = data + headerLength;
+
+    message->headerLength = headerLength;
+    message->method = (HttpSlice){0, 0};
+    message->target = (HttpSlice){0, 0};
+    message->status = 0;
+
+    const char *p = parseVersion(data, end, message);
+    if (p == NULL || end - p < 4 || *p != ' ')
+    {
+        return ERROR;
+    }
+    message->version = makeSlice(data, data, p);
+
+    for (int i = 1; i <= 3; i++)
+    {
+        if (p[i] < '0' || p[i] > '9')
+        {
+            return ERROR;
+        }
+        message->status = message->status * 10 + (p[i] - '0');
+    }
+
+    const char *lineEnd = memchr(p, '\n', end - p);
+    if (lineEnd == NULL || lineEnd[-1] != '\r' || (lineEnd - 1 > p + 4 && p[4] != ' '))
+    {
+        message->status = 0;
+        return ERROR;
+    }
+
+    return parseHeaders(data, lineEnd + 1, end, message);
+}
+
+const char *httpHeader(const char *data, const HttpMessage *message,
+                       HttpHeaderNameT id, size_t *valueLength)
+{
+    unsigned index = message->known[id];
+    if (index == 0)
+    {
+        return NULL;
+    }
+
+    const HttpHeader *header = &message->headers[index - 1];
+    *valueLength = header->value.length;
+    return data + header->value.offset;
+}
+
+int isHttpSlice(const char *data, HttpSlice slice, const char *text)
+{
+    return slice.length == strlen(text) && strncmp(data + slice.offset, text, slice.length) == 0;
+}
+
+int copyHttpSlice(const char *data, HttpSlice slice, char *out, size_t size)
+{
+    if (slice.length >= size)
+    {
+        return ERROR;
+    }
+
+    memcpy(out, data + slice.offset, slice.length);
+    out[slice.length] = '\0';
+    return SUCCESS;
+}
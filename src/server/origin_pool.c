@@ -0,0 +1,306 @@
+#include "proxy.h"
+#include "log.h"
+#include "metrics.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#define POOL_BUCKETS 64
+
+typedef struct PooledSocket PooledSocket;
+
+struct PooledSocket
+{
+    char host[HOST_MAX_LEN];
+    int port;
+    int socket;
+    time_t idleSince;
+    PooledSocket *originPrev;
+    PooledSocket *originNext;
+    PooledSocket *agePrev;
+    PooledSocket *ageNext;
+};
+
+/*
+ * Idle sockets are chained per origin bucket for lookup and on one global
+ * list ordered by idle time for the total cap and expiry. Both lists keep
+ * the most recently released socket at the head.
+ */
+static pthread_mutex_t poolMutex = PTHREAD_MUTEX_INITIALIZER;
+static PooledSocket *buckets[POOL_BUCKETS];
+static PooledSocket *ageHead;
+static PooledSocket *ageTail;
+static size_t idleCount;
+
+/*
+ * Origins that recently refused or timed out a connection, one per bucket.
+ * Requests to them fail fast until the entry expires instead of each one
+ * waiting out its own connect attempt.
+ */
+typedef struct DownOrigin
+{
+    char host[HOST_MAX_LEN];
+    int port;
+    time_t until;
+} DownOrigin;
+
+static DownOrigin downOrigins[POOL_BUCKETS];
+
+static size_t originBucket(const char *host, int port)
+{
+    size_t hash = 5381;
+
+    for (const char *p = host; *p != '\0'; p++)
+    {
+        hash = hash * 33 + (unsigned char)*p;
+    }
+    return (hash * 33 + port) % POOL_BUCKETS;
+}
+
+static void unlinkSocket(PooledSocket *pooled)
+{
+    size_t bucket = originBucket(pooled->host, pooled->port);
+
+    if (pooled->originPrev != NULL)
+    {
+        pooled->originPrev->originNext = pooled->originNext;
+    }
+    else
+    {
+        buckets[bucket] = pooled->originNext;
+    }
+    if (pooled->originNext != NULL)
+    {
+        pooled->originNext->originPrev = pooled->originPrev;
+    }
+
+    if (pooled->agePrev != NULL)
+    {
+        pooled->agePrev->ageNext = pooled->ageNext;
+    }
+    else
+    {
+        ageHead = pooled->ageNext;
+    }
+    if (pooled->ageNext != NULL)
+    {
+        pooled->ageNext->agePrev = pooled->agePrev;
+    }
+    else
+    {
+        ageTail = pooled->agePrev;
+    }
+
+    idleCount--;
+}
+
+static void dropSocket(PooledSocket *pooled)
+{
+    unlinkSocket(pooled);
+    close(pooled->socket);
+    free(pooled);
+}
+
+static void expireSockets(time_t now)
+{
+    while (ageTail != NULL && now - ageTail->idleSince >= POOL_IDLE_TIMEOUT_SEC)
+    {
+        dropSocket(ageTail);
+    }
+}
+
+static int isMatch(const PooledSocket *pooled, const char *host, int port)
+{
+    return pooled->port == port && strcmp(pooled->host, host) == 0;
+}
+
+static int isAlive(int socket)
+{
+    char byte;
+    ssize_t n = recv(socket, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+
+    return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+int acquireOriginSocket(const char *host, int port)
+{
+    while (1)
+    {
+        PooledSocket *pooled = NULL;
+
+        pthread_mutex_lock(&poolMutex);
+        expireSockets(time(NULL));
+
+        for (pooled = buckets[originBucket(host, port)]; pooled != NULL; pooled = pooled->originNext)
+        {
+            if (isMatch(pooled, host, port))
+            {
+                unlinkSocket(pooled);
+                break;
+            }
+        }
+        pthread_mutex_unlock(&poolMutex);
+
+        if (pooled == NULL)
+        {
+            return ERROR;
+        }
+
+        int socket = pooled->socket;
+        free(pooled);
+
+        if (isAlive(socket))
+        {
+            logDebug("Reusing pooled origin connection");
+            return socket;
+        }
+
+        logDebug("Pooled origin connection went away");
+        close(socket);
+    }
+}
+
+void releaseOriginSocket(const char *host, int port, int socket)
+{
+    PooledSocket *pooled = malloc(sizeof(PooledSocket));
+    if (pooled == NULL || strlen(host) >= HOST_MAX_LEN)
+    {
+        free(pooled);
+        close(socket);
+        return;
+    }
+
+    strcpy(pooled->host, host);
+    pooled->port = port;
+    pooled->socket = socket;
+    pooled->idleSince = time(NULL);
+
+    size_t bucket = originBucket(host, port);
+
+    pthread_mutex_lock(&poolMutex);
+    expireSockets(pooled->idleSince);
+
+    PooledSocket *oldest = NULL;
+    size_t sameOrigin = 0;
+    for (PooledSocket *p = buckets[bucket]; p != NULL; p = p->originNext)
+    {
+        if (isMatch(p, host, port))
+        {
+            oldest = p;
+            sameOrigin++;
+        }
+    }
+
+    if (sameOrigin >= POOL_MAX_IDLE_PER_ORIGIN)
+    {
+        dropSocket(oldest);
+    }
+    if (idleCount >= POOL_MAX_IDLE_TOTAL)
+    {
+        dropSocket(ageTail);
+    }
+
+    pooled->originPrev = NULL;
+    pooled->originNext = buckets[bucket];
+    if (buckets[bucket] != NULL)
+    {
+        buckets[bucket]->originPrev = pooled;
+    }
+    buckets[bucket] = pooled;
+
+    pooled->agePrev = NULL;
+    pooled->ageNext = ageHead;
+    if (ageHead != NULL)
+    {
+        ageHead->agePrev = pooled;
+    }
+    else
+    {
+        ageTail = pooled;
+    }
+    ageHead = pooled;
+
+    idleCount++;
+    pthread_mutex_unlock(&poolMutex);
+}
+
+void markOriginDown(const char *host, int port)
+{
+    if (strlen(host) >= HOST_MAX_LEN)
+    {
+        return;
+    }
+
+    DownOrigin *down = &downOrigins[originBucket(host, port)];
+
+    pthread_mutex_lock(&poolMutex);
+    strcpy(down->host, host);
+    down->port = port;
+    down->until = time(NULL) + ORIGIN_DOWN_TTL_SEC;
+    pthread_mutex_unlock(&poolMutex);
+}
+
+int isOriginDown(const char *host, int port)
+{
+    const DownOrigin *down = &downOrigins[originBucket(host, port)];
+
+    pthread_mutex_lock(&poolMutex);
+    int isDown = down->port == port && time(NULL) < down->until && strcmp(down->host, host) == 0;
+    pthread_mutex_unlock(&poolMutex);
+
+    return isDown;
+}
+
+int connectToOrigin(const char *host, int port, int *isReused, RequestTrace *trace)
+{
+    int socket = acquireOriginSocket(host, port);
+
+    *isReused = (socket >= 0);
+    if (socket >= 0)
+    {
+        metricsAdd(CounterOriginReused, 1);
+        return socket;
+    }
+
+    if (isOriginDown(host, port))
+    {
+        logDebug("Origin recently unreachable, not connecting");
+        return ERROR;
+    }
+
+    socket = connectToHost(host, port, trace);
+    if (socket < 0)
+    {
+        metricsAdd(CounterOriginConnectErrors, 1);
+        markOriginDown(host, port);
+        return socket;
+    }
+
+    metricsAdd(CounterOriginConnects, 1);
+    return socket;
+}
+
+void finishOriginSocket(const char *host, int port, int socket, const ResponseFrame *frame)
+{
+    if (frame->isComplete && frame->keepAlive && frame->isRequestSent)
+    {
+        releaseOriginSocket(host, port, socket);
+        return;
+    }
+
+    close(socket);
+}
+
+void closeOriginPool(void)
+{
+    pthread_mutex_lock(&poolMutex);
+    while (ageHead != NULL)
+    {
+        dropSocket(ageHead);
+    }
+    pthread_mutex_unlock(&poolMutex);
+}
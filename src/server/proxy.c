@@ -1,19 +1,35 @@
 #include "proxy.h"
 #include "log.h"
 #include "buffer.h"
+#include "probes.h"
 
+#include <poll.h>
 #include <pthread.h>
 #include <signal.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <linux/filter.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 
-#define SERVER_BACKLOG 10
+#define DEFER_ACCEPT_SEC 5
+#define ACCEPT_TICK_MS 500
+#define ACCEPT_BATCH 64
+
+typedef struct Acceptor
+{
+    pthread_t thread;
+    int serverSocket;
+    CacheManagerT *cache;
+} Acceptor;
 
 const char *HTTP_400_BAD_REQUEST = "400 Bad Request";
+const char *HTTP_413_CONTENT_TOO_LARGE = "413 Content Too Large";
 const char *HTTP_500_INTERNAL_ERROR = "500 Internal Server Error";
 const char *HTTP_502_BAD_GATEWAY = "502 Bad Gateway";
 
@@ -26,7 +42,6 @@ static void sighandler(int sig)
 {
     (void)sig;
     serverShutdown = 1;
-    logInfo("Received shutdown signal");
 }
 
 static void setupSigHandlers(void)
@@ -52,12 +67,47 @@ static void setupSigHandlers(void)
     logDebug("Signal handlers configured");
 }
 
-static int createServerSocket(int port)
+/*
+ * Each client and origin connection holds a descriptor, and the usual soft
+ * limit of 1024 is far below what the hard limit allows.
+ */
+static void raiseFileLimit(void)
+{
+    struct rlimit limit;
+
+    if (getrlimit(RLIMIT_NOFILE, &limit) != 0)
+    {
+        logError("Failed to read the open file limit");
+        return;
+    }
+
+    if (limit.rlim_cur < limit.rlim_max)
+    {
+        rlim_t previous = limit.rlim_cur;
+
+        limit.rlim_cur = limit.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &limit) != 0)
+        {
+            logError("Failed to raise the open file limit");
+            limit.rlim_cur = previous;
+        }
+    }
+
+    logInfo("Open file limit: %llu", (unsigned long long)limit.rlim_cur);
+}
+
+/*
+ * Every listener joins the same SO_REUSEPORT group, so the kernel spreads
+ * new connections over per-socket accept queues. Clients always speak
+ * first, so TCP_DEFER_ACCEPT keeps connections out of the queue until the
+ * request has started to arrive.
+ */
+static int createServerSocket(int port, int backlog)
 {
     int sock = -1;
     int ret = ERROR;
 
-    sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
     if (sock < 0)
     {
         logError("Failed to create socket");
@@ -65,7 +115,10 @@ static int createServerSocket(int port)
     }
 
     int opt = 1;
-    if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0)
+    int deferSec = DEFER_ACCEPT_SEC;
+    if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0 ||
+        setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0 ||
+        setsockopt(sock, IPPROTO_TCP, TCP_DEFER_ACCEPT, &deferSec, sizeof(deferSec)) < 0)
     {
         logError("Failed to set socket options");
         goto cleanup;
@@ -82,7 +135,7 @@ static int createServerSocket(int port)
         goto cleanup;
     }
 
-    if (listen(sock, SERVER_BACKLOG) < 0)
+    if (listen(sock, backlog) < 0)
     {
         logError("Failed to listen on socket");
         goto cleanup;
@@ -99,22 +152,93 @@ cleanup:
     return ret;
 }
 
-static void handleNewClient(int serverSocket, CacheManagerT *cacheManager)
+/*
+ * Classic BPF for the reuseport group: a connection goes to the listener
+ * whose index is the receiving CPU modulo the number of listeners.
+ */
+static int attachSteering(int sock, int listenerCount)
+{
+    struct sock_filter code[] = {
+        {BPF_LD | BPF_W | BPF_ABS, 0, 0, (uint32_t)(SKF_AD_OFF + SKF_AD_CPU)},
+        {BPF_ALU | BPF_MOD | BPF_K, 0, 0, (uint32_t)listenerCount},
+        {BPF_RET | BPF_A, 0, 0, 0},
+    };
+    struct sock_fprog program = {
+        .len = sizeof(code) / sizeof(code[0]),
+        .filter = code,
+    };
+
+    return setsockopt(sock, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &program, sizeof(program));
+}
+
+static int createServerSockets(const ProxyConfig *config, int *sockets, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        sockets[i] = createServerSocket(config->port, config->listenBacklog);
+        if (sockets[i] < 0)
+        {
+            goto cleanup;
+        }
+    }
+
+    if (config->isSteered && attachSteering(sockets[0], count) < 0)
+    {
+        logError("Failed to attach listener steering program");
+        goto cleanup;
+    }
+
+    logInfo("Listening on port %d with %d socket(s), backlog %d",
+            config->port, count, config->listenBacklog);
+    return SUCCESS;
+
+cleanup:
+    for (int i = 0; i < count; i++)
+    {
+        if (sockets[i] >= 0)
+        {
+            close(sockets[i]);
+            sockets[i] = -1;
+        }
+    }
+    return ERROR;
+}
+
+/* Threads mode defaults to one listener; the event loop gets one per worker. */
+static int listenerCountFor(const ProxyConfig *config)
+{
+    int count = config->listenerCount;
+
+    if (count <= 0)
+    {
+        count = (config->mode == ServerEventLoop) ? config->workerCount : 1;
+    }
+    if (config->mode == ServerEventLoop && count > config->workerCount)
+    {
+        count = config->workerCount;
+    }
+    return (count < MAX_LISTENERS) ? count : MAX_LISTENERS;
+}
+
+/* Returns ERROR only when there was no connection to accept. */
+static int handleNewClient(int serverSocket, CacheManagerT *cacheManager)
 {
     struct sockaddr_in clientAddr;
     socklen_t addrLen = sizeof(clientAddr);
     ClientContext *ctx = NULL;
     pthread_t thread;
 
-    int clientSocket = accept(serverSocket,
-                              (struct sockaddr *)&clientAddr,
-                              &addrLen);
+    int clientSocket = accept4(serverSocket,
+                               (struct sockaddr *)&clientAddr,
+                               &addrLen,
+                               SOCK_NONBLOCK | SOCK_CLOEXEC);
     if (clientSocket < 0)
     {
-        return;
+        return ERROR;
     }
 
     logDebug("New client connection accepted");
+    PROXY_PROBE1(conn_accept, clientSocket);
 
     ctx = malloc(sizeof(ClientContext));
     if (ctx == NULL)
@@ -144,7 +268,7 @@ static void handleNewClient(int serverSocket, CacheManagerT *cacheManager)
     }
 
     pthread_detach(thread);
-    return;
+    return SUCCESS;
 
 cleanup:
     free(ctx);
@@ -152,6 +276,66 @@ cleanup:
     {
         close(clientSocket);
     }
+    return SUCCESS;
+}
+
+/* Listeners are non-blocking; the poll tick lets acceptors notice shutdown. */
+static void acceptClients(int serverSocket, CacheManagerT *cacheManager)
+{
+    struct pollfd pfd = {.fd = serverSocket, .events = POLLIN};
+
+    while (!serverShutdown)
+    {
+        if (poll(&pfd, 1, ACCEPT_TICK_MS) <= 0)
+        {
+            continue;
+        }
+
+        for (int i = 0; i < ACCEPT_BATCH && !serverShutdown; i++)
+        {
+            if (handleNewClient(serverSocket, cacheManager) != SUCCESS)
+            {
+                break;
+            }
+        }
+    }
+}
+
+static void *acceptorThread(void *args)
+{
+    Acceptor *acceptor = args;
+
+    acceptClients(acceptor->serverSocket, acceptor->cache);
+    return NULL;
+}
+
+/* The calling thread serves the first listener, one extra thread each of the rest. */
+static void runAcceptors(const int *serverSockets, int count, CacheManagerT *cacheManager)
+{
+    Acceptor acceptors[MAX_LISTENERS];
+    int started;
+
+    for (started = 1; started < count; started++)
+    {
+        acceptors[started].serverSocket = serverSockets[started];
+        acceptors[started].cache = cacheManager;
+
+        if (pthread_create(&acceptors[started].thread, NULL, acceptorThread,
+                           &acceptors[started]) != 0)
+        {
+            logError("Failed to start acceptor thread");
+            serverShutdown = 1;
+            break;
+        }
+    }
+
+    acceptClients(serverSockets[0], cacheManager);
+    logInfo("Shutdown requested");
+
+    for (int i = 1; i < started; i++)
+    {
+        pthread_join(acceptors[i].thread, NULL);
+    }
 }
 
 static void waitForAllClients(void)
@@ -165,54 +349,94 @@ static void waitForAllClients(void)
     pthread_mutex_unlock(&clientsMutex);
 }
 
-void startProxyServer(int port)
+static void logCacheMemory(CacheManagerT *cache)
 {
-    int serverSocket = -1;
+    CacheMemoryStatsT stats;
+
+    CacheManagerT_memoryStats(cache, &stats);
+    logInfo("Cache memory: %zu reserved, %zu resident, %zu allocated, %zu used, %zu on disk",
+            stats.reservedBytes, stats.residentBytes, stats.allocatedBytes, stats.usedBytes,
+            stats.diskBytes);
+}
+
+void startProxyServer(const ProxyConfig *config)
+{
+    int serverSockets[MAX_LISTENERS];
+    int listenerCount = listenerCountFor(config);
     CacheManagerT *cacheManager = NULL;
 
     logInfo("Starting proxy server");
 
     setupSigHandlers();
+    raiseFileLimit();
 
-    serverSocket = createServerSocket(port);
-    if (serverSocket < 0)
+    if (createServerSockets(config, serverSockets, listenerCount) != SUCCESS)
     {
         logError("Failed to create server socket");
         return;
     }
 
-    cacheManager = CacheManagerT_new();
+    cacheManager = CacheManagerT_new(config->cacheMaxBytes, config->cacheStorage);
     if (cacheManager == NULL)
     {
         logError("Failed to create cache manager");
         goto cleanup;
     }
 
-    logInfo("Server ready, waiting for connections");
+    if (config->diskPath != NULL &&
+        CacheManagerT_attachDisk(cacheManager, config->diskPath, config->diskMaxBytes) != 0)
+    {
+        logError("Failed to open disk cache");
+        goto cleanup;
+    }
 
-    while (!serverShutdown)
+    if (startResolver() != SUCCESS)
+    {
+        logError("Failed to start resolver");
+        goto cleanup;
+    }
+
+    if (startTracing(config->traceSlowMs, config->traceSampleEvery, config->tracePath) != SUCCESS)
     {
-        handleNewClient(serverSocket, cacheManager);
+        goto cleanup;
+    }
+
+    if (config->adminPort > 0 && startAdminServer(config->adminPort, cacheManager) != SUCCESS)
+    {
+        goto cleanup;
+    }
 
-        if (serverShutdown)
+    logInfo("Server ready, waiting for connections");
+
+    if (config->mode == ServerEventLoop)
+    {
+        if (runEventLoopServer(serverSockets, listenerCount, cacheManager,
+                               config->workerCount, config->isSteered) != SUCCESS)
         {
-            logInfo("Shutdown requested");
-            break;
+            logError("Event loop server failed");
         }
+        goto cleanup;
     }
 
+    runAcceptors(serverSockets, listenerCount, cacheManager);
+
 cleanup:
     logInfo("Shutting down server");
 
-    if (serverSocket >= 0)
+    for (int i = 0; i < listenerCount; i++)
     {
-        close(serverSocket);
+        close(serverSockets[i]);
     }
 
     waitForAllClients();
+    stopAdminServer();
+    stopTracing();
+    closeOriginPool();
+    stopResolver();
 
     if (cacheManager != NULL)
     {
+        logCacheMemory(cacheManager);
         CacheManagerT_delete(cacheManager);
     }
 
@@ -0,0 +1,434 @@
+#include "proxy.h"
+#include "log.h"
+
+#include <netdb.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#define DNS_BUCKETS 256
+#define DNS_MAX_ENTRIES 4096
+
+typedef enum DnsState
+{
+    DnsPending,
+    DnsResolved,
+    DnsFailed
+} DnsStateT;
+
+typedef struct DnsEntry DnsEntry;
+
+struct DnsEntry
+{
+    char *host;
+    DnsStateT state;
+    int isQueued;
+    ResolvedHost resolved;
+    time_t expiresAt;
+    DnsWaiter *waiters;
+    DnsEntry *next;
+    DnsEntry *queueNext;
+};
+
+typedef struct BlockingWaiter
+{
+    DnsWaiter waiter;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int isDone;
+} BlockingWaiter;
+
+/*
+ * getaddrinfo() reports no TTL, so answers are kept for a fixed time.
+ * Expired answers are still served while one resolver thread refreshes
+ * them; only the first lookup of a name waits for the resolver.
+ */
+static pthread_mutex_t dnsMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dnsCond = PTHREAD_COND_INITIALIZER;
+static DnsEntry *buckets[DNS_BUCKETS];
+static size_t entryCount;
+static DnsEntry *queueHead;
+static DnsEntry *queueTail;
+static pthread_t resolverThreads[DNS_RESOLVER_THREADS];
+static int resolverCount;
+static int isStopping;
+
+static size_t hostBucket(const char *host)
+{
+    size_t hash = 5381;
+
+    for (const char *p = host; *p != '\0'; p++)
+    {
+        hash = hash * 33 + (unsigned char)*p;
+    }
+    return hash % DNS_BUCKETS;
+}
+
+static int lookupAddresses(const char *host, int flags, ResolvedHost *resolved)
+{
+    struct addrinfo hints = {0};
+    struct addrinfo *result = NULL;
+
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = (flags & AI_NUMERICHOST) ? flags : (flags | AI_ADDRCONFIG);
+
+    if (getaddrinfo(host, NULL, &hints, &result) != 0)
+    {
+        return ERROR;
+    }
+
+    resolved->count = 0;
+    for (struct addrinfo *ai = result; ai != NULL && resolved->count < DNS_MAX_ADDRESSES; ai = ai->ai_next)
+    {
+        if (ai->ai_addrlen > sizeof(struct sockaddr_storage))
+        {
+            continue;
+        }
+        memcpy(&resolved->addresses[resolved->count], ai->ai_addr, ai->ai_addrlen);
+        resolved->lengths[resolved->count] = ai->ai_addrlen;
+        resolved->count++;
+    }
+
+    freeaddrinfo(result);
+    return (resolved->count > 0) ? SUCCESS : ERROR;
+}
+
+static void pruneEntries(time_t now)
+{
+    for (size_t i = 0; i < DNS_BUCKETS; i++)
+    {
+        DnsEntry **link = &buckets[i];
+        while (*link != NULL)
+        {
+            DnsEntry *entry = *link;
+            if (entry->state != DnsPending && !entry->isQueued && now >= entry->expiresAt)
+            {
+                *link = entry->next;
+                free(entry->host);
+                free(entry);
+                entryCount--;
+                continue;
+            }
+            link = &entry->next;
+        }
+    }
+}
+
+static DnsEntry *findEntry(const char *host, size_t bucket)
+{
+    for (DnsEntry *entry = buckets[bucket]; entry != NULL; entry = entry->next)
+    {
+        if (strcmp(entry->host, host) == 0)
+        {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+static DnsEntry *createEntry(const char *host, size_t bucket)
+{
+    if (entryCount >= DNS_MAX_ENTRIES)
+    {
+        pruneEntries(time(NULL));
+    }
+
+    DnsEntry *entry = calloc(1, sizeof(DnsEntry));
+    if (entry == NULL)
+    {
+        return NULL;
+    }
+
+    entry->host = strdup(host);
+    if (entry->host == NULL)
+    {
+        free(entry);
+        return NULL;
+    }
+
+    entry->state = DnsPending;
+    entry->next = buckets[bucket];
+    buckets[bucket] = entry;
+    entryCount++;
+    return entry;
+}
+
+static void enqueueEntry(DnsEntry *entry)
+{
+    if (entry->isQueued)
+    {
+        return;
+    }
+
+    entry->isQueued = 1;
+    entry->queueNext = NULL;
+    if (queueTail != NULL)
+    {
+        queueTail->queueNext = entry;
+    }
+    else
+    {
+        queueHead = entry;
+    }
+    queueTail = entry;
+    pthread_cond_signal(&dnsCond);
+}
+
+static void linkWaiter(DnsEntry *entry, DnsWaiter *waiter)
+{
+    waiter->entry = entry;
+    waiter->prev = NULL;
+    waiter->next = entry->waiters;
+    if (entry->waiters != NULL)
+    {
+        entry->waiters->prev = waiter;
+    }
+    entry->waiters = waiter;
+    waiter->isLinked = 1;
+}
+
+static void completeEntry(DnsEntry *entry, int status, const ResolvedHost *resolved)
+{
+    time_t now = time(NULL);
+
+    entry->isQueued = 0;
+
+    if (status == SUCCESS)
+    {
+        entry->resolved = *resolved;
+        entry->state = DnsResolved;
+        entry->expiresAt = now + DNS_POSITIVE_TTL_SEC;
+    }
+    else if (entry->state != DnsResolved)
+    {
+        entry->state = DnsFailed;
+        entry->expiresAt = now + DNS_NEGATIVE_TTL_SEC;
+    }
+    else
+    {
+        logError("Failed to refresh host address, keeping the previous one");
+        entry->expiresAt = now + DNS_NEGATIVE_TTL_SEC;
+    }
+
+    DnsWaiter *waiter = entry->waiters;
+    entry->waiters = NULL;
+
+    while (waiter != NULL)
+    {
+        DnsWaiter *next = waiter->next;
+        waiter->prev = NULL;
+        waiter->next = NULL;
+        waiter->isLinked = 0;
+        waiter->status = (entry->state == DnsResolved) ? SUCCESS : ERROR;
+        if (waiter->status == SUCCESS)
+        {
+            *waiter->result = entry->resolved;
+        }
+        waiter->notify(waiter);
+        waiter = next;
+    }
+}
+
+static void *resolverThread(void *args)
+{
+    (void)args;
+
+    pthread_mutex_lock(&dnsMutex);
+    while (1)
+    {
+        while (queueHead == NULL && !isStopping)
+        {
+            pthread_cond_wait(&dnsCond, &dnsMutex);
+        }
+        if (isStopping)
+        {
+            break;
+        }
+
+        DnsEntry *entry = queueHead;
+        queueHead = entry->queueNext;
+        if (queueHead == NULL)
+        {
+            queueTail = NULL;
+        }
+
+        pthread_mutex_unlock(&dnsMutex);
+
+        ResolvedHost resolved;
+        int status = lookupAddresses(entry->host, 0, &resolved);
+
+        if (status != SUCCESS)
+        {
+            logError("Failed to resolve host");
+        }
+
+        pthread_mutex_lock(&dnsMutex);
+        completeEntry(entry, status, &resolved);
+    }
+    pthread_mutex_unlock(&dnsMutex);
+
+    return NULL;
+}
+
+int resolveHostAsync(const char *host, DnsWaiter *waiter)
+{
+    int result = ERROR;
+    size_t bucket = hostBucket(host);
+
+    if (lookupAddresses(host, AI_NUMERICHOST, waiter->result) == SUCCESS)
+    {
+        return SUCCESS;
+    }
+
+    pthread_mutex_lock(&dnsMutex);
+
+    DnsEntry *entry = findEntry(host, bucket);
+    if (entry == NULL)
+    {
+        entry = createEntry(host, bucket);
+        if (entry == NULL)
+        {
+            goto unlock;
+        }
+    }
+
+    int isExpired = (time(NULL) >= entry->expiresAt);
+
+    switch (entry->state)
+    {
+    case DnsResolved:
+        *waiter->result = entry->resolved;
+        if (isExpired)
+        {
+            enqueueEntry(entry);
+        }
+        result = SUCCESS;
+        break;
+    case DnsFailed:
+        if (!isExpired)
+        {
+            break;
+        }
+        entry->state = DnsPending;
+        /* fall through */
+    case DnsPending:
+    default:
+        enqueueEntry(entry);
+        linkWaiter(entry, waiter);
+        result = RESOLVE_PENDING;
+        break;
+    }
+
+unlock:
+    pthread_mutex_unlock(&dnsMutex);
+    return result;
+}
+
+void cancelResolve(DnsWaiter *waiter)
+{
+    pthread_mutex_lock(&dnsMutex);
+    if (waiter->isLinked)
+    {
+        if (waiter->prev != NULL)
+        {
+            waiter->prev->next = waiter->next;
+        }
+        else
+        {
+            waiter->entry->waiters = waiter->next;
+        }
+        if (waiter->next != NULL)
+        {
+            waiter->next->prev = waiter->prev;
+        }
+        waiter->isLinked = 0;
+    }
+    pthread_mutex_unlock(&dnsMutex);
+}
+
+static void notifyBlocking(DnsWaiter *waiter)
+{
+    BlockingWaiter *blocking = (BlockingWaiter *)waiter;
+
+    pthread_mutex_lock(&blocking->mutex);
+    blocking->isDone = 1;
+    pthread_cond_signal(&blocking->cond);
+    pthread_mutex_unlock(&blocking->mutex);
+}
+
+int resolveHost(const char *host, ResolvedHost *resolved)
+{
+    BlockingWaiter blocking = {0};
+
+    blocking.waiter.notify = notifyBlocking;
+    blocking.waiter.result = resolved;
+    pthread_mutex_init(&blocking.mutex, NULL);
+    pthread_cond_init(&blocking.cond, NULL);
+
+    int result = resolveHostAsync(host, &blocking.waiter);
+
+    if (result == RESOLVE_PENDING)
+    {
+        pthread_mutex_lock(&blocking.mutex);
+        while (!blocking.isDone)
+        {
+            pthread_cond_wait(&blocking.cond, &blocking.mutex);
+        }
+        pthread_mutex_unlock(&blocking.mutex);
+        result = blocking.waiter.status;
+    }
+
+    pthread_cond_destroy(&blocking.cond);
+    pthread_mutex_destroy(&blocking.mutex);
+    return result;
+}
+
+int startResolver(void)
+{
+    isStopping = 0;
+
+    for (resolverCount = 0; resolverCount < DNS_RESOLVER_THREADS; resolverCount++)
+    {
+        if (pthread_create(&resolverThreads[resolverCount], NULL, resolverThread, NULL) != 0)
+        {
+            logError("Failed to create resolver thread");
+            stopResolver();
+            return ERROR;
+        }
+    }
+
+    return SUCCESS;
+}
+
+void stopResolver(void)
+{
+    pthread_mutex_lock(&dnsMutex);
+    isStopping = 1;
+    pthread_cond_broadcast(&dnsCond);
+    pthread_mutex_unlock(&dnsMutex);
+
+    for (int i = 0; i < resolverCount; i++)
+    {
+        pthread_join(resolverThreads[i], NULL);
+    }
+    resolverCount = 0;
+
+    pthread_mutex_lock(&dnsMutex);
+    for (size_t i = 0; i < DNS_BUCKETS; i++)
+    {
+        while (buckets[i] != NULL)
+        {
+            DnsEntry *entry = buckets[i];
+            buckets[i] = entry->next;
+            free(entry->host);
+            free(entry);
+        }
+    }
+    entryCount = 0;
+    queueHead = NULL;
+    queueTail = NULL;
+    pthread_mutex_unlock(&dnsMutex);
+}
@@ -0,0 +1,228 @@
+#include "proxy.h"
+#include "log.h"
+#include "metrics.h"
+
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define TRACE_RECORD_MAX 4096
+#define TRACE_TAIL_ROOM 512
+
+typedef struct TraceRecord
+{
+    char data[TRACE_RECORD_MAX];
+    size_t size;
+} TraceRecord;
+
+static const char *phaseNames[PhaseCount] = {
+    [PhaseReceive] = "receive",
+    [PhaseLookup] = "lookup",
+    [PhaseResolve] = "resolve",
+    [PhaseConnect] = "connect",
+    [PhaseOriginWait] = "origin_wait",
+    [PhaseEntryWait] = "entry_wait",
+    [PhaseSend] = "send",
+};
+
+static uint64_t slowThreshold = (uint64_t)DEFAULT_TRACE_SLOW_MS * 1000000;
+static unsigned sampleEvery = 0;
+static int traceFd = STDERR_FILENO;
+static _Thread_local unsigned sampleCount = 0;
+
+/*
+ * Records go to stderr unless a path is given. Each record is written with
+ * a single write to an O_APPEND descriptor, so threads need no lock.
+ */
+int startTracing(int slowMs, int sampleEveryRequests, const char *path)
+{
+    slowThreshold = (slowMs > 0) ? (uint64_t)slowMs * 1000000 : UINT64_MAX;
+    sampleEvery = (sampleEveryRequests > 0) ? (unsigned)sampleEveryRequests : 0;
+
+    if (path != NULL)
+    {
+        int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (fd < 0)
+        {
+            logError("Failed to open trace file %s", path);
+            return ERROR;
+        }
+        traceFd = fd;
+    }
+    return SUCCESS;
+}
+
+void stopTracing(void)
+{
+    if (traceFd != STDERR_FILENO)
+    {
+        close(traceFd);
+        traceFd = STDERR_FILENO;
+    }
+}
+
+void traceStart(RequestTrace *trace, uint64_t receiveTime)
+{
+    uint64_t now = metricsNow();
+
+    memset(trace, 0, sizeof(*trace));
+    trace->startTime = receiveTime;
+    trace->phaseTime[PhaseReceive] = now - receiveTime;
+}
+
+void traceEnter(RequestTrace *trace, TracePhaseT phase)
+{
+    if (trace->phaseStart[phase] == 0)
+    {
+        trace->phaseStart[phase] = metricsNow();
+    }
+}
+
+/* Returns how long this run of the phase took, or 0 if it was not running. */
+uint64_t traceLeave(RequestTrace *trace, TracePhaseT phase)
+{
+    if (trace->phaseStart[phase] == 0)
+    {
+        return 0;
+    }
+
+    uint64_t elapsed = metricsNow() - trace->phaseStart[phase];
+    trace->phaseTime[phase] += elapsed;
+    trace->phaseStart[phase] = 0;
+    return elapsed;
+}
+
+void traceSwitch(RequestTrace *trace, TracePhaseT from, TracePhaseT to)
+{
+    uint64_t now = metricsNow();
+
+    if (trace->phaseStart[from] != 0)
+    {
+        trace->phaseTime[from] += now - trace->phaseStart[from];
+        trace->phaseStart[from] = 0;
+    }
+    if (trace->phaseStart[to] == 0)
+    {
+        trace->phaseStart[to] = now;
+    }
+}
+
+void traceSent(RequestTrace *trace, size_t bytes)
+{
+    trace->sentBytes += bytes;
+    metricsAdd(CounterClientBytes, bytes);
+}
+
+static void appendFormat(TraceRecord *record, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+static void appendFormat(TraceRecord *record, const char *format, ...)
+{
+    va_list args;
+    size_t available = sizeof(record->data) - record->size;
+
+    va_start(args, format);
+    int length = vsnprintf(record->data + record->size, available, format, args);
+    va_end(args);
+
+    if (length > 0)
+    {
+        record->size += ((size_t)length < available) ? (size_t)length : available - 1;
+    }
+}
+
+static void appendString(TraceRecord *record, const char *text)
+{
+    appendFormat(record, "\"");
+    for (size_t i = 0; text[i] != '\0' && record->size < TRACE_RECORD_MAX - TRACE_TAIL_ROOM; i++)
+    {
+        unsigned char c = text[i];
+
+        if (c == '"' || c == '\\')
+        {
+            appendFormat(record, "\\%c", c);
+        }
+        else if (c < 0x20 || c == 0x7f)
+        {
+            appendFormat(record, "\\u%04x", c);
+        }
+        else
+        {
+            appendFormat(record, "%c", c);
+        }
+    }
+    appendFormat(record, "\"");
+}
+
+static void writeRecord(const RequestTrace *trace, const char *url, int isError,
+                        uint64_t total, const char *reason)
+{
+    TraceRecord record = {.size = 0};
+    struct timespec now;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    appendFormat(&record, "{\"ts_ms\":%lld,\"reason\":\"%s\",\"url\":",
+                 (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000, reason);
+    appendString(&record, (url != NULL) ? url : "");
+    appendFormat(&record, ",\"cache\":\"%s\",\"status\":%d,\"error\":%s,\"bytes\":%zu,\"total_us\":%llu",
+                 (trace->cacheResult != NULL) ? trace->cacheResult : "none", trace->status,
+                 isError ? "true" : "false", trace->sentBytes, (unsigned long long)(total / 1000));
+
+    for (int phase = 0; phase < PhaseCount; phase++)
+    {
+        appendFormat(&record, ",\"%s_us\":%llu", phaseNames[phase],
+                     (unsigned long long)(trace->phaseTime[phase] / 1000));
+    }
+    appendFormat(&record, "}\n");
+
+    if (record.data[record.size - 1] != '\n')
+    {
+        record.data[record.size - 1] = '\n';
+    }
+
+    if (write(traceFd, record.data, record.size) < 0)
+    {
+        logError("Failed to write trace record");
+    }
+}
+
+/*
+ * Closes any running phase and records the request in the metrics. Requests
+ * over the slow threshold are always written; of the rest every
+ * sampleEvery-th request on each thread is.
+ */
+void traceFinish(RequestTrace *trace, const char *url, int isError)
+{
+    uint64_t now = metricsNow();
+
+    for (int phase = 0; phase < PhaseCount; phase++)
+    {
+        if (trace->phaseStart[phase] != 0)
+        {
+            trace->phaseTime[phase] += now - trace->phaseStart[phase];
+            trace->phaseStart[phase] = 0;
+        }
+    }
+
+    uint64_t total = now - trace->startTime;
+
+    metricsAdd(CounterRequests, 1);
+    if (isError)
+    {
+        metricsAdd(CounterRequestErrors, 1);
+    }
+    metricsObserve(HistogramRequestTime, total);
+
+    if (total >= slowThreshold)
+    {
+        writeRecord(trace, url, isError, total, "slow");
+    }
+    else if (sampleEvery > 0 && ++sampleCount >= sampleEvery)
+    {
+        sampleCount = 0;
+        writeRecord(trace, url, isError, total, "sample");
+    }
+}
@@ -1,22 +1,29 @@
 #include "proxy.h"
 #include "log.h"
 #include "buffer.h"
+#include "metrics.h"
 
 #include <errno.h>
 #include <fcntl.h>
-#include <netdb.h>
+#include <netinet/in.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
+#include <poll.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
-#include <sys/select.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 #define DEFAULT_HTTP_PORT   80
 #define CONNECT_TIMEOUT_SEC 30
 #define IO_TIMEOUT_SEC      60
 
-static int setNonBlocking(int sock)
+int setNonBlocking(int sock)
 {
     int flags = fcntl(sock, F_GETFL, 0);
     if (flags < 0)
@@ -26,17 +33,7 @@ static int setNonBlocking(int sock)
     return fcntl(sock, F_SETFL, flags | O_NONBLOCK);
 }
 
-static int setBlocking(int sock)
-{
-    int flags = fcntl(sock, F_GETFL, 0);
-    if (flags < 0)
-    {
-        return ERROR;
-    }
-    return fcntl(sock, F_SETFL, flags & ~O_NONBLOCK);
-}
-
-static int getSocketError(int sock)
+int getSocketError(int sock)
 {
     int error = 0;
     socklen_t len = sizeof(error);
@@ -48,18 +45,15 @@ static int getSocketError(int sock)
     return error;
 }
 
-static int waitForWritable(int sock, int timeoutSec)
+static int waitForEvents(int sock, short events, int timeoutSec)
 {
-    fd_set writefds;
-    struct timeval timeout;
+    struct pollfd pfd = {.fd = sock, .events = events};
+    int result;
 
-    FD_ZERO(&writefds);
-    FD_SET(sock, &writefds);
-
-    timeout.tv_sec = timeoutSec;
-    timeout.tv_usec = 0;
-
-    int result = select(sock + 1, NULL, &writefds, NULL, &timeout);
+    do
+    {
+        result = poll(&pfd, 1, timeoutSec * 1000);
+    } while (result < 0 && errno == EINTR);
 
     if (result < 0)
     {
@@ -74,100 +68,219 @@ static int waitForWritable(int sock, int timeoutSec)
     return SUCCESS;
 }
 
+static int waitForWritable(int sock, int timeoutSec)
+{
+    return waitForEvents(sock, POLLOUT, timeoutSec);
+}
+
 int waitForReadable(int sock, int timeoutSec)
 {
-    fd_set readfds;
-    struct timeval timeout;
+    return waitForEvents(sock, POLLIN, timeoutSec);
+}
 
-    FD_ZERO(&readfds);
-    FD_SET(sock, &readfds);
+int parseUrl(const char *url, char *host, char *path, int *port)
+{
+    const char *hostStart;
+    const char *hostEnd;
+    const char *p;
 
-    timeout.tv_sec = timeoutSec;
-    timeout.tv_usec = 0;
+    *port = DEFAULT_HTTP_PORT;
+    path[0] = '\0';
 
-    int result = select(sock + 1, &readfds, NULL, NULL, &timeout);
+    if (strncasecmp(url, "http://", 7) != 0)
+    {
+        goto fail;
+    }
 
-    if (result < 0)
+    hostStart = url + 7;
+    if (*hostStart == '[')
     {
-        return ERROR;
+        hostStart++;
+        hostEnd = strchr(hostStart, ']');
+        if (hostEnd == NULL)
+        {
+            goto fail;
+        }
+        p = hostEnd + 1;
     }
-    if (result == 0)
+    else
     {
-        errno = ETIMEDOUT;
-        return ERROR;
+        hostEnd = hostStart + strcspn(hostStart, ":/?#");
+        p = hostEnd;
     }
 
-    return SUCCESS;
-}
-
-int parseUrl(const char *url, char *host, char *path, int *port)
-{
-    *port = DEFAULT_HTTP_PORT;
-    path[0] = '\0';
+    size_t hostLength = hostEnd - hostStart;
+    if (hostLength == 0 || hostLength >= HOST_MAX_LEN)
+    {
+        goto fail;
+    }
+    memcpy(host, hostStart, hostLength);
+    host[hostLength] = '\0';
 
-    if (sscanf(url, "http://%1023[^:/]:%d/%2047[^\n]", host, port, path) == 3)
+    if (*p == ':')
     {
-        return SUCCESS;
+        char *end = NULL;
+        long value = strtol(p + 1, &end, 10);
+        if (end == p + 1 || value <= 0 || value > 65535)
+        {
+            goto fail;
+        }
+        *port = value;
+        p = end;
     }
-    if (sscanf(url, "http://%1023[^/]/%2047[^\n]", host, path) == 2)
+
+    if (*p == '/')
     {
-        return SUCCESS;
+        p++;
     }
-    if (sscanf(url, "http://%1023[^:/]:%d", host, port) == 2)
+    else if (*p != '\0' && *p != '?' && *p != '#')
     {
-        return SUCCESS;
+        goto fail;
     }
-    if (sscanf(url, "http://%1023[^\n/]", host) == 1)
+
+    size_t pathLength = strlen(p);
+    if (pathLength >= PATH_MAX_LEN)
     {
-        return SUCCESS;
+        goto fail;
     }
+    memcpy(path, p, pathLength + 1);
+    return SUCCESS;
 
+fail:
     logError("Failed to parse URL");
     return ERROR;
 }
 
-static int findHeaderEnd(Buffer *buffer)
+static int isTerminatorAt(const char *data, size_t i)
 {
-    const char *data = get_Buffer_data(buffer);
-    size_t len = get_Buffer_size(buffer);
+    return data[i] == '\r' && data[i + 1] == '\n' && data[i + 2] == '\r' && data[i + 3] == '\n';
+}
 
-    for (size_t i = 0; i + 3 < len; i++)
+static long scanScalar(const char *data, size_t from, size_t end)
+{
+    for (size_t i = from; i < end; i++)
     {
-        if (data[i] == '\r' && data[i + 1] == '\n' &&
-            data[i + 2] == '\r' && data[i + 3] == '\n')
+        const char *cr = memchr(data + i, '\r', end - i);
+        if (cr == NULL)
         {
-            return i + 4;
+            return -1;
+        }
+
+        i = cr - data;
+        if (isTerminatorAt(data, i))
+        {
+            return i;
         }
     }
     return -1;
 }
 
-int isResponse200(const char *data)
+#if defined(__x86_64__)
+static long scanSse2(const char *data, size_t from, size_t end)
 {
-    return (strncmp(data, "HTTP/1.1 200", 12) == 0 ||
-            strncmp(data, "HTTP/1.0 200", 12) == 0);
+    const __m128i cr = _mm_set1_epi8('\r');
+    size_t i = from;
+
+    for (; i + 16 <= end; i += 16)
+    {
+        __m128i block = _mm_loadu_si128((const __m128i *)(data + i));
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, cr));
+
+        for (; mask != 0; mask &= mask - 1)
+        {
+            size_t at = i + __builtin_ctz(mask);
+            if (isTerminatorAt(data, at))
+            {
+                return at;
+            }
+        }
+    }
+    return scanScalar(data, i, end);
 }
 
-int isGetRequest(const char *method)
+__attribute__((target("avx2"))) static long scanAvx2(const char *data, size_t from, size_t end)
 {
-    return strcmp(method, "GET") == 0;
-}
+    const __m256i cr = _mm256_set1_epi8('\r');
+    size_t i = from;
+
+    for (; i + 32 <= end; i += 32)
+    {
+        __m256i block = _mm256_loadu_si256((const __m256i *)(data + i));
+        unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, cr));
 
-int connectToHost(const char *host, int port)
+        for (; mask != 0; mask &= mask - 1)
+        {
+            size_t at = i + __builtin_ctz(mask);
+            if (isTerminatorAt(data, at))
+            {
+                return at;
+            }
+        }
+    }
+    return scanSse2(data, i, end);
+}
+#endif
+
+/*
+ * Candidates are the positions of '\r' that leave room for the full
+ * terminator. The scan resumes where the previous call stopped, so a
+ * header arriving in many small reads is examined once.
+ */
+int findHeaderEnd(Buffer *buffer)
 {
-    int sock = -1;
-    int error = 0;
+    if (buffer->headerEnd >= 0)
+    {
+        return buffer->headerEnd;
+    }
 
-    logDebug("Resolving host");
+    size_t len = get_Buffer_size(buffer);
+    if (len < 4 || buffer->headerScanned >= len - 3)
+    {
+        return -1;
+    }
+
+    const char *data = get_Buffer_data(buffer);
+    size_t end = len - 3;
+    long at;
 
-    struct hostent *server = gethostbyname(host);
-    if (server == NULL)
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("avx2"))
     {
-        logError("Failed to resolve host");
-        return ERROR;
+        at = scanAvx2(data, buffer->headerScanned, end);
+    }
+    else
+    {
+        at = scanSse2(data, buffer->headerScanned, end);
+    }
+#else
+    at = scanScalar(data, buffer->headerScanned, end);
+#endif
+
+    if (at < 0)
+    {
+        buffer->headerScanned = end;
+        return -1;
+    }
+
+    buffer->headerEnd = at + 4;
+    return buffer->headerEnd;
+}
+
+int startConnect(const ResolvedHost *resolved, int index, int port)
+{
+    struct sockaddr_storage addr = resolved->addresses[index];
+    socklen_t addrLen = resolved->lengths[index];
+
+    if (addr.ss_family == AF_INET6)
+    {
+        ((struct sockaddr_in6 *)&addr)->sin6_port = htons(port);
+    }
+    else
+    {
+        ((struct sockaddr_in *)&addr)->sin_port = htons(port);
     }
 
-    sock = socket(AF_INET, SOCK_STREAM, 0);
+    int sock = socket(addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
     if (sock < 0)
     {
         logError("Failed to create socket");
@@ -180,56 +293,64 @@ int connectToHost(const char *host, int port)
         goto cleanup;
     }
 
-    struct sockaddr_in addr = {0};
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(port);
-    memcpy(&addr.sin_addr.s_addr, server->h_addr, server->h_length);
+    if (connect(sock, (struct sockaddr *)&addr, addrLen) < 0 && errno != EINPROGRESS)
+    {
+        logError("Failed to initiate connection");
+        goto cleanup;
+    }
 
-    int result = connect(sock, (struct sockaddr *)&addr, sizeof(addr));
+    return sock;
 
-    if (result < 0)
+cleanup:
+    close(sock);
+    return ERROR;
+}
+
+int connectToHost(const char *host, int port, RequestTrace *trace)
+{
+    ResolvedHost resolved;
+
+    logDebug("Resolving host");
+
+    traceEnter(trace, PhaseResolve);
+    int isResolved = (resolveHost(host, &resolved) == SUCCESS);
+    traceLeave(trace, PhaseResolve);
+
+    if (!isResolved)
     {
-        if (errno != EINPROGRESS)
+        logError("Failed to resolve host");
+        return ERROR;
+    }
+
+    traceEnter(trace, PhaseConnect);
+
+    for (int i = 0; i < resolved.count; i++)
+    {
+        int sock = startConnect(&resolved, i, port);
+        if (sock < 0)
         {
-            logError("Failed to initiate connection");
-            goto cleanup;
+            continue;
         }
 
         if (waitForWritable(sock, CONNECT_TIMEOUT_SEC) != SUCCESS)
         {
-            if (errno == ETIMEDOUT)
-            {
-                logError("Connection timed out");
-            }
-            else
-            {
-                logError("Connection wait failed");
-            }
-            goto cleanup;
+            logError((errno == ETIMEDOUT) ? "Connection timed out" : "Connection wait failed");
         }
-
-        error = getSocketError(sock);
-        if (error != 0)
+        else if (getSocketError(sock) != 0)
         {
             logError("Connection failed");
-            goto cleanup;
         }
-    }
-
-    if (setBlocking(sock) < 0)
-    {
-        logError("Failed to set blocking mode");
-        goto cleanup;
-    }
-
-    logDebug("Connected to remote host");
-    return sock;
+        else
+        {
+            logDebug("Connected to remote host");
+            metricsObserve(HistogramOriginConnect, traceLeave(trace, PhaseConnect));
+            return sock;
+        }
 
-cleanup:
-    if (sock >= 0)
-    {
         close(sock);
     }
+
+    traceLeave(trace, PhaseConnect);
     return ERROR;
 }
 
@@ -239,32 +360,72 @@ ssize_t sendAll(int socket, const char *data, size_t size)
 
     while (sent < size)
     {
-        if (waitForWritable(socket, IO_TIMEOUT_SEC) != SUCCESS)
+        ssize_t n = send(socket, data + sent, size - sent, MSG_NOSIGNAL);
+        if (n < 0)
         {
-            if (errno == ETIMEDOUT)
+            if (errno == EINTR)
             {
-                logError("Send timed out");
+                continue;
             }
-            else
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                logError("Send failed");
+                return ERROR;
+            }
+            if (waitForWritable(socket, IO_TIMEOUT_SEC) != SUCCESS)
             {
-                logError("Send wait failed");
+                if (errno == ETIMEDOUT)
+                {
+                    logError("Send timed out");
+                }
+                else
+                {
+                    logError("Send wait failed");
+                }
+                return ERROR;
             }
+            continue;
+        }
+        if (n == 0)
+        {
+            logError("Connection closed during send");
             return ERROR;
         }
 
-        ssize_t n = send(socket, data + sent, size - sent, 0);
+        sent += n;
+    }
+
+    return sent;
+}
+
+ssize_t sendFileAll(int socket, int fd, off_t offset, size_t size)
+{
+    size_t sent = 0;
+
+    while (sent < size)
+    {
+        ssize_t n = sendfile(socket, fd, &offset, size - sent);
         if (n < 0)
         {
-            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            if (errno == EINTR)
             {
-                continue; 
+                continue;
             }
-            logError("Send failed");
-            return ERROR;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                logError("Sendfile failed");
+                return ERROR;
+            }
+            if (waitForWritable(socket, IO_TIMEOUT_SEC) != SUCCESS)
+            {
+                logError("Send timed out");
+                return ERROR;
+            }
+            continue;
         }
         if (n == 0)
         {
-            logError("Connection closed during send");
+            logError("Unexpected end of cache file");
             return ERROR;
         }
 
@@ -276,31 +437,49 @@ ssize_t sendAll(int socket, const char *data, size_t size)
 
 ssize_t recvWithTimeout(int socket, char *buffer, size_t size, int timeoutSec)
 {
-    if (waitForReadable(socket, timeoutSec) != SUCCESS)
+    while (1)
     {
-        if (errno == ETIMEDOUT)
+        ssize_t n = recv(socket, buffer, size, 0);
+        if (n >= 0)
         {
-            logError("Receive timed out");
+            return n;
         }
-        else
+        if (errno == EINTR)
         {
-            logError("Receive wait failed");
+            continue;
         }
-        return ERROR;
-    }
-
-    ssize_t n = recv(socket, buffer, size, 0);
-
-    if (n < 0)
-    {
-        if (errno != EAGAIN)
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
         {
             logError("Receive failed");
+            return ERROR;
+        }
+
+        if (waitForReadable(socket, timeoutSec) != SUCCESS)
+        {
+            if (errno == ETIMEDOUT)
+            {
+                logError("Receive timed out");
+            }
+            else
+            {
+                logError("Receive wait failed");
+            }
+            return ERROR;
         }
-        return ERROR;
     }
+}
 
-    return n;
+size_t adaptReadSize(size_t current, size_t requested, size_t received)
+{
+    if (requested == current && received == requested && current < UPLOAD_READ_MAX)
+    {
+        return current * 2;
+    }
+    if (received < requested / 4 && current > UPLOAD_READ_MIN)
+    {
+        return current / 2;
+    }
+    return current;
 }
 
 ssize_t recvToBuffer(int socket, Buffer *buffer)
@@ -366,13 +545,27 @@ ssize_t recvUntilHeaderEnd(int socket, Buffer *buffer)
     return get_Buffer_size(buffer);
 }
 
+static int formatErrorResponse(char *response, size_t size, const char *status, const char *message)
+{
+    int len = snprintf(response, size, "HTTP/1.0 %s\r\n\r\n%s", status, message);
+
+    return ((size_t)len < size) ? len : (int)size - 1;
+}
+
+int buildErrorResponse(Buffer *out, const char *status, const char *message)
+{
+    char response[512];
+    int len = formatErrorResponse(response, sizeof(response), status, message);
+
+    return (len > 0) ? Buffer_append(out, response, len) : ERROR;
+}
+
 void sendErrorResponse(int sock, const char *status, const char *message)
 {
     logDebug("Sending error response");
 
     char response[512];
-    int len = snprintf(response, sizeof(response),
-                       "HTTP/1.0 %s\r\n\r\n%s", status, message);
+    int len = formatErrorResponse(response, sizeof(response), status, message);
 
     if (len > 0)
     {
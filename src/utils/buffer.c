@@ -23,6 +23,8 @@ Buffer *Buffer_create(size_t capacity)
 
     buf->size = 0;
     buf->capacity = capacity;
+    buf->headerScanned = 0;
+    buf->headerEnd = -1;
     return buf;
 }
 
@@ -50,6 +52,42 @@ int Buffer_reserve(Buffer *buffer, size_t minCapacity)
     return 0;
 }
 
+int Buffer_append(Buffer *buffer, const char *data, size_t size)
+{
+    if (Buffer_reserve(buffer, buffer->size + size) != 0)
+    {
+        return -1;
+    }
+
+    memcpy(buffer->data + buffer->size, data, size);
+    buffer->size += size;
+    return 0;
+}
+
+void Buffer_consume(Buffer *buffer, size_t count)
+{
+    if (count >= buffer->size)
+    {
+        Buffer_clear(buffer);
+        return;
+    }
+
+    buffer->headerScanned = 0;
+    buffer->headerEnd = -1;
+    memmove(buffer->data, buffer->data + count, buffer->size - count);
+    buffer->size -= count;
+}
+
+void Buffer_truncate(Buffer *buffer, size_t size)
+{
+    if (size < buffer->size)
+    {
+        buffer->size = size;
+        buffer->headerScanned = 0;
+        buffer->headerEnd = -1;
+    }
+}
+
 void Buffer_destroy(Buffer *buffer)
 {
     if (buffer == NULL)
@@ -63,6 +101,8 @@ void Buffer_destroy(Buffer *buffer)
 void Buffer_clear(Buffer *buffer)
 {
     buffer->size = 0;
+    buffer->headerScanned = 0;
+    buffer->headerEnd = -1;
 }
 
 const char *get_Buffer_data(const Buffer *buffer)
@@ -1,31 +1,381 @@
 #include "log.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
 #include <time.h>
 
-static void getTimestamp(char *buffer, size_t size)
+#define LOG_RING_SIZE ((size_t)64 * 1024)
+#define LOG_MESSAGE_MAX 1008
+#define LOG_RECORD_ALIGN 16
+#define LOG_PADDING 0xff
+#define LOG_IDLE_NS 1000000L
+
+typedef struct LogRecord
 {
-    time_t now = time(NULL);
-    struct tm *tm_info = localtime(&now);
-    strftime(buffer, size, "%H:%M:%S", tm_info);
+    uint32_t size;
+    uint16_t length;
+    uint8_t level;
+    uint8_t reserved;
+    int64_t seconds;
+} LogRecord;
+
+#define LOG_RECORD_MAX (sizeof(LogRecord) + LOG_MESSAGE_MAX)
+
+static_assert(sizeof(LogRecord) == LOG_RECORD_ALIGN, "log records must stay aligned");
+static_assert(LOG_RECORD_MAX % LOG_RECORD_ALIGN == 0, "log records must stay aligned");
+
+/*
+ * Single-producer ring owned by one thread. head and tail only grow; the
+ * owner publishes records with a release store of head and the writer
+ * hands space back with a release store of tail.
+ */
+typedef struct LogRing
+{
+    _Alignas(64) atomic_size_t head;
+    _Alignas(64) atomic_size_t tail;
+    atomic_size_t dropped;
+    atomic_int isRetired;
+    struct LogRing *next;
+    char data[LOG_RING_SIZE];
+} LogRing;
+
+_Atomic int logRuntimeLevel = LOG_LEVEL_DEBUG;
+
+static const char *levelNames[] = {"DEBUG", "INFO", "ERROR"};
+
+static _Atomic(LogRing *) rings = NULL;
+static LogRing *freeRings = NULL;
+static pthread_mutex_t ringsMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t ringKey;
+static pthread_once_t ringKeyOnce = PTHREAD_ONCE_INIT;
+static _Thread_local LogRing *localRing = NULL;
+
+static atomic_int isRunning = 0;
+static atomic_int isStopping = 0;
+static pthread_t writerThread;
+
+static int64_t cachedSeconds = -1;
+static char cachedTimestamp[16];
+
+static FILE *streamFor(int level)
+{
+    return (level >= LOG_LEVEL_ERROR) ? stderr : stdout;
 }
 
-void logDebug(const char *message)
+static void writeSync(int level, const char *format, va_list args)
 {
     char timestamp[16];
-    getTimestamp(timestamp, sizeof(timestamp));
-    printf("[%s] [DEBUG] %s\n", timestamp, message);
+    time_t now = time(NULL);
+    struct tm tm;
+    FILE *stream = streamFor(level);
+
+    localtime_r(&now, &tm);
+    strftime(timestamp, sizeof(timestamp), "%H:%M:%S", &tm);
+
+    flockfile(stream);
+    fprintf(stream, "[%s] [%s] ", timestamp, levelNames[level]);
+    vfprintf(stream, format, args);
+    fputc('\n', stream);
+    funlockfile(stream);
 }
 
-void logInfo(const char *message)
+static void retireRing(void *arg)
 {
-    char timestamp[16];
-    getTimestamp(timestamp, sizeof(timestamp));
-    printf("[%s] [INFO] %s\n", timestamp, message);
+    LogRing *ring = arg;
+    atomic_store_explicit(&ring->isRetired, 1, memory_order_release);
 }
 
-void logError(const char *message)
+static void createRingKey(void)
 {
-    char timestamp[16];
-    getTimestamp(timestamp, sizeof(timestamp));
-    fprintf(stderr, "[%s] [ERROR] %s\n", timestamp, message);
-}
\ No newline at end of file
+    pthread_key_create(&ringKey, retireRing);
+}
+
+/*
+ * Rings of exited threads are recycled once the writer has drained them,
+ * so thread-per-connection servers do not allocate one per client.
+ */
+static LogRing *acquireRing(void)
+{
+    LogRing *ring = NULL;
+
+    pthread_mutex_lock(&ringsMutex);
+
+    if (freeRings != NULL)
+    {
+        ring = freeRings;
+        freeRings = ring->next;
+    }
+    else
+    {
+        ring = aligned_alloc(_Alignof(LogRing), sizeof(LogRing));
+    }
+
+    if (ring != NULL)
+    {
+        atomic_init(&ring->head, 0);
+        atomic_init(&ring->tail, 0);
+        atomic_init(&ring->dropped, 0);
+        atomic_init(&ring->isRetired, 0);
+        ring->next = atomic_load_explicit(&rings, memory_order_relaxed);
+        atomic_store_explicit(&rings, ring, memory_order_release);
+    }
+
+    pthread_mutex_unlock(&ringsMutex);
+
+    if (ring != NULL)
+    {
+        pthread_setspecific(ringKey, ring);
+        localRing = ring;
+    }
+    return ring;
+}
+
+/*
+ * Every record is reserved at its maximum size so the message can be
+ * formatted in place; a record never wraps, the end of the ring is padded
+ * instead. When the writer falls behind messages are dropped and counted.
+ */
+static void enqueue(LogRing *ring, int level, const char *format, va_list args)
+{
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    size_t position = head & (LOG_RING_SIZE - 1);
+    size_t contiguous = LOG_RING_SIZE - position;
+    size_t padding = (contiguous < LOG_RECORD_MAX) ? contiguous : 0;
+
+    if (LOG_RING_SIZE - (head - tail) < padding + LOG_RECORD_MAX)
+    {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    if (padding > 0)
+    {
+        LogRecord *pad = (LogRecord *)(ring->data + position);
+        pad->size = padding;
+        pad->level = LOG_PADDING;
+        head += padding;
+        position = 0;
+    }
+
+    struct timespec now;
+    LogRecord *record = (LogRecord *)(ring->data + position);
+    int length = vsnprintf((char *)(record + 1), LOG_MESSAGE_MAX, format, args);
+
+    if (length < 0)
+    {
+        length = 0;
+    }
+    else if (length >= LOG_MESSAGE_MAX)
+    {
+        length = LOG_MESSAGE_MAX - 1;
+    }
+
+    clock_gettime(CLOCK_REALTIME_COARSE, &now);
+    record->length = length;
+    record->level = level;
+    record->seconds = now.tv_sec;
+    record->size = (sizeof(LogRecord) + length + LOG_RECORD_ALIGN - 1) & ~(size_t)(LOG_RECORD_ALIGN - 1);
+
+    atomic_store_explicit(&ring->head, head + record->size, memory_order_release);
+}
+
+void logWrite(int level, const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+
+    if (atomic_load_explicit(&isRunning, memory_order_acquire))
+    {
+        LogRing *ring = (localRing != NULL) ? localRing : acquireRing();
+        if (ring != NULL)
+        {
+            enqueue(ring, level, format, args);
+            va_end(args);
+            return;
+        }
+    }
+
+    writeSync(level, format, args);
+    va_end(args);
+}
+
+static const char *timestampFor(int64_t seconds)
+{
+    if (seconds != cachedSeconds)
+    {
+        time_t now = seconds;
+        struct tm tm;
+
+        localtime_r(&now, &tm);
+        strftime(cachedTimestamp, sizeof(cachedTimestamp), "%H:%M:%S", &tm);
+        cachedSeconds = seconds;
+    }
+    return cachedTimestamp;
+}
+
+static size_t drainRing(LogRing *ring)
+{
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    size_t drained = 0;
+
+    while (tail != head)
+    {
+        LogRecord *record = (LogRecord *)(ring->data + (tail & (LOG_RING_SIZE - 1)));
+
+        if (record->level != LOG_PADDING)
+        {
+            fprintf(streamFor(record->level), "[%s] [%s] %.*s\n", timestampFor(record->seconds),
+                    levelNames[record->level], (int)record->length, (const char *)(record + 1));
+            drained++;
+        }
+        tail += record->size;
+    }
+    atomic_store_explicit(&ring->tail, tail, memory_order_release);
+
+    size_t dropped = atomic_exchange_explicit(&ring->dropped, 0, memory_order_relaxed);
+    if (dropped > 0)
+    {
+        fprintf(stderr, "[%s] [ERROR] %zu log messages dropped\n", timestampFor(time(NULL)), dropped);
+        drained++;
+    }
+    return drained;
+}
+
+static void recycleRetiredRings(void)
+{
+    pthread_mutex_lock(&ringsMutex);
+
+    LogRing *previous = NULL;
+    LogRing *ring = atomic_load_explicit(&rings, memory_order_relaxed);
+
+    while (ring != NULL)
+    {
+        LogRing *next = ring->next;
+
+        if (atomic_load_explicit(&ring->isRetired, memory_order_acquire) &&
+            atomic_load_explicit(&ring->head, memory_order_relaxed) ==
+                atomic_load_explicit(&ring->tail, memory_order_relaxed))
+        {
+            if (previous == NULL)
+            {
+                atomic_store_explicit(&rings, next, memory_order_release);
+            }
+            else
+            {
+                previous->next = next;
+            }
+            ring->next = freeRings;
+            freeRings = ring;
+        }
+        else
+        {
+            previous = ring;
+        }
+        ring = next;
+    }
+
+    pthread_mutex_unlock(&ringsMutex);
+}
+
+/*
+ * Only the writer unlinks rings and new ones are pushed at the head, so
+ * the list can be walked without the mutex.
+ */
+static size_t drainAll(void)
+{
+    size_t drained = 0;
+    int hasRetired = 0;
+
+    for (LogRing *ring = atomic_load_explicit(&rings, memory_order_acquire); ring != NULL;
+         ring = ring->next)
+    {
+        hasRetired |= atomic_load_explicit(&ring->isRetired, memory_order_acquire);
+        drained += drainRing(ring);
+    }
+
+    if (drained > 0)
+    {
+        fflush(stdout);
+        fflush(stderr);
+    }
+    if (hasRetired)
+    {
+        recycleRetiredRings();
+    }
+    return drained;
+}
+
+static void *runWriter(void *arg)
+{
+    (void)arg;
+
+    while (1)
+    {
+        int isLast = atomic_load_explicit(&isStopping, memory_order_acquire);
+
+        if (drainAll() == 0 && !isLast)
+        {
+            struct timespec idle = {0, LOG_IDLE_NS};
+            nanosleep(&idle, NULL);
+        }
+        if (isLast)
+        {
+            break;
+        }
+    }
+    return NULL;
+}
+
+void logSetLevel(int level)
+{
+    atomic_store_explicit(&logRuntimeLevel, level, memory_order_relaxed);
+}
+
+int logParseLevel(const char *name)
+{
+    static const char *names[] = {"debug", "info", "error", "none"};
+
+    for (int level = LOG_LEVEL_DEBUG; level <= LOG_LEVEL_NONE; level++)
+    {
+        if (strcasecmp(name, names[level]) == 0)
+        {
+            return level;
+        }
+    }
+    return -1;
+}
+
+int logStart(void)
+{
+    if (atomic_load(&isRunning))
+    {
+        return 0;
+    }
+
+    pthread_once(&ringKeyOnce, createRingKey);
+    atomic_store(&isStopping, 0);
+    if (pthread_create(&writerThread, NULL, runWriter, NULL) != 0)
+    {
+        return -1;
+    }
+    atomic_store(&isRunning, 1);
+    return 0;
+}
+
+void logStop(void)
+{
+    if (!atomic_exchange(&isRunning, 0))
+    {
+        return;
+    }
+
+    atomic_store(&isStopping, 1);
+    pthread_join(writerThread, NULL);
+}
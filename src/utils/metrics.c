@@ -0,0 +1,258 @@
+#include "metrics.h"
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <time.h>
+
+typedef struct MetricsHistogramShard
+{
+    atomic_uint_fast64_t buckets[METRICS_BUCKETS];
+    atomic_uint_fast64_t sum;
+} MetricsHistogramShard;
+
+/*
+ * Threads are spread over the shards round-robin, so a shard is normally
+ * written by one thread and its cache lines do not bounce. Readers sum all
+ * shards when metrics are rendered.
+ */
+typedef struct MetricsShard
+{
+    _Alignas(64) atomic_int_fast64_t counters[CounterCount];
+    MetricsHistogramShard histograms[HistogramCount];
+} MetricsShard;
+
+typedef struct MetricInfo
+{
+    const char *name;
+    const char *help;
+    int isGauge;
+} MetricInfo;
+
+typedef struct HistogramInfo
+{
+    const char *name;
+    const char *help;
+    double scale;
+} HistogramInfo;
+
+static const MetricInfo counterInfo[CounterCount] = {
+    [CounterRequests] = {"proxy_requests_total", "Requests handled", 0},
+    [CounterRequestErrors] = {"proxy_request_errors_total", "Requests that ended in an error", 0},
+    [CounterCacheHits] = {"proxy_cache_hits_total", "GET requests served from an existing entry", 0},
+    [CounterCacheMisses] = {"proxy_cache_misses_total", "GET requests that started a fill", 0},
+    [CounterRevalidations] = {"proxy_cache_revalidations_total", "Stale entries revalidated at the origin", 0},
+    [CounterClientBytes] = {"proxy_client_sent_bytes_total", "Response bytes sent to clients", 0},
+    [CounterOriginConnects] = {"proxy_origin_connects_total", "New connections opened to origins", 0},
+    [CounterOriginConnectErrors] = {"proxy_origin_connect_errors_total", "Failed connection attempts to origins", 0},
+    [CounterOriginReused] = {"proxy_origin_reused_total", "Origin requests sent on pooled connections", 0},
+    [GaugeClientConnections] = {"proxy_client_connections", "Open client connections", 1},
+    [GaugeDownloads] = {"proxy_downloads_in_flight", "Background downloads into the cache", 1},
+};
+
+static const HistogramInfo histogramInfo[HistogramCount] = {
+    [HistogramRequestTime] = {"proxy_request_duration_seconds", "Time from the first request byte to the end of the response", 1e-9},
+    [HistogramOriginFirstByte] = {"proxy_origin_first_byte_seconds", "Time from sending a request to the origin to its response headers", 1e-9},
+    [HistogramOriginConnect] = {"proxy_origin_connect_seconds", "Time to open a new origin connection", 1e-9},
+    [HistogramCacheLookup] = {"proxy_cache_lookup_seconds", "Time to look up or create a cache entry", 1e-9},
+    [HistogramObjectSize] = {"proxy_object_size_bytes", "Body size of objects stored in the cache", 1},
+};
+
+static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+
+static MetricsShard shards[METRICS_SHARDS];
+static atomic_uint nextShard = 0;
+static _Thread_local MetricsShard *localShard = NULL;
+
+static MetricsShard *shardForThread(void)
+{
+    if (localShard == NULL)
+    {
+        unsigned index = atomic_fetch_add_explicit(&nextShard, 1, memory_order_relaxed);
+        localShard = &shards[index % METRICS_SHARDS];
+    }
+    return localShard;
+}
+
+uint64_t metricsNow(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+void metricsAdd(MetricCounterT counter, int64_t value)
+{
+    atomic_fetch_add_explicit(&shardForThread()->counters[counter], value, memory_order_relaxed);
+}
+
+/*
+ * Log-linear buckets as in HdrHistogram: values below METRICS_SUB_BUCKETS
+ * are exact, larger ones keep their top METRICS_SUB_BUCKET_BITS + 1 bits,
+ * so every bucket is within 1/METRICS_SUB_BUCKETS of its values.
+ */
+static size_t bucketFor(uint64_t value)
+{
+    if (value < METRICS_SUB_BUCKETS)
+    {
+        return value;
+    }
+
+    int exponent = 63 - __builtin_clzll(value);
+    if (exponent > METRICS_MAX_EXPONENT)
+    {
+        return METRICS_BUCKETS - 1;
+    }
+
+    size_t sub = (value >> (exponent - METRICS_SUB_BUCKET_BITS)) & (METRICS_SUB_BUCKETS - 1);
+    return (size_t)(exponent - METRICS_SUB_BUCKET_BITS + 1) * METRICS_SUB_BUCKETS + sub;
+}
+
+static uint64_t bucketHighest(size_t index)
+{
+    if (index < METRICS_SUB_BUCKETS)
+    {
+        return index;
+    }
+
+    int shift = (int)(index / METRICS_SUB_BUCKETS) - 1;
+    uint64_t sub = index % METRICS_SUB_BUCKETS;
+    return ((METRICS_SUB_BUCKETS + sub + 1) << shift) - 1;
+}
+
+void metricsObserve(MetricHistogramT histogram, uint64_t value)
+{
+    MetricsHistogramShard *shard = &shardForThread()->histograms[histogram];
+
+    atomic_fetch_add_explicit(&shard->buckets[bucketFor(value)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&shard->sum, value, memory_order_relaxed);
+}
+
+void metricsObserveSince(MetricHistogramT histogram, uint64_t start)
+{
+    metricsObserve(histogram, metricsNow() - start);
+}
+
+static int appendFormat(Buffer *out, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+static int appendFormat(Buffer *out, const char *format, ...)
+{
+    va_list args;
+
+    while (1)
+    {
+        va_start(args, format);
+        int length = vsnprintf(Buffer_writePtr(out), Buffer_available(out), format, args);
+        va_end(args);
+
+        if (length < 0)
+        {
+            return -1;
+        }
+        if ((size_t)length < Buffer_available(out))
+        {
+            Buffer_advanceSize(out, length);
+            return 0;
+        }
+        if (Buffer_reserve(out, get_Buffer_size(out) + length + 1) != 0)
+        {
+            return -1;
+        }
+    }
+}
+
+int metricsAppendGauge(Buffer *out, const char *name, const char *help, double value)
+{
+    return appendFormat(out, "# HELP %s %s\n# TYPE %s gauge\n%s %.17g\n",
+                        name, help, name, name, value);
+}
+
+static int renderCounter(Buffer *out, MetricCounterT counter)
+{
+    const MetricInfo *info = &counterInfo[counter];
+    int64_t total = 0;
+
+    for (size_t i = 0; i < METRICS_SHARDS; i++)
+    {
+        total += atomic_load_explicit(&shards[i].counters[counter], memory_order_relaxed);
+    }
+
+    return appendFormat(out, "# HELP %s %s\n# TYPE %s %s\n%s %lld\n", info->name, info->help,
+                        info->name, info->isGauge ? "gauge" : "counter", info->name,
+                        (long long)total);
+}
+
+/* Histograms are exported as summaries with quantiles taken from the merged buckets. */
+static int renderHistogram(Buffer *out, MetricHistogramT histogram)
+{
+    uint64_t merged[METRICS_BUCKETS];
+    const HistogramInfo *info = &histogramInfo[histogram];
+    uint64_t count = 0;
+    uint64_t sum = 0;
+
+    for (size_t b = 0; b < METRICS_BUCKETS; b++)
+    {
+        merged[b] = 0;
+        for (size_t i = 0; i < METRICS_SHARDS; i++)
+        {
+            merged[b] += atomic_load_explicit(&shards[i].histograms[histogram].buckets[b],
+                                              memory_order_relaxed);
+        }
+        count += merged[b];
+    }
+    for (size_t i = 0; i < METRICS_SHARDS; i++)
+    {
+        sum += atomic_load_explicit(&shards[i].histograms[histogram].sum, memory_order_relaxed);
+    }
+
+    if (appendFormat(out, "# HELP %s %s\n# TYPE %s summary\n", info->name, info->help,
+                     info->name) != 0)
+    {
+        return -1;
+    }
+
+    size_t bucket = 0;
+    uint64_t seen = 0;
+
+    for (size_t q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++)
+    {
+        uint64_t rank = (uint64_t)(quantiles[q] * count + 0.5);
+        if (rank == 0)
+        {
+            rank = 1;
+        }
+
+        while (count > 0 && bucket < METRICS_BUCKETS && seen + merged[bucket] < rank)
+        {
+            seen += merged[bucket++];
+        }
+
+        double value = (count > 0) ? bucketHighest(bucket) * info->scale : 0;
+        if (appendFormat(out, "%s{quantile=\"%g\"} %.9g\n", info->name, quantiles[q], value) != 0)
+        {
+            return -1;
+        }
+    }
+
+    return appendFormat(out, "%s_sum %.9g\n%s_count %llu\n", info->name, sum * info->scale,
+                        info->name, (unsigned long long)count);
+}
+
+int metricsRender(Buffer *out)
+{
+    for (int counter = 0; counter < CounterCount; counter++)
+    {
+        if (renderCounter(out, counter) != 0)
+        {
+            return -1;
+        }
+    }
+
+    for (int histogram = 0; histogram < HistogramCount; histogram++)
+    {
+        if (renderHistogram(out, histogram) != 0)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}